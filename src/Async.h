@@ -9,6 +9,7 @@
 #include <future>
 #include <chrono>
 #include "Progress.h"
+#include "ThreadPool.h"
 
 
 template <typename T>
@@ -44,14 +45,30 @@ public:
 
 	}
 
+	/*!
+	 * Wait for any computation still in flight, since it may refer to state owned by the creator of this task
+	 */
+	~AsyncTask()
+	{
+		if (m_future.valid() && policy != std::launch::deferred)
+			ThreadPool::global().wait(m_future);
+	}
+
 	/*!
 	 * Start the computation (if it hasn't already been started)
+	 *
+	 * The computation is executed by the process-wide @ref ThreadPool
 	 */
 	void compute()
 	{
 		// start only if not done and not already started
 		if (!m_future.valid() && !m_ready)
-			m_future = std::async(policy, m_compute, std::ref(m_progress));
+		{
+			if (policy == std::launch::deferred)
+				m_future = std::async(policy, m_compute, std::ref(m_progress));
+			else
+				m_future = ThreadPool::global().async(std::bind(m_compute, std::ref(m_progress)));
+		}
 	}
 
 	/*!
@@ -65,6 +82,8 @@ public:
 		if (m_ready)
 			return m_value;
 
+		if (m_future.valid())
+			ThreadPool::global().wait(m_future);
 		m_value = m_future.valid() ? m_future.get() : m_compute(m_progress);
 
 		m_ready = true;
@@ -87,6 +106,23 @@ public:
 		m_progress.resetProgress(p);
 	}
 
+	/*!
+	 * Request that the computation stops as soon as possible.
+	 *
+	 * Cancellation is cooperative: the computation bails out the next time it reports progress,
+	 * after which @ref get throws a @ref CanceledError. Tasks without progress reporting run to completion.
+	 */
+	void cancel()
+	{
+		m_progress.cancel();
+	}
+
+	//! @return true if @ref cancel has been called on a task that reports its progress
+	bool canceled() const
+	{
+		return m_progress.canceled();
+	}
+
 	/*!
 	 * @return true if the computation has finished
 	 */
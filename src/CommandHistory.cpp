@@ -0,0 +1,551 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "CommandHistory.h"
+#include <algorithm>             // for min, max, sort, remove_if
+#include <cstdio>                // for FILE, tmpfile, fread, fwrite
+#include <cstring>               // for memcmp, memcpy
+#include <stdexcept>             // for runtime_error
+#include <unordered_map>         // for unordered_multimap
+#include <zlib.h>                // for compress2, uncompress
+#include "ParallelFor.h"         // for parallel_for
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using namespace Eigen;
+
+
+/*!
+ * A temporary file that holds the undo data spilled to disk.
+ *
+ * The file is deleted by the OS when it is closed, i.e. once no entry refers to it anymore.
+ * Space is not reused, so the file only shrinks when the history is discarded.
+ */
+class SpillFile
+{
+public:
+    SpillFile() : m_file(tmpfile())
+    {
+        if (!m_file)
+            throw runtime_error("Could not create a temporary file for the undo history");
+    }
+    ~SpillFile() {fclose(m_file);}
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile & operator=(const SpillFile &) = delete;
+
+    //! Append \a data to the file, and return its offset
+    uint64_t append(const vector<uint8_t> & data)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        seek(m_size);
+        if (fwrite(data.data(), 1, data.size(), m_file) != data.size())
+            throw runtime_error("Could not write the undo history to disk");
+
+        uint64_t offset = m_size;
+        m_size += data.size();
+        return offset;
+    }
+
+    void read(uint64_t offset, vector<uint8_t> & data)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        seek(offset);
+        if (fread(data.data(), 1, data.size(), m_file) != data.size())
+            throw runtime_error("Could not read the undo history from disk");
+    }
+
+private:
+    void seek(uint64_t offset)
+    {
+#if defined(_WIN32)
+        int failed = _fseeki64(m_file, int64_t(offset), SEEK_SET);
+#else
+        int failed = fseeko(m_file, off_t(offset), SEEK_SET);
+#endif
+        if (failed)
+            throw runtime_error("Could not seek in the undo history file");
+    }
+
+    mutex m_mutex;
+    FILE * m_file;
+    uint64_t m_size = 0;
+};
+
+
+// local functions
+namespace
+{
+
+// the pixel data is compressed in independent chunks of this many bytes, in parallel
+const size_t compressionChunk = size_t(1) << 22;
+
+/*
+ * Reorder the bytes of n RGBA pixels into 16 planes (one for each byte of each channel) and delta
+ * encode them. Neighboring pixels usually share their high bytes, which then compress to almost nothing.
+ */
+void shufflePixels(const uint8_t * src, uint8_t * dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        for (int b = 0; b < 16; ++b)
+            dst[b * n + i] = src[16 * i + b];
+
+    uint8_t previous = 0;
+    for (size_t i = 0; i < 16 * n; ++i)
+    {
+        uint8_t v = dst[i];
+        dst[i] = uint8_t(v - previous);
+        previous = v;
+    }
+}
+
+// the inverse of shufflePixels; this modifies src
+void unshufflePixels(uint8_t * src, uint8_t * dst, size_t n)
+{
+    for (size_t i = 1; i < 16 * n; ++i)
+        src[i] = uint8_t(src[i] + src[i - 1]);
+
+    for (size_t i = 0; i < n; ++i)
+        for (int b = 0; b < 16; ++b)
+            dst[16 * i + b] = src[b * n + i];
+}
+
+// compressed data consists of the compressed chunks, each preceded by its size as a uint32_t
+vector<uint8_t> compressPixels(const HDRImage & img)
+{
+    const uint8_t * src = (const uint8_t *) img.data();
+    size_t total = img.size() * sizeof(Color4);
+    int numChunks = int((total + compressionChunk - 1) / compressionChunk);
+
+    vector<vector<uint8_t>> chunks(numChunks);
+    parallel_for(0, numChunks, [&](int c)
+    {
+        size_t begin = c * compressionChunk, size = min(compressionChunk, total - begin);
+        vector<uint8_t> planes(size);
+        shufflePixels(src + begin, planes.data(), size / sizeof(Color4));
+
+        uLongf compressedSize = compressBound(uLong(size));
+        chunks[c].resize(sizeof(uint32_t) + compressedSize);
+        if (compress2(&chunks[c][sizeof(uint32_t)], &compressedSize, planes.data(), uLong(size), Z_BEST_SPEED) != Z_OK)
+            throw runtime_error("Could not compress undo data");
+
+        uint32_t header = uint32_t(compressedSize);
+        memcpy(chunks[c].data(), &header, sizeof(uint32_t));
+        chunks[c].resize(sizeof(uint32_t) + compressedSize);
+    });
+
+    size_t compressedTotal = 0;
+    for (const auto & chunk : chunks)
+        compressedTotal += chunk.size();
+
+    vector<uint8_t> compressed;
+    compressed.reserve(compressedTotal);
+    for (const auto & chunk : chunks)
+        compressed.insert(compressed.end(), chunk.begin(), chunk.end());
+    return compressed;
+}
+
+void decompressPixels(const vector<uint8_t> & compressed, HDRImage & img, AtomicProgress & progress)
+{
+    uint8_t * dst = (uint8_t *) img.data();
+    size_t total = img.size() * sizeof(Color4);
+    int numChunks = int((total + compressionChunk - 1) / compressionChunk);
+
+    // find where each chunk starts
+    vector<size_t> offsets(numChunks);
+    for (size_t c = 0, offset = 0; c < offsets.size(); ++c)
+    {
+        uint32_t size;
+        memcpy(&size, &compressed[offset], sizeof(uint32_t));
+        offsets[c] = offset;
+        offset += sizeof(uint32_t) + size;
+    }
+
+    progress.setNumSteps(numChunks);
+    parallel_for(0, numChunks, [&](int c)
+    {
+        size_t begin = c * compressionChunk, size = min(compressionChunk, total - begin);
+        uint32_t compressedSize;
+        memcpy(&compressedSize, &compressed[offsets[c]], sizeof(uint32_t));
+
+        vector<uint8_t> planes(size);
+        uLongf planesSize = uLongf(size);
+        if (uncompress(planes.data(), &planesSize, &compressed[offsets[c] + sizeof(uint32_t)], compressedSize) != Z_OK ||
+            planesSize != size)
+            throw runtime_error("Corrupt undo data");
+
+        unshufflePixels(planes.data(), dst + begin, size / sizeof(Color4));
+        ++progress;
+    });
+}
+
+struct TileRect
+{
+    int x, y, w, h;
+};
+
+TileRect tileRect(int index, int numTilesX, int width, int height)
+{
+    int x = (index % numTilesX) * TileDeltaUndo::tileSize;
+    int y = (index / numTilesX) * TileDeltaUndo::tileSize;
+    return {x, y, min(TileDeltaUndo::tileSize, width - x), min(TileDeltaUndo::tileSize, height - y)};
+}
+
+// compares the w x h block of a at (ax, ay) with the one of b at (bx, by), bit by bit
+bool sameBlock(const HDRImage & a, int ax, int ay, const HDRImage & b, int bx, int by, int w, int h)
+{
+    if (bx < 0 || by < 0 || bx + w > b.width() || by + h > b.height())
+        return false;
+
+    for (int j = 0; j < h; ++j)
+        if (memcmp(&a(ax, ay + j), &b(bx, by + j), w * sizeof(Color4)) != 0)
+            return false;
+    return true;
+}
+
+// 64-bit FNV-1a style hash of the bits of a block, one 32-bit word at a time
+uint64_t hashBlock(const HDRImage & img, const TileRect & r)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (int j = 0; j < r.h; ++j)
+    {
+        const uint32_t * words = (const uint32_t *) &img(r.x, r.y + j);
+        for (int i = 0; i < 4 * r.w; ++i)
+            h = (h ^ words[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+} // namespace
+
+
+shared_ptr<HDRImage> PackedPixels::pixels(AtomicProgress progress)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_pixels)
+        return m_pixels;
+
+    // keep the copy on disk, if any, so that spilling these pixels again is free
+    vector<uint8_t> fromDisk;
+    if (m_compressed.empty())
+    {
+        fromDisk.resize(m_fileSize);
+        m_file->read(m_fileOffset, fromDisk);
+    }
+
+    auto pixels = make_shared<HDRImage>(m_width, m_height);
+    decompressPixels(m_compressed.empty() ? fromDisk : m_compressed, *pixels, progress);
+    m_pixels = pixels;
+    vector<uint8_t>().swap(m_compressed);
+    updateBytes();
+    return m_pixels;
+}
+
+void PackedPixels::compress()
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_pixels)
+        return;
+
+    if (!m_file && m_compressed.empty())
+        m_compressed = compressPixels(*m_pixels);
+    m_pixels = nullptr;
+    updateBytes();
+}
+
+void PackedPixels::spill(const shared_ptr<SpillFile> & file)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_file)
+    {
+        if (m_compressed.empty())
+            m_compressed = compressPixels(*m_pixels);
+
+        m_fileOffset = file->append(m_compressed);
+        m_fileSize = m_compressed.size();
+        m_file = file;
+    }
+
+    m_pixels = nullptr;
+    vector<uint8_t>().swap(m_compressed);
+    updateBytes();
+}
+
+void PackedPixels::updateBytes()
+{
+    m_bytes = (m_pixels ? m_pixels->size() * sizeof(Color4) : 0) + m_compressed.size();
+}
+
+
+TileDeltaUndo::TileDeltaUndo(const HDRImage & before, const HDRImage & after, const Vector2i & offset)
+{
+    encode(before, after, offset);
+}
+
+void TileDeltaUndo::encode(const HDRImage & other, const HDRImage & current, const Vector2i & offset)
+{
+    m_width = other.width();
+    m_height = other.height();
+    m_offset = offset;
+    m_tiles.clear();
+
+    int numTilesX = (m_width + tileSize - 1) / tileSize;
+    int numTilesY = (m_height + tileSize - 1) / tileSize;
+    int numTiles = numTilesX * numTilesY;
+
+    // find the tiles that changed, and hash them so we can find duplicates
+    vector<uint64_t> hashes(numTiles);
+    m_tileIndex.assign(numTiles, -1);
+    parallel_for(0, numTiles, [&](int t)
+    {
+        TileRect r = tileRect(t, numTilesX, m_width, m_height);
+        if (!sameBlock(other, r.x, r.y, current, r.x + offset.x(), r.y + offset.y(), r.w, r.h))
+        {
+            m_tileIndex[t] = 0;
+            hashes[t] = hashBlock(other, r);
+        }
+    });
+
+    // assign each changed tile a slot, sharing the slot of an identical earlier tile
+    vector<int> firstTile;
+    unordered_multimap<uint64_t, int> slotsByHash;
+    for (int t = 0; t < numTiles; ++t)
+    {
+        if (m_tileIndex[t] < 0)
+            continue;
+
+        TileRect r = tileRect(t, numTilesX, m_width, m_height);
+        int slot = -1;
+        auto range = slotsByHash.equal_range(hashes[t]);
+        for (auto it = range.first; it != range.second && slot < 0; ++it)
+        {
+            TileRect s = tileRect(firstTile[it->second], numTilesX, m_width, m_height);
+            if (s.w == r.w && s.h == r.h && sameBlock(other, r.x, r.y, other, s.x, s.y, r.w, r.h))
+                slot = it->second;
+        }
+
+        if (slot < 0)
+        {
+            slot = int(firstTile.size());
+            firstTile.push_back(t);
+            slotsByHash.emplace(hashes[t], slot);
+        }
+        m_tileIndex[t] = slot;
+    }
+
+    // copy out the distinct tiles
+    m_tiles.resize(firstTile.size());
+    parallel_for(0, int(firstTile.size()), [&](int slot)
+    {
+        TileRect r = tileRect(firstTile[slot], numTilesX, m_width, m_height);
+        m_tiles[slot] = make_shared<PackedPixels>(make_shared<HDRImage>(other.block(r.x, r.y, r.w, r.h)));
+    });
+}
+
+HDRImage TileDeltaUndo::decode(const HDRImage & current) const
+{
+    HDRImage result(m_width, m_height);
+    int numTilesX = (m_width + tileSize - 1) / tileSize;
+    parallel_for(0, int(m_tileIndex.size()), [&](int t)
+    {
+        TileRect r = tileRect(t, numTilesX, m_width, m_height);
+        if (m_tileIndex[t] < 0)
+            result.block(r.x, r.y, r.w, r.h) = current.block(r.x + m_offset.x(), r.y + m_offset.y(), r.w, r.h);
+        else
+            result.block(r.x, r.y, r.w, r.h) = *m_tiles[m_tileIndex[t]]->pixels();
+    });
+    return result;
+}
+
+void TileDeltaUndo::swap(shared_ptr<HDRImage> & img)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto other = make_shared<HDRImage>(decode(*img));
+    // from the other side, the current image is at the opposite offset
+    encode(*img, *other, -m_offset);
+    img = other;
+}
+
+void TileDeltaUndo::collectMemory(MemoryBlocks & blocks) const
+{
+    lock_guard<mutex> lock(m_mutex);
+    for (const auto & tile : m_tiles)
+        blocks[tile.get()] = tile->bytes();
+}
+
+size_t TileDeltaUndo::bytes() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    size_t total = 0;
+    for (const auto & tile : m_tiles)
+        total += tile->bytes();
+    return total;
+}
+
+// the tiles are immutable, so the methods below work on them without holding up the rest of this entry
+
+void TileDeltaUndo::compress() const
+{
+    for (const auto & tile : tiles())
+        tile->compress();
+}
+
+void TileDeltaUndo::spill(const shared_ptr<SpillFile> & file) const
+{
+    for (const auto & tile : tiles())
+        tile->spill(file);
+}
+
+void TileDeltaUndo::unpack(AtomicProgress progress) const
+{
+    auto t = tiles();
+    progress.setNumSteps(int(t.size()));
+    parallel_for(0, int(t.size()), [&t,&progress](int i)
+    {
+        t[i]->pixels();
+        ++progress;
+    });
+}
+
+vector<shared_ptr<PackedPixels>> TileDeltaUndo::tiles() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_tiles;
+}
+
+
+UndoPtr createUndo(const HDRImage & before, const HDRImage & after, const Vector2i & offset)
+{
+    auto delta = make_shared<TileDeltaUndo>(before, after, offset);
+
+    // a half-float snapshot is smaller than a delta covering more than half of the image
+    size_t halfBytes = before.size() * sizeof(Color4) / 2;
+    if (delta->bytes() > halfBytes && HalfImage::isExactlyRepresentable(before))
+        return make_shared<FullImageUndo>(before);
+
+    return delta;
+}
+
+
+size_t CommandHistory::memoryUsage() const
+{
+    MemoryBlocks blocks;
+    for (const auto & cmd : m_history)
+        cmd->collectMemory(blocks);
+
+    size_t total = 0;
+    for (const auto & b : blocks)
+        total += b.second;
+    return total;
+}
+
+void CommandHistory::enforceMemoryBudget()
+{
+    int dropped = 0;
+    // never drop the current state's command, so the most recent edit can always be undone
+    while (m_currentState > 1 && memoryUsage() > m_memoryBudget)
+    {
+        m_history.erase(m_history.begin());
+        m_currentState--;
+        // once the saved state is dropped, we can no longer return to it
+        m_savedState = m_savedState > 0 ? m_savedState - 1 : -1;
+        dropped++;
+    }
+
+    if (dropped)
+        spdlog::get("console")->debug("Dropped the {} oldest undo entries to stay within the undo memory budget of {} MB.",
+                                      dropped, m_memoryBudget >> 20);
+}
+
+void CommandHistory::packColdEntries()
+{
+    // forget about finished work
+    m_packingTasks.erase(remove_if(m_packingTasks.begin(), m_packingTasks.end(),
+                                   [](const shared_ptr<AsyncTask<bool>> & task) {return task->ready();}),
+                         m_packingTasks.end());
+
+    // undo and redo need the entries right next to the current state; the others are cold,
+    // and we spill the ones farthest away from the current state first
+    vector<pair<int, UndoPtr>> byDistance;
+    for (int i = 0; i < size(); ++i)
+        if (i < m_currentState - 1 || i > m_currentState)
+            byDistance.emplace_back(i < m_currentState ? m_currentState - 1 - i : i - m_currentState, m_history[i]);
+    if (byDistance.empty())
+        return;
+
+    sort(byDistance.begin(), byDistance.end(),
+         [](const pair<int, UndoPtr> & a, const pair<int, UndoPtr> & b) {return a.first > b.first;});
+    vector<UndoPtr> cold;
+    for (const auto & entry : byDistance)
+        cold.push_back(entry.second);
+
+    if (!m_spillFile)
+    {
+        try
+        {
+            m_spillFile = make_shared<SpillFile>();
+        }
+        catch (const exception & e)
+        {
+            spdlog::get("console")->warn("{}; the undo history will stay in memory.", e.what());
+        }
+    }
+
+    auto file = m_spillFile;
+    size_t threshold = m_spillThreshold;
+    auto task = make_shared<AsyncTask<bool>>([cold,file,threshold](void)
+    {
+        try
+        {
+            for (const auto & cmd : cold)
+                cmd->compress();
+
+            if (!file)
+                return true;
+
+            MemoryBlocks blocks;
+            for (const auto & cmd : cold)
+                cmd->collectMemory(blocks);
+            size_t inMemory = 0;
+            for (const auto & b : blocks)
+                inMemory += b.second;
+
+            for (const auto & cmd : cold)
+            {
+                if (inMemory <= threshold)
+                    break;
+
+                MemoryBlocks before, after;
+                cmd->collectMemory(before);
+                cmd->spill(file);
+                cmd->collectMemory(after);
+                for (const auto & b : before)
+                    inMemory -= b.second - after[b.first];
+            }
+            return true;
+        }
+        catch (const exception & e)
+        {
+            // the entries are still intact, just not (all) packed
+            spdlog::get("console")->warn("Could not pack the undo history: {}", e.what());
+            return false;
+        }
+    });
+    task->compute();
+    m_packingTasks.push_back(task);
+}
+
+size_t & CommandHistory::defaultBudget()
+{
+    static size_t budget = size_t(4) << 30;
+    return budget;
+}
+
+size_t & CommandHistory::defaultSpill()
+{
+    static size_t threshold = size_t(1) << 30;
+    return threshold;
+}
@@ -8,10 +8,62 @@
 
 #include <cstdint>             // for uint32_t
 #include <Eigen/Core>          // for Vector2i, Matrix4f, Vector3f
+#include <atomic>              // for atomic
+#include <map>                 // for map
+#include <mutex>               // for mutex, lock_guard
 #include <vector>              // for vector, allocator
+#include "Async.h"             // for AsyncTask
 #include "HDRImage.h"          // for HDRImage
+#include "HalfImage.h"         // for HalfImage
+#include "PixelPipeline.h"     // for PixelPipeline
 #include "Fwd.h"               // for HDRImage
 
+//! The memory held by undo entries: the size in bytes of each distinct allocation
+using MemoryBlocks = std::map<const void *, size_t>;
+
+class SpillFile;
+
+/*!
+ * Pixel data of an undo entry, which can be compressed and moved to disk while it is not needed
+ *
+ * Compression is lossless: the floats are split into byte planes, which are delta encoded and
+ * then deflated with zlib, much like the ZIP codec of OpenEXR. The pixels are restored on demand.
+ * All methods are thread-safe, so that entries can be packed in the background.
+ */
+class PackedPixels
+{
+public:
+    explicit PackedPixels(std::shared_ptr<HDRImage> pixels) :
+        m_pixels(std::move(pixels)), m_width(m_pixels->width()), m_height(m_pixels->height()),
+        m_bytes(m_pixels->size() * sizeof(Color4)) {}
+
+    //! The pixels, decompressed or read back from disk if needed
+    std::shared_ptr<HDRImage> pixels(AtomicProgress progress = AtomicProgress());
+
+    //! Compress the pixels, unless they already are
+    void compress();
+
+    //! Move the compressed pixels to \a file, unless they are already on disk
+    void spill(const std::shared_ptr<SpillFile> & file);
+
+    //! The number of bytes held in memory. This does not wait for any ongoing (de)compression.
+    size_t bytes() const            {return m_bytes;}
+
+private:
+    void updateBytes();
+
+    std::mutex m_mutex;
+
+    // the pixels are in at least one of these places
+    std::shared_ptr<HDRImage> m_pixels;
+    std::vector<uint8_t> m_compressed;
+    std::shared_ptr<SpillFile> m_file;
+    uint64_t m_fileOffset = 0, m_fileSize = 0;
+
+    int m_width, m_height;
+    std::atomic<size_t> m_bytes;
+};
+
 //! Generic image manipulation undo class
 class ImageCommandUndo
 {
@@ -20,6 +72,22 @@ public:
 
     virtual void undo(std::shared_ptr<HDRImage> & img) = 0;
     virtual void redo(std::shared_ptr<HDRImage> & img) = 0;
+
+    /*!
+     * Add the allocations this entry keeps alive to \a blocks.
+     *
+     * Storage that is shared between entries is keyed by the same address, so it is only counted once.
+     */
+    virtual void collectMemory(MemoryBlocks & blocks) const {}
+
+    //@{ \name Cold storage. These can be called from any thread, and do not change what the entry restores.
+    //! Compress the stored pixels, as they will likely not be needed for a while
+    virtual void compress() const {}
+    //! Move the compressed pixels to \a file
+    virtual void spill(const std::shared_ptr<SpillFile> & file) const {}
+    //! Bring all stored pixels back into memory, ahead of an undo or redo
+    virtual void unpack(AtomicProgress progress) const {}
+    //@}
 };
 
 using UndoPtr = std::shared_ptr<ImageCommandUndo>;
@@ -27,24 +95,150 @@ using ImageCommandResult = std::pair<std::shared_ptr<HDRImage>, UndoPtr>;
 
 using ImageCommand = std::function<ImageCommandResult(const std::shared_ptr<const HDRImage> &)>;
 using ImageCommandWithProgress = std::function<ImageCommandResult(const std::shared_ptr<const HDRImage> &, AtomicProgress &)>;
+//! A command that modifies the pixels of an image in place, and returns its undo, which it needs to create before changing any pixels
+using ImageInPlaceCommand = std::function<UndoPtr(HDRImage &, AtomicProgress &)>;
 
 
-//! Brute-force undo: Saves the entire image data so that we can copy it back
+/*!
+ * Brute-force undo: Saves the entire image data so that we can copy it back
+ *
+ * Snapshots that are exactly representable using half floats (e.g. unmodified images
+ * loaded from half-float EXR files) are stored as a HalfImage, using half the memory.
+ */
 class FullImageUndo : public ImageCommandUndo
 {
 public:
-    explicit FullImageUndo(const HDRImage & img) : m_undoImage(std::make_shared<HDRImage>(img)) {}
+    explicit FullImageUndo(const HDRImage & img)
+    {
+        if (HalfImage::isExactlyRepresentable(img))
+            m_halfImage = std::make_shared<HalfImage>(img);
+        else
+            m_undoImage = std::make_shared<PackedPixels>(std::make_shared<HDRImage>(img));
+    }
     ~FullImageUndo() override = default;
 
-    void undo(std::shared_ptr<HDRImage> & img) override {img.swap(m_undoImage);}
+    void undo(std::shared_ptr<HDRImage> & img) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::shared_ptr<HDRImage> previous = storedImage();
+        store(img);
+        img = previous;
+    }
     void redo(std::shared_ptr<HDRImage> & img) override {undo(img);}
 
-	const std::shared_ptr<HDRImage> image() const {return m_undoImage;}
+    void collectMemory(MemoryBlocks & blocks) const override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_halfImage)
+            blocks[m_halfImage.get()] = m_halfImage->bytes();
+        else
+            blocks[m_undoImage.get()] = m_undoImage->bytes();
+    }
+
+    void compress() const override                                      {if (auto p = packed()) p->compress();}
+    void spill(const std::shared_ptr<SpillFile> & file) const override  {if (auto p = packed()) p->spill(file);}
+    void unpack(AtomicProgress progress) const override                 {if (auto p = packed()) p->pixels(progress);}
+
+	const std::shared_ptr<HDRImage> image() const
+	{
+        std::lock_guard<std::mutex> lock(m_mutex);
+		return storedImage();
+	}
 
 private:
-    std::shared_ptr<HDRImage> m_undoImage;
+    std::shared_ptr<HDRImage> storedImage() const
+    {
+        return m_halfImage ? std::make_shared<HDRImage>(m_halfImage->decoded()) : m_undoImage->pixels();
+    }
+
+    std::shared_ptr<PackedPixels> packed() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_undoImage;
+    }
+
+    void store(const std::shared_ptr<HDRImage> & img)
+    {
+        if (HalfImage::isExactlyRepresentable(*img))
+        {
+            m_halfImage = std::make_shared<HalfImage>(*img);
+            m_undoImage = nullptr;
+        }
+        else
+        {
+            m_halfImage = nullptr;
+            m_undoImage = std::make_shared<PackedPixels>(img);
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    std::shared_ptr<PackedPixels> m_undoImage;
+    std::shared_ptr<HalfImage> m_halfImage;
 };
 
+/*!
+ * Undo that only stores the tiles of the image that an edit changed
+ *
+ * The entry describes the image on the other side of the edit relative to the current image:
+ * each tile of the other image is either found unchanged in the current image (possibly at an
+ * offset, for edits that move pixels around), or stored. Undo and redo both rebuild the other
+ * image and then re-encode the current one relative to it, so the entry always costs memory in
+ * proportion to the area the edit touched. Identical tiles, such as the uniform background
+ * added by a canvas resize, are stored only once.
+ */
+class TileDeltaUndo : public ImageCommandUndo
+{
+public:
+    /*!
+     * @param before    The image before the edit
+     * @param after     The image after the edit
+     * @param offset    Where pixel (0,0) of \a before ended up in \a after, if the edit moved pixels.
+     *                  This is only a hint: tiles are always compared, so a wrong offset costs memory, not correctness.
+     */
+    TileDeltaUndo(const HDRImage & before, const HDRImage & after,
+                  const Eigen::Vector2i & offset = Eigen::Vector2i(0, 0));
+    ~TileDeltaUndo() override = default;
+
+    void undo(std::shared_ptr<HDRImage> & img) override {swap(img);}
+    void redo(std::shared_ptr<HDRImage> & img) override {swap(img);}
+
+    void collectMemory(MemoryBlocks & blocks) const override;
+    void compress() const override;
+    void spill(const std::shared_ptr<SpillFile> & file) const override;
+    void unpack(AtomicProgress progress) const override;
+
+    //! The number of bytes of pixel data held in memory
+    size_t bytes() const;
+
+    static const int tileSize = 64;
+
+private:
+    void encode(const HDRImage & other, const HDRImage & current, const Eigen::Vector2i & offset);
+    HDRImage decode(const HDRImage & current) const;
+    void swap(std::shared_ptr<HDRImage> & img);
+    std::vector<std::shared_ptr<PackedPixels>> tiles() const;
+
+    // the size of the other image, and where its pixel (0,0) is in the current image
+    int m_width = 0, m_height = 0;
+    Eigen::Vector2i m_offset;
+
+    // for each tile of the other image, -1 if it is unchanged in the current image, or its index in m_tiles
+    std::vector<int> m_tileIndex;
+    std::vector<std::shared_ptr<PackedPixels>> m_tiles;
+
+    // guards the members above, since cold storage may work on this entry in the background
+    mutable std::mutex m_mutex;
+};
+
+/*!
+ * Create the cheapest lossless undo for an edit from \a before to \a after.
+ *
+ * This is a TileDeltaUndo, unless the edit changed most of the image and \a before can be stored
+ * at half precision by a FullImageUndo.
+ */
+UndoPtr createUndo(const HDRImage & before, const HDRImage & after,
+                   const Eigen::Vector2i & offset = Eigen::Vector2i(0, 0));
+
 //! Specify the undo and redo commands using lambda expressions
 class LambdaUndo : public ImageCommandUndo
 {
@@ -61,12 +255,58 @@ private:
     std::function<void(std::shared_ptr<HDRImage> & img)> m_undo, m_redo;
 };
 
+/*!
+ * Undo for a pointwise adjustment, which can share its snapshot with a run of preceding adjustments
+ *
+ * Instead of each adjustment saving a full copy of the image, consecutive pointwise adjustments
+ * all refer to the snapshot taken before the first one, and remember the adjustments made since.
+ * Undoing replays those adjustments on the snapshot in a single fused pass, and redoing re-applies
+ * just this adjustment. Both reproduce the original results exactly.
+ */
+class PointwiseUndo : public ImageCommandUndo
+{
+public:
+    /*!
+     * @param snapshot      The image before the first adjustment of the run
+     * @param before        The adjustments of the run that precede this one
+     * @param adjustment    This adjustment
+     */
+    PointwiseUndo(std::shared_ptr<const FullImageUndo> snapshot,
+                  const PixelPipeline & before, const PixelPipeline & adjustment) :
+        m_snapshot(std::move(snapshot)), m_before(before), m_adjustment(adjustment) {}
+    ~PointwiseUndo() override = default;
+
+    void undo(std::shared_ptr<HDRImage> & img) override
+    {
+        img = std::make_shared<HDRImage>(m_before.applied(*m_snapshot->image()));
+    }
+    void redo(std::shared_ptr<HDRImage> & img) override
+    {
+        img = std::make_shared<HDRImage>(m_adjustment.applied(*img));
+    }
+
+    void collectMemory(MemoryBlocks & blocks) const override                {m_snapshot->collectMemory(blocks);}
+    void compress() const override                                          {m_snapshot->compress();}
+    void spill(const std::shared_ptr<SpillFile> & file) const override      {m_snapshot->spill(file);}
+    void unpack(AtomicProgress progress) const override                     {m_snapshot->unpack(progress);}
+
+    const std::shared_ptr<const FullImageUndo> & snapshot() const {return m_snapshot;}
+
+    //! All adjustments of the run, up to and including this one
+    PixelPipeline adjustments() const {return PixelPipeline(m_before).then(m_adjustment);}
+
+private:
+    std::shared_ptr<const FullImageUndo> m_snapshot;
+    PixelPipeline m_before, m_adjustment;
+};
+
 //! Stores and manages an undo history list for image modifications
 class CommandHistory
 {
 public:
     CommandHistory() :
-        m_currentState(0), m_savedState(0)
+        m_currentState(0), m_savedState(0),
+        m_memoryBudget(defaultMemoryBudget()), m_spillThreshold(defaultSpillThreshold())
     {
         // empty
     }
@@ -85,6 +325,11 @@ public:
     bool hasUndo() const        {return m_currentState > 0;}
     bool hasRedo() const        {return m_currentState < size();}
 
+    //! The command that produced the current state, or nullptr if there is nothing to undo
+    UndoPtr currentCommand() const {return hasUndo() ? m_history[m_currentState - 1] : nullptr;}
+    //! The command that the next redo would apply, or nullptr if there is nothing to redo
+    UndoPtr nextCommand() const    {return hasRedo() ? m_history[m_currentState] : nullptr;}
+
     void addCommand(UndoPtr cmd)
     {
         // deletes all history newer than the current state
@@ -93,8 +338,40 @@ public:
         // add the new command and increment state
         m_history.push_back(std::move(cmd));
         m_currentState++;
+
+        enforceMemoryBudget();
+        packColdEntries();
     }
 
+    //! The memory held by all entries, in bytes
+    size_t memoryUsage() const;
+
+    /*!
+     * Limit the memory held by the history to \a bytes.
+     *
+     * When a new command exceeds the budget, the oldest entries are dropped, but the most recent
+     * one is always kept.
+     */
+    void setMemoryBudget(size_t bytes)      {m_memoryBudget = bytes; enforceMemoryBudget();}
+    size_t memoryBudget() const             {return m_memoryBudget;}
+
+    //! The memory budget of newly created histories
+    static size_t defaultMemoryBudget()     {return defaultBudget();}
+    static void setDefaultMemoryBudget(size_t bytes) {defaultBudget() = bytes;}
+
+    /*!
+     * Keep at most \a bytes of the entries away from the current state in memory, and spill the rest to disk.
+     *
+     * Entries more than one step away from the current state are compressed in the background. If
+     * they still take up more than \a bytes, the ones farthest away are moved to a temporary file.
+     */
+    void setSpillThreshold(size_t bytes)    {m_spillThreshold = bytes; packColdEntries();}
+    size_t spillThreshold() const           {return m_spillThreshold;}
+
+    //! The spill threshold of newly created histories
+    static size_t defaultSpillThreshold()   {return defaultSpill();}
+    static void setDefaultSpillThreshold(size_t bytes) {defaultSpill() = bytes;}
+
     bool undo(std::shared_ptr<HDRImage> & img)
     {
         // check if there is anything to undo
@@ -102,6 +379,7 @@ public:
             return false;
 
         m_history[--m_currentState]->undo(img);
+        packColdEntries();
         return true;
     }
     bool redo(std::shared_ptr<HDRImage> & img)
@@ -111,10 +389,16 @@ public:
             return false;
 
         m_history[m_currentState++]->redo(img);
+        packColdEntries();
         return true;
     }
 
 private:
+    void enforceMemoryBudget();
+    void packColdEntries();
+    static size_t & defaultBudget();
+    static size_t & defaultSpill();
+
     std::vector<UndoPtr> m_history;
 
     // it is best to think of this state as pointing in between the entries in the m_history vector
@@ -123,4 +407,8 @@ private:
     // m_currentState == size() indicates that there is nothing to redo
     int m_currentState;
     int m_savedState;
+    size_t m_memoryBudget, m_spillThreshold;
+
+    std::shared_ptr<SpillFile> m_spillFile;
+    std::vector<std::shared_ptr<AsyncTask<bool>>> m_packingTasks;
 };
\ No newline at end of file
@@ -11,10 +11,14 @@
 #include "HDRImage.h"
 #include "ImageListPanel.h"
 #include "EnvMap.h"
+#include "ImagePyramid.h"
 #include "Colorspace.h"
 #include "HSLGradient.h"
 #include "MultiGraph.h"
 #include "FilmicToneCurve.h"
+#include "PixelPipeline.h"
+#include "WarpMap.h"
+#include <mutex>
 #include <spdlog/spdlog.h>
 #include <Eigen/Geometry>
 
@@ -106,12 +110,7 @@ Button * createColorSpaceButton(Widget *parent, HDRViewScreen * screen, ImageLis
 			addOKCancelButtons(gui, window,
 				[&]()
 				{
-					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-						{
-							return {make_shared<HDRImage>(img->unaryExpr([](const Color4 & c){return c.convert(dst, src);}).eval()),
-							        nullptr};
-						});
+					imagesPanel->adjustImage(PixelPipeline().then(PixelPipeline::convertColorSpace(dst, src)));
 				});
 
 			window->center();
@@ -186,13 +185,8 @@ Button * createExposureGammaButton(Widget *parent, HDRViewScreen * screen, Image
 			addOKCancelButtons(gui, window,
 				[&]()
 				{
-					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-						{
-							spdlog::get("console")->debug("{}; {}; {}", exposure, offset, gamma);
-							return {make_shared<HDRImage>((Color4(pow(2.0f, exposure), 1.f) * (*img) + Color4(offset, 0.f)).pow(Color4(1.0f/gamma))),
-							        nullptr};
-						});
+					spdlog::get("console")->debug("{}; {}; {}", exposure, offset, gamma);
+					imagesPanel->adjustImage(PixelPipeline().then(PixelPipeline::exposureGamma(exposure, offset, gamma)));
 				});
 
 			window->center();
@@ -309,12 +303,8 @@ Button * createBrightnessContrastButton(Widget *parent, HDRViewScreen * screen,
 			addOKCancelButtons(gui, window,
                [&]()
                {
-	               imagesPanel->modifyImage(
-		               [&](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
-		               {
-			               return {make_shared<HDRImage>(img->brightnessContrast(brightness, contrast, linear, channelMap[channel])),
-			                       nullptr};
-		               });
+	               imagesPanel->adjustImage(PixelPipeline().then(
+		               PixelPipeline::brightnessContrast(brightness, contrast, linear, channelMap[channel])));
                });
 
 			window->center();
@@ -427,11 +417,10 @@ Button * createFilmicTonemappingButton(Widget *parent, HDRViewScreen * screen, I
 			addOKCancelButtons(gui, window,
 				[&]()
 				{
-				   imagesPanel->modifyImage(
-				       [&](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
-				       {
-				           return {make_shared<HDRImage>(img->unaryExpr(
-				               [](const Color4 & c)
+				   // the curve can be edited again while the adjustment is applied, so use a copy
+				   FilmicToneCurve::FullCurve curve = fCurve;
+				   imagesPanel->adjustImage(PixelPipeline().thenMap(
+				               [curve](const Color4 & c)
 				               {
 //					               float srcLum = c.average();
 //					               float dstLum = fCurve.eval(srcLum);
@@ -440,12 +429,11 @@ Button * createFilmicTonemappingButton(Widget *parent, HDRViewScreen * screen, I
 //					                             c.g * (dstLum/srcLum),
 //					                             c.b * (dstLum/srcLum),
 //					                             c.a);
-				                   return Color4(fCurve.eval(c.r),
-				                                 fCurve.eval(c.g),
-				                                 fCurve.eval(c.b),
+				                   return Color4(curve.eval(c.r),
+				                                 curve.eval(c.g),
+				                                 curve.eval(c.b),
 				                                 c.a);
-				               }).eval()), nullptr};
-				       });
+				               }));
 				});
 
 			window->center();
@@ -514,16 +502,8 @@ Button * createHueSaturationButton(Widget *parent, HDRViewScreen * screen, Image
 			addOKCancelButtons(gui, window,
 			                   [&]()
 			                   {
-				                   imagesPanel->modifyImage(
-					                   [&](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
-					                   {
-						                   return {make_shared<HDRImage>(
-							                   img->unaryExpr(
-								                   [](const Color4 & c)
-								                   {
-									                   return c.HSLAdjust(hue, (saturation+100.f)/100.f, (lightness)/100.f);
-								                   }).eval()), nullptr};
-					                   });
+				                   imagesPanel->adjustImage(PixelPipeline().then(
+					                   PixelPipeline::hslAdjust(hue, (saturation+100.f)/100.f, (lightness)/100.f)));
 			                   });
 
 			window->center();
@@ -536,7 +516,12 @@ Button * createGaussianFilterButton(Widget *parent, HDRViewScreen * screen, Imag
 {
 	static float width = 1.0f, height = 1.0f;
 	static HDRImage::BorderMode borderModeX = HDRImage::EDGE, borderModeY = HDRImage::EDGE;
-	static bool exact = false;
+	static enum EMethod
+	{
+		EXACT = 0,
+		FAST,
+		RECURSIVE
+	} method = FAST;
 	static string name = "Gaussian blur...";
 	auto b = new Button(parent, name, ENTYPO_ICON_DROP);
 	b->setFixedHeight(21);
@@ -565,7 +550,8 @@ Button * createGaussianFilterButton(Widget *parent, HDRViewScreen * screen, Imag
 			gui->addVariable("Border mode Y:", borderModeY, true)
 			   ->setItems(HDRImage::borderModeNames());
 
-			gui->addVariable("Exact (slow!):", exact, true);
+			gui->addVariable("Method:", method, true)
+			   ->setItems({"Exact (slow!)", "Fast (box approximation)", "Fast (recursive)"});
 
 
 			addOKCancelButtons(gui, window,
@@ -574,9 +560,18 @@ Button * createGaussianFilterButton(Widget *parent, HDRViewScreen * screen, Imag
 					imagesPanel->modifyImage(
 						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(exact ? img->GaussianBlurred(width, height, progress, borderModeX, borderModeY) :
-							        img->fastGaussianBlurred(width, height, progress, borderModeX, borderModeY)),
-							        nullptr};
+							switch (method)
+							{
+								case EXACT:
+									return {make_shared<HDRImage>(img->GaussianBlurred(width, height, progress, borderModeX, borderModeY)),
+									        nullptr};
+								case RECURSIVE:
+									return {make_shared<HDRImage>(img->recursiveGaussianBlurred(width, height, progress, borderModeX, borderModeY)),
+									        nullptr};
+								default:
+									return {make_shared<HDRImage>(img->fastGaussianBlurred(width, height, progress, borderModeX, borderModeY)),
+									        nullptr};
+							}
 						});
 				});
 
@@ -637,6 +632,11 @@ Button * createBilateralFilterButton(Widget *parent, HDRViewScreen * screen, Ima
 {
 	static float rangeSigma = 1.0f, valueSigma = 0.1f;
 	static HDRImage::BorderMode borderModeX = HDRImage::EDGE, borderModeY = HDRImage::EDGE;
+	static enum EMethod
+	{
+		EXACT = 0,
+		GRID
+	} method = EXACT;
 	static string name = "Bilateral filter...";
 	auto b = new Button(parent, name, ENTYPO_ICON_DROP);
 	b->setFixedHeight(21);
@@ -649,24 +649,33 @@ Button * createBilateralFilterButton(Widget *parent, HDRViewScreen * screen, Ima
 			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
 //           window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
 
+			// both filters divide by the sigmas
 			auto w = gui->addVariable("Range sigma:", rangeSigma);
 			w->setSpinnable(true);
-			w->setMinValue(0.0f);
+			w->setMinValue(0.01f);
 			w = gui->addVariable("Value sigma:", valueSigma);
 			w->setSpinnable(true);
-			w->setMinValue(0.0f);
+			w->setMinValue(0.01f);
 
 			gui->addVariable("Border mode X:", borderModeX, true)
 			   ->setItems(HDRImage::borderModeNames());
 			gui->addVariable("Border mode Y:", borderModeY, true)
 			   ->setItems(HDRImage::borderModeNames());
 
+			// the bilateral grid compares log luminance, so its value sigma is in stops
+			gui->addVariable("Method:", method, true)
+			   ->setItems({"Exact (slow!)", "Fast (value sigma in stops)"});
+
 			addOKCancelButtons(gui, window,
 				[&]()
 				{
 					imagesPanel->modifyImage(
 						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
+							if (method == GRID)
+								return {make_shared<HDRImage>(img->bilateralGridFiltered(valueSigma, rangeSigma,
+								                              progress, borderModeX, borderModeY)),
+								        nullptr};
 							return {make_shared<HDRImage>(img->bilateralFiltered(valueSigma, rangeSigma,
 							                              progress, borderModeX, borderModeY)),
 							        nullptr};
@@ -728,6 +737,7 @@ Button * createUnsharpMaskFilterButton(Widget *parent, HDRViewScreen * screen, I
 Button * createMedianFilterButton(Widget *parent, HDRViewScreen * screen, ImageListPanel * imagesPanel)
 {
 	static float radius = 1.0f;
+	static bool roundWindow = false;
 	static HDRImage::BorderMode borderModeX = HDRImage::EDGE, borderModeY = HDRImage::EDGE;
 	static string name = "Median filter...";
 	auto b = new Button(parent, name, ENTYPO_ICON_DROP);
@@ -744,6 +754,7 @@ Button * createMedianFilterButton(Widget *parent, HDRViewScreen * screen, ImageL
 			auto w = gui->addVariable("Radius:", radius);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
+			gui->addVariable("Round window:", roundWindow, true);
 
 			gui->addVariable("Border mode X:", borderModeX, true)
 			   ->setItems(HDRImage::borderModeNames());
@@ -756,7 +767,7 @@ Button * createMedianFilterButton(Widget *parent, HDRViewScreen * screen, ImageL
 					imagesPanel->modifyImage(
 						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(img->medianFiltered(radius, progress, borderModeX, borderModeY)),
+							return {make_shared<HDRImage>(img->medianFiltered(radius, progress, borderModeX, borderModeY, roundWindow)),
 							        nullptr};
 						});
 				});
@@ -772,6 +783,7 @@ Button * createResizeButton(Widget *parent, HDRViewScreen * screen, ImageListPan
 	static int width = 128, height = 128;
 	static string name = "Resize...";
 	static bool aspect = true;
+	static HDRImage::ResizeFilter filter = HDRImage::MITCHELL_FILTER;
 	auto b = new Button(parent, name, ENTYPO_ICON_RESIZE_FULL_SCREEN);
 	b->setFixedHeight(21);
 	b->setCallback(
@@ -853,13 +865,16 @@ Button * createResizeButton(Widget *parent, HDRViewScreen * screen, ImageListPan
 
 			gui->addWidget("", row);
 
+			gui->addVariable("Filter:", filter, true)
+			   ->setItems(HDRImage::resizeFilterNames());
+
 			addOKCancelButtons(gui, window,
 				[&]()
 				{
 					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(img->resized(width, height)),
+							return {make_shared<HDRImage>(img->resized(width, height, filter, progress)),
 							        nullptr};
 						});
 				});
@@ -878,6 +893,13 @@ Button * createRemapButton(Widget *parent, HDRViewScreen *screen, ImageListPanel
 	static bool autoAspect = true;
 	static HDRImage::BorderMode borderModeX = HDRImage::EDGE, borderModeY = HDRImage::EDGE;
 	static int samples = 1;
+	static bool filtered = false;
+
+	// the lookups of the last remap, which make remapping more images of the same size (e.g. a set of
+	// light probes) a quick gather. Maps estimated to take more memory than this are not kept.
+	static shared_ptr<const WarpMap> warpMap;
+	static mutex warpMapMutex;
+	static const size_t maxWarpMapBytes = size_t(1) << 30;
 
 	static float autoAspects[] =
 		{
@@ -981,8 +1003,9 @@ Button * createRemapButton(Widget *parent, HDRViewScreen *screen, ImageListPanel
 			gui->refresh();
 
 
-			gui->addVariable("Sampler:", sampler, true)
-			   ->setItems(HDRImage::samplerNames());
+			auto samplerBox = gui->addVariable("Sampler:", sampler, true);
+			samplerBox->setItems(HDRImage::samplerNames());
+			samplerBox->setEnabled(!filtered);
 			gui->addVariable("Border mode X:", borderModeX, true)
 			   ->setItems(HDRImage::borderModeNames());
 			gui->addVariable("Border mode Y:", borderModeY, true)
@@ -991,6 +1014,17 @@ Button * createRemapButton(Widget *parent, HDRViewScreen *screen, ImageListPanel
 			w = gui->addVariable("Super-samples:", samples);
 			w->setSpinnable(true);
 			w->setMinValue(1);
+			w->setEnabled(!filtered);
+
+			// filtering each pixel's footprint from a mip-map replaces the sampler and super-sampling
+			auto filteredCheckbox = gui->addVariable("Mip-map filtering:", filtered, true);
+			filteredCheckbox->setCallback(
+				[w,samplerBox](bool f)
+				{
+					filtered = f;
+					w->setEnabled(!f);
+					samplerBox->setEnabled(!f);
+				});
 
 			addOKCancelButtons(gui, window,
 				[&]()
@@ -999,13 +1033,54 @@ Button * createRemapButton(Widget *parent, HDRViewScreen *screen, ImageListPanel
 //					auto xyz2src = XYZToEnvMapUV(from);
 //					auto warp = [dst2xyz,xyz2src](const Vector2f &uv) { return xyz2src(dst2xyz(uv)); };
 					auto warp = [](const Vector2f &uv) { return convertEnvMappingUV(from, to, uv); };
+					auto cached = filtered ? imagesPanel->currentImage()->pyramid() : GLImage::LazyPyramid();
 
 					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
+						[&,warp,cached](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(img->resampled(width, height, progress, warp, samples, sampler,
-							                                            borderModeX, borderModeY)),
-							        nullptr};
+							if (filtered)
+							{
+								// reuse the image's own pyramid, unless the image changed since it was requested
+								shared_ptr<const ImagePyramid> levels;
+								if (cached.valid())
+								{
+									ThreadPool::global().wait(cached);
+									levels = cached.get();
+								}
+								ImagePyramid pyramid = levels && &levels->level(0) == img.get() ?
+									ImagePyramid(*levels, borderModeX, borderModeY) :
+									ImagePyramid(img, borderModeX, borderModeY, AtomicProgress(progress, 0.1f));
+								return {make_shared<HDRImage>(pyramid.warped(width, height, warp, AtomicProgress(progress, 0.9f))),
+								        nullptr};
+							}
+
+							Vector2i srcSize(img->width(), img->height()), dstSize(width, height);
+							string description = fmt::format("{:d},{:d},{:d},{:d},{:d},{:d}", int(from), int(to), samples,
+							                                 int(sampler), int(borderModeX), int(borderModeY));
+
+							shared_ptr<const WarpMap> map;
+							{
+								lock_guard<mutex> lock(warpMapMutex);
+								map = warpMap;
+							}
+							if (map && map->matches(srcSize, dstSize, description))
+								return {make_shared<HDRImage>(map->applied(*img, progress)), nullptr};
+
+							// roughly the number of source pixels the sub-samples of an output pixel read
+							int footprint = samples + (sampler == HDRImage::BICUBIC ? 3 : sampler == HDRImage::BILINEAR ? 1 : 0);
+							size_t estimatedBytes = size_t(width) * height * (sizeof(uint64_t) + footprint * footprint * sizeof(WarpMap::Tap));
+							if (estimatedBytes > maxWarpMapBytes)
+								return {make_shared<HDRImage>(img->resampled(width, height, progress, warp, samples, sampler,
+								                                            borderModeX, borderModeY)),
+								        nullptr};
+
+							map = make_shared<WarpMap>(srcSize, dstSize, description, warp, samples, sampler,
+							                           borderModeX, borderModeY, AtomicProgress(progress, 0.9f));
+							{
+								lock_guard<mutex> lock(warpMapMutex);
+								warpMap = map;
+							}
+							return {make_shared<HDRImage>(map->applied(*img, AtomicProgress(progress, 0.1f))), nullptr};
 						});
 				});
 
@@ -1059,10 +1134,14 @@ Button * createShiftButton(Widget *parent, HDRViewScreen * screen, ImageListPane
 								{
 									return (uv + Vector2f(dx / img->width(), dy / img->height())).eval();
 								};
-							return {make_shared<HDRImage>(img->resampled(img->width(), img->height(),
-							                                             progress, shift, 1, sampler,
-							                                             borderModeX, borderModeY)),
-							        nullptr};
+							auto result = make_shared<HDRImage>(img->resampled(img->width(), img->height(),
+							                                                   progress, shift, 1, sampler,
+							                                                   borderModeX, borderModeY));
+							// whole-pixel shifts only move pixels, so the undo can find most of them in the result
+							Vector2i offset(0, 0);
+							if (dx == round(dx) && dy == round(dy))
+								offset = Vector2i(-int(dx), -int(dy));
+							return {result, createUndo(*img, *result, offset)};
 						});
 				});
 
@@ -1284,8 +1363,11 @@ Button * createCanvasSizeButton(Widget *parent, HDRViewScreen * screen, ImageLis
 							float gain = pow(2.f, EV);
 							Color4 c(bgColor.r() * gain, bgColor.g() * gain, bgColor.b() * gain, alpha);
 
-							return {make_shared<HDRImage>(img->resizedCanvas(newW, newH, anchor, c)),
-							        nullptr};
+							auto result = make_shared<HDRImage>(img->resizedCanvas(newW, newH, anchor, c));
+							// the old pixels are only moved, so the undo just needs to store the new border
+							Vector2i offset = HDRImage::canvasOffset(Vector2i(img->width(), img->height()),
+							                                         Vector2i(newW, newH), anchor);
+							return {result, createUndo(*img, *result, offset)};
 						});
 				},
 				[popup](){ popup->dispose(); });
@@ -1703,11 +1785,11 @@ EditImagePanel::EditImagePanel(Widget *parent, HDRViewScreen * screen, ImageList
 	m_filterButtons.back()->setCallback(
 		[this]()
 		{
-			m_imagesPanel->modifyImage(
-				[](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+			m_imagesPanel->modifyImageInPlace(
+				[](HDRImage & img, AtomicProgress & progress) -> UndoPtr
 				{
-					return {make_shared<HDRImage>(img->inverted()),
-					        make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->inverted(); })};
+					PixelPipeline().then(PixelPipeline::invert()).applyTo(img, progress);
+					return make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->inverted(); });
 				});
 		});
 	agrid->setAnchor(m_filterButtons.back(), AdvancedGridLayout::Anchor(0, agrid->rowCount()-1));
@@ -1718,15 +1800,7 @@ EditImagePanel::EditImagePanel(Widget *parent, HDRViewScreen * screen, ImageList
 	m_filterButtons.back()->setCallback(
 		[this]()
 		{
-			m_imagesPanel->modifyImage(
-				[](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-				{
-					return {make_shared<HDRImage>(img->unaryExpr(
-						[](const Color4 & c)
-						{
-							return Color4(clamp01(c.r), clamp01(c.g), clamp01(c.b), clamp01(c.a));
-						}).eval()), nullptr };
-				});
+			m_imagesPanel->adjustImage(PixelPipeline().then(PixelPipeline::clamp01()));
 		});
 	agrid->setAnchor(m_filterButtons.back(), AdvancedGridLayout::Anchor(2, agrid->rowCount()-1));
 
@@ -12,10 +12,13 @@ class Color4;
 class ImageButton;
 class ImageCommandUndo;
 class FullImageUndo;
+class TileDeltaUndo;
 class LambdaUndo;
 class CommandHistory;
 class GLImage;
 class HDRImage;
+class PixelPipeline;
+class PointwiseUndo;
 class HDRViewScreen;
 class HDRImageViewer;
 class HelpWindow;
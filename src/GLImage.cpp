@@ -9,10 +9,12 @@
 #include "Timer.h"
 #include "Colorspace.h"
 #include "ParallelFor.h"
+#include "PixelKernels.h"
 #include <random>
 #include <nanogui/common.h>
 #include <nanogui/glutil.h>
 #include <cmath>
+#include <cstring>
 #include <spdlog/spdlog.h>
 #include "MultiGraph.h"
 
@@ -20,7 +22,62 @@ using namespace nanogui;
 using namespace Eigen;
 using namespace std;
 
-shared_ptr<ImageStatistics> ImageStatistics::computeStatistics(const HDRImage &img, float exposure)
+namespace
+{
+
+// histograms of larger images are estimated from a level of their pyramid with at least this many pixels
+const size_t histogramPixels = size_t(1) << 22;
+
+/*!
+ * Returns the lower bounds of bins 1 to numBins-1 of a histogram of f(v) over [0,1].
+ *
+ * Each bound is the smallest float whose bin is at least that high, found by bisecting over all finite
+ * floats. Since f is monotonic, comparing values against these bounds bins them exactly like evaluating
+ * f would, at a fraction of the cost.
+ */
+vector<float> binThresholds(float (*f)(float), int numBins)
+{
+	auto bin = [f,numBins](float v)
+	{
+		float b = floor(f(v) * numBins);
+		return b >= numBins - 1 ? numBins - 1 : (b > 0 ? int(b) : 0);
+	};
+
+	// consecutive integers correspond to consecutive floats
+	auto toFloat = [](uint32_t i)
+	{
+		i = i & 0x80000000u ? i ^ 0x80000000u : ~i;
+		float v;
+		memcpy(&v, &i, sizeof(float));
+		return v;
+	};
+
+	// the integers of -FLT_MAX and +inf
+	const uint32_t lowest = 0x00800000u, infinity = 0xff800000u;
+
+	vector<float> thresholds(numBins - 1);
+	for (int k = 1; k < numBins; ++k)
+	{
+		// bisect for the first float that lands in bin k or above (or +inf if there is none)
+		uint32_t lo = lowest, hi = infinity;
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (bin(toFloat(mid)) >= k)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		thresholds[k - 1] = toFloat(lo);
+	}
+	return thresholds;
+}
+
+} // namespace
+
+
+shared_ptr<ImageStatistics> ImageStatistics::computeStatistics(const HDRImage &img, float exposure,
+                                                               const HDRImage * binned)
 {
 	static const int numBins = 256;
 	static const int numTicks = 8;
@@ -36,23 +93,36 @@ shared_ptr<ImageStatistics> ImageStatistics::computeStatistics(const HDRImage &i
 	ret->maximum = img.max().Color3::max();
 	ret->minimum = img.min().Color3::min();
 
-	Color4 gain(pow(2.f, exposure), 1.f);
-	float d = 1.f / (img.width() * img.height());
+	const HDRImage & src = binned ? *binned : img;
+	float gain = pow(2.f, exposure);
+	float d = 1.f / (src.width() * src.height());
 
-	for (Eigen::DenseIndex i = 0; i < img.size(); ++i)
-    {
-        Color4 val = gain * img(i);
-        ret->average += val[0] + val[1] + val[2];
-
-        for (int c = 0; c < 3; ++c)
-        {
-	        ret->histogram[ELinear].values(clamp(int(floor(val[c] * numBins)), 0, numBins - 1), c) += d;
-	        ret->histogram[ESRGB].values(clamp(int(floor(LinearToSRGB(val[c]) * numBins)), 0, numBins - 1), c) += d;
-	        ret->histogram[ELog].values(clamp(int(floor(normalizedLogScale(val[c]) * numBins)), 0, numBins - 1), c) += d;
-        }
-    }
+	// the bin thresholds of the linear, sRGB and log histograms, back to back
+	static const vector<float> thresholds = []() -> vector<float>
+	{
+		vector<float> t = binThresholds([](float v){return v;}, numBins);
+		vector<float> sRGB = binThresholds([](float v){return LinearToSRGB(v);}, numBins);
+		vector<float> log = binThresholds([](float v){return normalizedLogScale(v);}, numBins);
+		t.insert(t.end(), sRGB.begin(), sRGB.end());
+		t.insert(t.end(), log.begin(), log.end());
+		return t;
+	}();
+
+	// each channel is binned from its own contiguous plane, and writes only to its own histogram column
+	float channelSums[3] = {0.f, 0.f, 0.f};
+	parallel_for(0, 3, [&src,&ret,&channelSums,gain,d](int c)
+	{
+		const HDRImage::Plane plane = src.channel(c);
+		vector<uint32_t> counts(ENumAxisScales * numBins, 0);
+		channelSums[c] = accumulateHistograms(plane.data(), plane.size(), gain,
+		                                      numBins, thresholds.data(), ENumAxisScales, counts.data());
 
-	ret->average /= 3 * img.width() * img.height();
+		for (int i = 0; i < ENumAxisScales; ++i)
+			for (int b = 0; b < numBins; ++b)
+				ret->histogram[i].values(b, c) = counts[i * numBins + b] * d;
+	});
+
+	ret->average = (channelSums[0] + channelSums[1] + channelSums[2]) / (3 * src.width() * src.height());
 
 
 	// Normalize each histogram according to its 10th-largest bin
@@ -223,32 +293,119 @@ void GLImage::asyncModify(const ImageCommand &command)
 	m_asyncCommand->compute();
 }
 
-bool GLImage::undo()
+/*!
+ * Modify the pixels of the image in place, copying them first only if needed (copy on write).
+ *
+ * Most commands create a new image next to the current one. Commands that can work in place
+ * instead avoid that copy, and the memory it takes, as long as nothing else refers to the image:
+ * no undo entry, pending histogram computation, pyramid or texture upload. Otherwise, the command works
+ * on a copy, just like @ref asyncModify.
+ *
+ * An in-place modification cannot be canceled, since that would leave the image half-modified.
+ */
+void GLImage::asyncModifyInPlace(const ImageInPlaceCommand & command)
 {
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
-	if (m_history.undo(m_image))
-	{
-		m_histogramDirty = true;
-		m_texture.setDirty();
-		return true;
-	}
-	return false;
+	// the pyramid is about to be stale anyway, and would otherwise count as a reference to the image
+	m_pyramid = LazyPyramid();
+
+	bool inPlace = m_image.use_count() == 1 && !m_texture.dirty() && (!m_histograms || m_histograms->ready());
+	m_modifyingInPlace = inPlace;
+
+	auto image = m_image;
+	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>(
+		[image,inPlace,command](AtomicProgress & prog)
+		{
+			auto target = inPlace ? image : make_shared<HDRImage>(*image);
+			auto undo = command(*target, prog);
+			return ImageCommandResult(target, undo);
+		});
+	m_asyncRetrieved = false;
+	m_asyncCommand->compute();
+}
+
+/*!
+ * Apply a pointwise adjustment to the image, in place if possible (see @ref asyncModifyInPlace).
+ *
+ * Rather than saving a full copy of the image for undo, consecutive adjustments share the snapshot
+ * taken before the first of them (see @ref PointwiseUndo), so only the first adjustment of a run
+ * copies the image.
+ */
+void GLImage::asyncAdjust(const PixelPipeline & adjustment)
+{
+	// make sure any pending edits are done, so that the history is up to date
+	waitForAsyncResult();
+
+	auto previous = dynamic_pointer_cast<PointwiseUndo>(m_history.currentCommand());
+	asyncModifyInPlace(
+		[adjustment,previous](HDRImage & img, AtomicProgress & prog) -> UndoPtr
+		{
+			auto undo = previous ?
+				make_shared<PointwiseUndo>(previous->snapshot(), previous->adjustments(), adjustment) :
+				make_shared<PointwiseUndo>(make_shared<FullImageUndo>(img), PixelPipeline(), adjustment);
+			adjustment.applyTo(img, prog);
+			return undo;
+		});
 }
 
+/*!
+ * Request cancellation of the pending modification, if any.
+ *
+ * This returns immediately; the result of a canceled command is discarded once it
+ * bails out, leaving both the image and the undo history unchanged.
+ *
+ * @return True if there was a pending modification to cancel
+ */
+bool GLImage::cancelModify()
+{
+	if (!m_asyncCommand || m_asyncRetrieved || m_asyncCommand->canceled() || m_modifyingInPlace)
+		return false;
+
+	// commands without progress reporting cannot be canceled
+	m_asyncCommand->cancel();
+	return m_asyncCommand->canceled();
+}
+
+/*!
+ * Undo the most recent command.
+ *
+ * Undo entries may be compressed or moved to disk (see @ref CommandHistory::setSpillThreshold),
+ * so the entry is unpacked in the background, and the undo happens once that is done.
+ *
+ * @return True if there was anything to undo
+ */
+bool GLImage::undo()
+{
+	return asyncHistoryStep(false);
+}
+
+//! Redo the most recently undone command. See @ref undo.
 bool GLImage::redo()
+{
+	return asyncHistoryStep(true);
+}
+
+bool GLImage::asyncHistoryStep(bool forward)
 {
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
-	if (m_history.redo(m_image))
-	{
-		m_histogramDirty = true;
-		m_texture.setDirty();
-		return true;
-	}
-	return false;
+	auto command = forward ? m_history.nextCommand() : m_history.currentCommand();
+	if (!command)
+		return false;
+
+	m_historyStep = forward ? 1 : -1;
+	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>(
+		[command](AtomicProgress & prog)
+		{
+			command->unpack(prog);
+			return ImageCommandResult(nullptr, command);
+		});
+	m_asyncRetrieved = false;
+	m_asyncCommand->compute();
+	return true;
 }
 
 bool GLImage::checkAsyncResult() const
@@ -276,10 +433,35 @@ bool GLImage::waitForAsyncResult() const
 	if (!m_asyncRetrieved)
 	{
 		// now retrieve the result and copy it out of the async task
-		auto result = m_asyncCommand->get();
+		ImageCommandResult result;
+		try
+		{
+			result = m_asyncCommand->get();
+		}
+		catch (const CanceledError &)
+		{
+			// leave the image and the undo history untouched
+			spdlog::get("console")->info("Canceled modifying image \"{}\"", m_filename);
+			m_historyStep = 0;
+			m_modifyingInPlace = false;
+			modifyFinished();
+			return false;
+		}
 
+		m_modifyingInPlace = false;
+
+		if (m_historyStep)
+		{
+			// the undo entry is unpacked, so stepping through the history is now quick
+			if (m_historyStep > 0)
+				m_history.redo(m_image);
+			else
+				m_history.undo(m_image);
+			m_historyStep = 0;
+			result.first = m_image;
+		}
 		// if there is no undo, treat this as an image load
-		if (!result.second)
+		else if (!result.second)
 		{
 			if (result.first)
 			{
@@ -295,6 +477,7 @@ bool GLImage::waitForAsyncResult() const
 
 		m_asyncRetrieved = true;
 		m_histogramDirty = true;
+		m_pyramid = LazyPyramid();
 		m_texture.setDirty();
 
 		if (!result.first)
@@ -316,12 +499,35 @@ bool GLImage::waitForAsyncResult() const
 
 void GLImage::uploadToGPU() const
 {
-	if (m_texture.uploadToGPU(m_image))
+	auto image = textureImage();
+	if (image && m_texture.uploadToGPU(image))
 		// now that we grabbed the results and uploaded to GPU, destroy the task
 		modifyFinished();
 }
 
 
+/*!
+ * The image to display: the image itself, unless it is larger than the GPU supports.
+ *
+ * In that case, this is the largest level of the pyramid that fits, or null while the pyramid is being built.
+ * The texture is looked up with normalized coordinates, so a smaller level is simply displayed at lower resolution.
+ */
+shared_ptr<const HDRImage> GLImage::textureImage() const
+{
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if (m_image->isNull() || (m_image->width() <= maxSize && m_image->height() <= maxSize))
+		return m_image;
+
+	auto levels = pyramid();
+	if (!levels.valid() || levels.wait_for(chrono::seconds(0)) != future_status::ready)
+		return nullptr;
+
+	auto pyramid = levels.get();
+	return pyramid->levelPtr(pyramid->levelAtMost(maxSize, maxSize));
+}
+
+
 GLuint GLImage::glTextureId() const
 {
 	checkAsyncResult();
@@ -337,7 +543,9 @@ bool GLImage::load(const std::string & filename)
 
     m_history = CommandHistory();
     m_filename = filename;
+    setFileRegion(0, Eigen::Vector2i::Zero());
     m_histogramDirty = true;
+	m_pyramid = LazyPyramid();
 	m_texture.setDirty();
     return m_image->load(filename);
 }
@@ -358,16 +566,39 @@ bool GLImage::save(const std::string & filename,
     return true;
 }
 
+GLImage::LazyPyramid GLImage::pyramid() const
+{
+	if (!m_pyramid.valid() && !m_image->isNull() && !m_modifyingInPlace)
+	{
+		shared_ptr<const HDRImage> image = m_image;
+		m_pyramid = ThreadPool::global().async(
+			[image]() -> shared_ptr<const ImagePyramid> {return make_shared<ImagePyramid>(image);}).share();
+	}
+	return m_pyramid;
+}
+
 void GLImage::recomputeHistograms(float exposure) const
 {
 	checkAsyncResult();
 
-    if ((!m_histograms || m_histogramDirty || exposure != m_cachedHistogramExposure) && !m_image->isNull())
+    // the histograms are recomputed once an in-place modification is done
+    if ((!m_histograms || m_histogramDirty || exposure != m_cachedHistogramExposure) && !m_image->isNull() &&
+        !m_modifyingInPlace)
     {
+        // large images are binned from a smaller level of the pyramid, which is then shared with later exposures
+        LazyPyramid levels = size_t(m_image->width()) * m_image->height() > 4 * histogramPixels ? pyramid() : LazyPyramid();
         m_histograms = make_shared<LazyHistogram>(
-	        [this,exposure](void)
+	        [this,exposure,levels](void)
 	        {
-		        return ImageStatistics::computeStatistics(*m_image, exposure);
+		        if (!levels.valid())
+			        return ImageStatistics::computeStatistics(*m_image, exposure);
+
+		        ThreadPool::global().wait(levels);
+		        const ImagePyramid & pyramid = *levels.get();
+		        const HDRImage & img = pyramid.level(0);
+		        float scale = sqrt(float(histogramPixels) / (float(img.width()) * img.height()));
+		        int level = pyramid.levelAtLeast(int(ceil(img.width() * scale)), int(ceil(img.height() * scale)));
+		        return ImageStatistics::computeStatistics(img, exposure, &pyramid.level(level));
 	        });
         m_histograms->compute();
         m_histogramDirty = false;
@@ -14,11 +14,13 @@
 #include <vector>              // for vector, allocator
 #include <nanogui/opengl.h>
 #include "HDRImage.h"          // for HDRImage
+#include "ImagePyramid.h"      // for ImagePyramid
 #include "Fwd.h"               // for HDRImage
 #include "CommandHistory.h"
 #include "Async.h"
 #include <utility>
 #include <memory>
+#include <future>
 
 
 struct ImageStatistics
@@ -46,7 +48,14 @@ struct ImageStatistics
 	Histogram histogram[ENumAxisScales];
 
 
-	static std::shared_ptr<ImageStatistics> computeStatistics(const HDRImage &img, float exposure);
+	/*!
+	 * Compute the statistics of \a img, at the given exposure.
+	 *
+	 * @param binned 	If not null, a downsampled version of \a img (e.g. a level of its @ref ImagePyramid)
+	 * 					from which to estimate the histograms and the average; the extrema still come from \a img
+	 */
+	static std::shared_ptr<ImageStatistics> computeStatistics(const HDRImage &img, float exposure,
+	                                                          const HDRImage * binned = nullptr);
 };
 
 
@@ -95,6 +104,7 @@ class GLImage
 public:
 	using LazyHistogram = AsyncTask<std::shared_ptr<ImageStatistics>>;
 	using LazyHistogramPtr = std::shared_ptr<LazyHistogram>;
+	using LazyPyramid = std::shared_future<std::shared_ptr<const ImagePyramid>>;
 	using ConstModifyingTask = std::shared_ptr<const AsyncTask<ImageCommandResult>>;
 	using ModifyingTask = std::shared_ptr<AsyncTask<ImageCommandResult>>;
 	using VoidVoidFunc = std::function<void(void)>;
@@ -107,11 +117,16 @@ public:
 	float progress() const;
     void asyncModify(const ImageCommand & command);
 	void asyncModify(const ImageCommandWithProgress & command);
+	void asyncModifyInPlace(const ImageInPlaceCommand & command);
+	void asyncAdjust(const PixelPipeline & adjustment);
+	bool cancelModify();
     bool isModified() const;
     bool undo();
     bool redo();
     bool hasUndo() const;
     bool hasRedo() const;
+	/// Whether a pending modification is changing the pixels of @ref image, which should not be read until it is done
+	bool modifyingInPlace() const               { return m_modifyingInPlace; }
 
 	GLuint glTextureId() const;
 	void setFilename(const std::string & filename)  { m_filename = filename; }
@@ -123,6 +138,12 @@ public:
     Eigen::Vector2i size() const                    { return isNull() ? Eigen::Vector2i(0,0) : Eigen::Vector2i(m_image->width(), m_image->height()); }
     bool contains(const Eigen::Vector2i& p) const   {return (p.array() >= 0).all() && (p.array() < size().array()).all();}
 
+    /// The resolution level of the file this image was loaded from (0 unless only a reduced level was loaded)
+    int fileLevel() const                           { return m_fileLevel; }
+    /// The position of this image's top-left pixel within that level of the file
+    const Eigen::Vector2i & fileOrigin() const      { return m_fileOrigin; }
+    void setFileRegion(int level, const Eigen::Vector2i & origin) { m_fileLevel = level; m_fileOrigin = origin; }
+
     bool load(const std::string & filename);
     bool save(const std::string & filename,
               float gain, float gamma,
@@ -133,6 +154,15 @@ public:
 	LazyHistogramPtr histograms() const         { return m_histograms; }
 	void recomputeHistograms(float exposure) const;
 
+	/*!
+	 * The mip-map of @ref image, shared by everything that needs a smaller version of it.
+	 *
+	 * The pyramid is built in the background the first time it is asked for, and is kept until the
+	 * image changes. Wait for it with ThreadPool::wait; it is invalid while the image is empty or
+	 * is being modified in place.
+	 */
+	LazyPyramid pyramid() const;
+
 	/// Callback executed whenever an image finishes being modified, e.g. via @ref asyncModify
 	const VoidVoidFunc & imageModifyDoneCallback() const            { return m_imageModifyDoneCallback; }
 	void setImageModifyDoneCallback(const VoidVoidFunc & callback)  { m_imageModifyDoneCallback = callback; }
@@ -140,19 +170,26 @@ public:
 private:
 	bool checkAsyncResult() const;
 	bool waitForAsyncResult() const;
+	bool asyncHistoryStep(bool forward);
 	void uploadToGPU() const;
+	std::shared_ptr<const HDRImage> textureImage() const;
 	void modifyFinished() const;
 
 	mutable std::shared_ptr<HDRImage> m_image;
     std::string m_filename;
+    int m_fileLevel = 0;
+    Eigen::Vector2i m_fileOrigin = Eigen::Vector2i::Zero();
 	mutable LazyGLTextureLoader m_texture;
     mutable float m_cachedHistogramExposure;
     mutable std::atomic<bool> m_histogramDirty;
 	mutable LazyHistogramPtr m_histograms;
+	mutable LazyPyramid m_pyramid;          ///< invalid until asked for, and again whenever the image changes
     mutable CommandHistory m_history;
 
 	mutable ModifyingTask m_asyncCommand = nullptr;
 	mutable bool m_asyncRetrieved = false;
+	mutable int m_historyStep = 0;      ///< +1 (-1) while the pending task prepares a redo (undo)
+	mutable bool m_modifyingInPlace = false;
 
 	// various callback functions
 	VoidVoidFunc m_imageModifyDoneCallback;
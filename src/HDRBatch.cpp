@@ -4,14 +4,25 @@
 // be found in the LICENSE.txt file.
 //
 
+#include <algorithm>                     // for find_if
 #include <ctype.h>                       // for tolower
 #include <docopt.h>                      // for docopt
 #include <Eigen/Core>                    // for Vector2f
 #include <iostream>                      // for string
 #include <random>                        // for normal_distribution, mt19937
+#include <atomic>                        // for atomic
+#include <condition_variable>            // for condition_variable
+#include <exception>                     // for exception_ptr, rethrow_exception
+#include <mutex>                         // for mutex, lock_guard, unique_lock
+#include <thread>                        // for thread
 #include "Common.h"                      // for getBasename, getExtension
 #include "HDRImage.h"                    // for HDRImage
 #include "EnvMap.h"                      // for XYZToAngularMap, XYZToCubeMap
+#include "ImagePyramid.h"                // for ImagePyramid
+#include "ParallelFor.h"                 // for parallel_for_range
+#include "PixelKernels.h"                // for activeSIMDLevel
+#include "PixelPipeline.h"               // for PixelPipeline
+#include "WarpMap.h"                     // for WarpMap
 #include "HDRViewer.h"                   // for spdlog
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/ostr.h>
@@ -21,8 +32,6 @@ namespace spd = spdlog;
 
 namespace
 {
-std::mt19937 g_rand(53);
-
 HDRImage::BorderMode parseBorderMode(const string &mode)
 {
 	if (mode == "black")
@@ -36,6 +45,256 @@ HDRImage::BorderMode parseBorderMode(const string &mode)
 
 	throw invalid_argument(fmt::format("Invalid border mode \"{}\".", mode));
 }
+
+/*!
+ * Lets files that are processed concurrently take turns in input order, for the
+ * steps whose results depend on the order in which the files are visited.
+ *
+ * Once aborted, no turn is ever granted again and all waiting files are woken up,
+ * so that an error in one file cannot leave the others blocked forever.
+ */
+class FileOrder
+{
+public:
+	//! The turn of a single file, which is always passed on to the next file, even if never taken
+	class Turn
+	{
+	public:
+		Turn(FileOrder & order, size_t index) : m_order(order), m_index(index) {}
+		~Turn() {release();}
+
+		/*!
+		 * Block until all previous files have released their turn.
+		 *
+		 * \return false if the order was aborted instead, in which case the turn was not granted
+		 */
+		bool take()
+		{
+			if (!m_taken)
+			{
+				m_granted = m_order.waitFor(m_index);
+				m_taken = true;
+			}
+			return m_granted;
+		}
+
+		//! Let the next file take its turn
+		void release()
+		{
+			if (m_released)
+				return;
+			if (take())
+				m_order.pass(m_index);
+			m_released = true;
+		}
+
+	private:
+		FileOrder & m_order;
+		size_t m_index;
+		bool m_taken = false, m_granted = false, m_released = false;
+	};
+
+	//! Stop granting turns, and wake up all files waiting for one
+	void abort()
+	{
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_aborted = true;
+		}
+		m_turnPassed.notify_all();
+	}
+
+private:
+	bool waitFor(size_t index)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_turnPassed.wait(lock, [this,index](){return m_aborted || m_next == index;});
+		return !m_aborted;
+	}
+
+	void pass(size_t index)
+	{
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_next = index + 1;
+		}
+		m_turnPassed.notify_all();
+	}
+
+	mutex m_mutex;
+	condition_variable m_turnPassed;
+	size_t m_next = 0;
+	bool m_aborted = false;
+};
+
+/*!
+ * Per-pixel count, mean, and sum of squared deviations from the mean (M2) of a set of images.
+ *
+ * Images are added one at a time using Welford's update, and partial statistics of disjoint
+ * sets of images are combined using the parallel formula of Chan et al. Both update the
+ * accumulators in place in a single pass over the pixels, without any temporary images.
+ */
+class PixelStatistics
+{
+public:
+	int count() const           {return m_count;}
+	const HDRImage & mean() const   {return m_mean;}
+
+	//! The unbiased sample variance, using the (n-1) Bessel correction, with alpha set to 1
+	HDRImage variance() const
+	{
+		float norm = 1.f / (m_count - 1);
+		return m_m2.unaryExpr([norm](const Color4 & c)
+		{
+			return Color4(c.r * norm, c.g * norm, c.b * norm, 1.f);
+		});
+	}
+
+	void add(const HDRImage & image)
+	{
+		if (!m_count)
+		{
+			m_mean = image;
+			m_m2 = HDRImage::Constant(image.width(), image.height(), Color4(0.f, 0.f, 0.f, 0.f));
+			m_count = 1;
+			return;
+		}
+
+		checkSize(image);
+		++m_count;
+		Color4 weight(1.f / m_count);
+		parallel_for_range(0, image.height(), [this,&image,weight](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+				for (int x = 0; x < image.width(); ++x)
+				{
+					Color4 delta = image(x, y) - m_mean(x, y);
+					m_mean(x, y) += delta * weight;
+					m_m2(x, y) += delta * (image(x, y) - m_mean(x, y));
+				}
+		});
+	}
+
+	void merge(const PixelStatistics & other)
+	{
+		if (!other.m_count)
+			return;
+		if (!m_count)
+		{
+			*this = other;
+			return;
+		}
+
+		checkSize(other.m_mean);
+		float n = float(m_count) + other.m_count;
+		Color4 weight(other.m_count / n), m2Weight(m_count * (other.m_count / n));
+		parallel_for_range(0, m_mean.height(), [this,&other,weight,m2Weight](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+				for (int x = 0; x < m_mean.width(); ++x)
+				{
+					Color4 delta = other.m_mean(x, y) - m_mean(x, y);
+					m_mean(x, y) += delta * weight;
+					m_m2(x, y) += other.m_m2(x, y) + delta * delta * m2Weight;
+				}
+		});
+		m_count += other.m_count;
+	}
+
+private:
+	void checkSize(const HDRImage & image) const
+	{
+		if (m_mean.width() != image.width() || m_mean.height() != image.height())
+			throw invalid_argument("Images do not have the same size.");
+	}
+
+	int m_count = 0;
+	HDRImage m_mean, m_m2;
+};
+
+/*!
+ * The warp maps of --remap, built once for each source and destination size and shared by all files.
+ *
+ * Given a file name, the map is loaded from it if it was built for the same remapping and sizes, and
+ * is written to it otherwise, so that later runs over images of the same size can skip building it.
+ */
+class WarpMapCache
+{
+public:
+	void setup(const string & description, const WarpMap::WarpFn & warp, int samples,
+	           HDRImage::Sampler sampler, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+	           const string & filename)
+	{
+		m_description = description;
+		m_warp = warp;
+		m_samples = samples;
+		m_sampler = sampler;
+		m_mX = mX;
+		m_mY = mY;
+		m_filename = filename;
+	}
+
+	//! The map for \a srcSize and \a dstSize. Files processed concurrently wait for the first one to build it.
+	shared_ptr<const WarpMap> get(const Eigen::Vector2i & srcSize, const Eigen::Vector2i & dstSize)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		for (const auto & map : m_maps)
+			if (map->matches(srcSize, dstSize, m_description))
+				return map;
+
+		auto console = spdlog::get("console");
+		shared_ptr<WarpMap> map;
+		if (!m_filename.empty())
+		{
+			try
+			{
+				map = make_shared<WarpMap>(WarpMap::load(m_filename));
+				if (!map->matches(srcSize, dstSize, m_description))
+				{
+					console->info("The warp map in \"{}\" was built for different parameters.", m_filename);
+					map = nullptr;
+				}
+				else
+					console->info("Loaded the warp map from \"{}\".", m_filename);
+			}
+			catch (const exception & e)
+			{
+				console->debug("{}", e.what());
+			}
+		}
+
+		if (!map)
+		{
+			console->info("Building the warp map for {:d}x{:d} images...", srcSize.x(), srcSize.y());
+			map = make_shared<WarpMap>(srcSize, dstSize, m_description, m_warp, m_samples, m_sampler, m_mX, m_mY);
+			if (!m_filename.empty())
+			{
+				try
+				{
+					map->save(m_filename);
+					console->info("Saved the warp map to \"{}\".", m_filename);
+				}
+				catch (const exception & e)
+				{
+					console->warn("{}", e.what());
+				}
+			}
+		}
+
+		m_maps.push_back(map);
+		return map;
+	}
+
+private:
+	mutex m_mutex;
+	vector<shared_ptr<const WarpMap>> m_maps;
+
+	string m_description, m_filename;
+	WarpMap::WarpFn m_warp;
+	int m_samples = 1;
+	HDRImage::Sampler m_sampler = HDRImage::BILINEAR;
+	HDRImage::BorderMode m_mX = HDRImage::EDGE, m_mY = HDRImage::EDGE;
+};
 }
 
 static const char USAGE[] =
@@ -92,15 +351,23 @@ Options:
   --invert, -i             Invert the image (compute 1-image).
   --filter=TYPE,PARAMS...  Process image(s) using filter TYPE with
                            filter-specific PARAMS specified after the comma.
-                           TYPE : (gaussian | box | fast-gaussian | unsharp |
-                                   bilateral | median).
+                           TYPE : (gaussian | box | fast-gaussian |
+                                   recursive-gaussian | unsharp | bilateral |
+                                   bilateral-grid | median | convolve).
                            For example: '--filter fast-gaussian,10x10' would
                            filter using a 10x10 fast Gaussian approximation.
-  -r SIZE, --resize=SIZE   Resize the image to the specified SIZE.
-                           This currently uses a box filter for resampling, but
-                           you can combine with a Gaussian blur to obtain
-                           smoother downsampled results. The blur is applied
-                           *before* downsampling.
+                           'convolve' takes an image file instead, and
+                           convolves with its luminance, normalized to sum
+                           to one: '--filter convolve,psf.exr'. Large
+                           kernels are applied using FFTs.
+                           'bilateral-grid' is a fast approximation of
+                           'bilateral' which compares log luminance, so its
+                           first (range) parameter is in stops.
+                           'recursive-gaussian' costs the same per pixel
+                           for any blur size.
+  -r SIZE, --resize=SIZE   Resize the image to the specified SIZE, using the
+                           --resize-filter. Reductions of any size are done in
+                           a single pass, without aliasing.
                            SIZE can be either absolute or relative.
                            Absolute: SIZE should be a string matching the
                            pattern '%dx%d', for instance: '640x480'.
@@ -108,6 +375,11 @@ Options:
                            pattern '%f%%x%f%%' e.g. '33.3%x25%' would make the
                            image a third its original width and a quarter its
                            original height.
+  --resize-filter=F        The filter used by --resize. Mitchell and Lanczos3
+                           are sharpest; their ringing around bright highlights
+                           is clamped.
+                           F : (box | tent | mitchell | lanczos3 | gaussian)
+                           [default: mitchell].
   --remap=M,M,[S],[L]      Remap the input image from one environment map
                            format to another. M,M are the input and output
                            environment map formats respectively.
@@ -115,10 +387,19 @@ Options:
                            The optional S results in SxS super-sampling, where
                            the default is S=1: one centered sample per pixel.
                            The optional L parameter specifies the sampling lookup
-                           mode: L : (nearest | bilinear | bicubic).
+                           mode: L : (nearest | bilinear | bicubic | filtered).
+                           'filtered' ignores S, and instead averages each output
+                           pixel's footprint from a mip-map of the input image.
+                           This is comparable to 8x8 super-sampling, at a cost
+                           that does not depend on how much the image shrinks.
                            Specifying the same M parameter twice results in no
                            change. Combine with --resize to specify output file
                            dimensions.
+                           Which source pixels each output pixel reads is only
+                           computed once for all images of the same size.
+  --warp-map=FILE          Load the precomputed --remap lookups from FILE if they
+                           match the remapping and image size; otherwise compute
+                           and save them there, for subsequent runs.
   --border-mode=MODE,MODE  Specifies what x- and y-modes to use when accessing pixels
                            outside the bounds of the image.
                            MODE : (black | mirror | edge | repeat)
@@ -139,6 +420,14 @@ Options:
   --random-noise=M,V       Generate random Gaussian noise with mean M and
                            variance V.
   -n R,G,B, --nan=R,G,B    Replace all NaNs and INFs with (R,G,B)
+  -j N, --jobs=N           Process up to N files concurrently, so that loading
+                           and saving one file overlaps with processing another.
+                           Each job keeps one image in memory (plus temporaries
+                           while filtering or resizing), and with --average or
+                           --variance also two images of partial statistics,
+                           for about 3N+2 images in all. The results, including
+                           --average and --variance, do not depend on N
+                           [default: 1].
   --dry-run                Don't actually save any files, just report what would
                            be done.
 )";
@@ -156,7 +445,7 @@ int main(int argc, char **argv)
            filterParams = "",
            errorType = "",
            referenceFile = "";
-    int verbosity = 0, absoluteWidth, absoluteHeight, samples = 1;
+    int verbosity = 0, absoluteWidth, absoluteHeight, samples = 1, jobs = 1;
     float gamma, exposure, relativeWidth = 100.f, relativeHeight = 100.f,
           noiseMean = 0, noiseVar = 0;
     bool dither = true,
@@ -165,16 +454,19 @@ int main(int argc, char **argv)
          fixNaNs = false,
          resize = false,
          remap = false,
+         filteredRemap = false,
          relativeSize = true,
          saveFiles = false,
          makeNoise = false,
          invert = false;
     HDRImage::BorderMode borderModeX, borderModeY;
+    WarpMapCache warpMaps;
     Color3 nanColor(0.0f,0.0f,0.0f);
     // by default use a no-op passthrough warp function
     function<Vector2f(const Vector2f&)> warp = [](const Vector2f & uv) {return uv;};
     // use bilinear lookup by default
     HDRImage::Sampler sampler = HDRImage::BILINEAR;
+    HDRImage::ResizeFilter resizeFilter = HDRImage::MITCHELL_FILTER;
     // no filter by default
     function<HDRImage(const HDRImage &)> filter;
 
@@ -220,6 +512,7 @@ int main(int argc, char **argv)
 
         console->info("Welcome to HDRView!");
         console->info("Verbosity threshold set to level {:d}.", verbosity);
+        console->debug("Using {} pixel kernels.", simdLevelName(activeSIMDLevel()));
 
         console->debug("Running with the following commands/arguments/options:");
         for (auto const& arg : docargs)
@@ -296,20 +589,37 @@ int main(int argc, char **argv)
 
         if (docargs["--filter"].isString())
         {
-            float filterArg1, filterArg2;
-            char type[22], params[32];
-            if (sscanf(docargs["--filter"].asString().c_str(), "%20[^','],%30s", type, params) != 2)
-                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", docargs["--filter"].asString()));
-
-            filterParams = params;
-            if (sscanf(filterParams.c_str(), "%f,%f", &filterArg1, &filterArg2) != 2)
-                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", docargs["--filter"].asString()));
+            string filterArg = docargs["--filter"].asString();
+            size_t comma = filterArg.find(',');
+            if (comma == string::npos)
+                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", filterArg));
 
-            filterType = type;
+            filterType = filterArg.substr(0, comma);
+            filterParams = filterArg.substr(comma + 1);
             transform(filterType.begin(), filterType.end(), filterType.begin(), ::tolower);
 
+            // all filters but 'convolve' take two numeric parameters
+            float filterArg1 = 0.f, filterArg2 = 0.f;
+            if (filterType != "convolve" && sscanf(filterParams.c_str(), "%f,%f", &filterArg1, &filterArg2) != 2)
+                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", filterArg));
+
             AtomicProgress progress;
-            if (filterType == "gaussian")
+            if (filterType == "convolve")
+            {
+                HDRImage kernelImage;
+                if (!kernelImage.load(filterParams))
+                    throw invalid_argument(fmt::format("Cannot read kernel image \"{}\".", filterParams));
+
+                // convolve all channels with the kernel image's luminance
+                Eigen::ArrayXXf kernel(kernelImage.width(), kernelImage.height());
+                for (int y = 0; y < kernelImage.height(); ++y)
+                    for (int x = 0; x < kernelImage.width(); ++x)
+                        kernel(x, y) = kernelImage(x, y).luminance();
+
+                filter = [kernel, progress, borderModeX, borderModeY](const HDRImage & i) {return i
+                    .convolved(kernel, progress, borderModeX, borderModeY);};
+            }
+            else if (filterType == "gaussian")
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .GaussianBlurred(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
             else if (filterType == "box")
@@ -318,19 +628,25 @@ int main(int argc, char **argv)
             else if (filterType == "fast-gaussian")
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .fastGaussianBlurred(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+            else if (filterType == "recursive-gaussian")
+                filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
+                    .recursiveGaussianBlurred(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
             else if (filterType == "median")
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .medianFiltered(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
             else if (filterType == "bilateral")
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .bilateralFiltered(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+            else if (filterType == "bilateral-grid")
+                filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
+                    .bilateralGridFiltered(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
             else if (filterType == "unsharp")
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .unsharpMasked(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
             else
                 throw invalid_argument(fmt::format("Unrecognized filter type: \"{}\".", filterType));
 
-            console->info("Filtering using {}({:f},{:f}).", filterType, filterArg1, filterArg2);
+            console->info("Filtering using {}({}).", filterType, filterParams);
         }
 
         if (docargs["--error"].isString())
@@ -360,11 +676,21 @@ int main(int argc, char **argv)
             else
                 throw invalid_argument(fmt::format("Cannot parse --resize parameters:\t{}", docargs["--resize"].asString()));
 
+            string filterName = docargs["--resize-filter"].asString();
+            auto & names = HDRImage::resizeFilterNames();
+            auto match = find_if(names.begin(), names.end(),
+                                 [&filterName](const string & name) {return toLower(name) == toLower(filterName);});
+            if (match == names.end())
+                throw invalid_argument(fmt::format("Unrecognized resize filter \"{}\".", filterName));
+            resizeFilter = HDRImage::ResizeFilter(match - names.begin());
+
             resize = true;
             if (relativeSize)
-                console->info("Resizing images to a relative size of {:.1f}% x {:.1f}%.", relativeWidth, relativeHeight);
+                console->info("Resizing images to a relative size of {:.1f}% x {:.1f}% with a {} filter.",
+                              relativeWidth, relativeHeight, *match);
             else
-                console->info("Resizing images to an absolute size of {:d} x {:d}.", absoluteWidth, absoluteHeight);
+                console->info("Resizing images to an absolute size of {:d} x {:d} with a {} filter.",
+                              absoluteWidth, absoluteHeight, *match);
         }
 
         if (docargs["--remap"].isString())
@@ -404,11 +730,13 @@ int main(int argc, char **argv)
                 else
                     throw invalid_argument(fmt::format("Cannot parse --remap parameters, unrecognized mapping type \"{}\"", to));
 
-                warp = [&](const Vector2f & uv) {return xyz2src(dst2xyz(Vector2f(uv(0), uv(1))));};
+                warp = [xyz2src, dst2xyz](const Vector2f & uv) {return xyz2src(dst2xyz(Vector2f(uv(0), uv(1))));};
             }
 
             string interp = s3;
-            if (interp == "nearest")
+            if (interp == "filtered")
+                filteredRemap = true;
+            else if (interp == "nearest")
                 sampler = HDRImage::NEAREST;
             else if (interp == "bilinear")
                 sampler = HDRImage::BILINEAR;
@@ -417,7 +745,21 @@ int main(int argc, char **argv)
             else
                 throw invalid_argument(fmt::format("Cannot parse --remap parameters, unrecognized sampler type \"{}\"", interp));
 
-            console->info("Remapping from {} to {} using {} interpolation with {:d} samples.", from, to, interp, samples);
+            if (filteredRemap)
+            {
+                console->info("Remapping from {} to {} using mip-mapped filtering.", from, to);
+                if (docargs["--warp-map"].isString())
+                    console->warn("Ignoring --warp-map, which does not apply to filtered remapping.");
+            }
+            else
+            {
+                console->info("Remapping from {} to {} using {} interpolation with {:d} samples.", from, to, interp, samples);
+
+                string warpMapFile = docargs["--warp-map"].isString() ? docargs["--warp-map"].asString() : "";
+                warpMaps.setup(fmt::format("{},{},{:d},{},{},{}", from, to, samples, interp,
+                                           HDRImage::borderModeNames()[borderModeX], HDRImage::borderModeNames()[borderModeY]),
+                               warp, samples, sampler, borderModeX, borderModeY, warpMapFile);
+            }
         }
 
         if (docargs["--random-noise"].isString())
@@ -438,6 +780,12 @@ int main(int argc, char **argv)
             fixNaNs = true;
         }
 
+        jobs = strtol(docargs["--jobs"].asString().c_str(), (char **)NULL, 10);
+        if (jobs < 1)
+            throw invalid_argument(fmt::format("Invalid number of jobs \"{}\".", docargs["--jobs"].asString()));
+        if (jobs > 1)
+            console->info("Processing up to {:d} files concurrently.", jobs);
+
         dryRun = docargs["--dry-run"].asBool();
         if (dryRun)
             console->info("Only testing. Will not write files.");
@@ -459,48 +807,47 @@ int main(int argc, char **argv)
             console->info("Reference image size: {:d}x{:d}", referenceImage.width(), referenceImage.height());
         }
 
-        HDRImage avgImg;
-        HDRImage varImg;
-        int varN = 0;
-
-        for (size_t i = 0; i < inFiles.size(); ++i)
+        // statistics for --average and --variance are accumulated over consecutive chunks of files,
+        // which are merged in order. The chunk size only depends on the number of files, so that
+        // the results do not depend on the number of jobs. Up to maxChunks files get a chunk each,
+        // so that any number of jobs up to that can run at once, and more files share chunks,
+        // which keeps the number of ordered merges bounded
+        const size_t maxChunks = 64;
+        bool computeStatistics = !avgFilename.empty() || !varFilename.empty();
+        size_t chunkSize = computeStatistics ? (inFiles.size() + maxChunks - 1) / maxChunks : 1;
+        size_t numChunks = (inFiles.size() + chunkSize - 1) / chunkSize;
+        PixelStatistics statistics;
+
+        // merging statistics depends on the order of the chunks
+        FileOrder mergeOrder;
+
+        auto processFile = [&](size_t i, PixelStatistics & chunkStatistics)
         {
             HDRImage image;
             console->info("Reading image \"{}\"...", inFiles[i]);
             if (!image.load(inFiles[i]))
             {
                 console->error("Cannot read image \"{}\". Skipping...\n", inFiles[i]);
-                continue;
+                return;
             }
             console->info("Image size: {:d}x{:d}", image.width(), image.height());
 
-            varN += 1;
-            // initialize variables for average and variance
-            if (varN == 1)
+            // consecutive pointwise operations are deferred and then applied in a single pass,
+            // right before the next operation that needs the pixels, or while saving
+            PixelPipeline pending;
+            auto applyPending = [&image,&pending]()
             {
-                // set images to zeros
-                varImg = avgImg = image.unaryExpr([](const Color4 & c)
-                {
-                    return Color4(0,0,0,0);
-                });
-            }
+                pending.applyTo(image);
+                pending = PixelPipeline();
+            };
 
             if (fixNaNs || !dryRun)
-                image = image.unaryExpr([nanColor](const Color4 & c)
-                {
-                    return isfinite(c.sum()) ? c : Color4(nanColor, c[3]);
-                });
+                pending.then(PixelPipeline::replaceNonFinite(nanColor));
 
-            if (!avgFilename.empty() || !varFilename.empty())
+            if (computeStatistics)
             {
-                if (avgImg.width() != image.width() || avgImg.height() != image.height())
-                    throw invalid_argument("Images do not have the same size.");
-
-                // incremental average and variance computation
-                auto delta = image - avgImg;
-                avgImg += delta/Color4(varN,varN,varN,varN);
-                auto delta2 = image - avgImg;
-                varImg += delta * delta2;
+                applyPending();
+                chunkStatistics.add(image);
             }
 
             if (filter)
@@ -508,7 +855,10 @@ int main(int argc, char **argv)
                 console->info("Filtering image with {}({})...", filterType, filterParams);
 
                 if (!dryRun)
+                {
+                    applyPending();
                     image = filter(image);
+                }
             }
 
             if (resize || remap)
@@ -521,27 +871,40 @@ int main(int argc, char **argv)
                     h = absoluteHeight;
                 }
 
+                applyPending();
+
                 if (!remap)
                 {
                     console->info("Resizing image to {:d}x{:d}...", w, h);
-                    image = image.resized(w, h);
+                    image = image.resized(w, h, resizeFilter, AtomicProgress(), borderModeX, borderModeY);
                 }
                 else
                 {
                     console->info("Remapping image to {:d}x{:d}...", w, h);
-                    AtomicProgress progress;
-                    image = image.resampled(w, h, progress, warp, samples,
-                                            sampler, borderModeX, borderModeY);
+                    if (filteredRemap)
+                    {
+                        ImagePyramid pyramid(make_shared<const HDRImage>(std::move(image)), borderModeX, borderModeY);
+                        image = pyramid.warped(w, h, warp);
+                    }
+                    else
+                    {
+                        auto map = warpMaps.get(Eigen::Vector2i(image.width(), image.height()), Eigen::Vector2i(w, h));
+                        image = map->applied(image);
+                    }
                 }
             }
 
             if (makeNoise)
             {
+                // every pixel is overwritten
+                pending = PixelPipeline();
+                // seeded by the file index, so that the noise does not depend on the number of jobs
+                std::mt19937 rand(53 + uint32_t(i));
+                normal_distribution<float> dist(normalDist.param());
                 for (int y = 0; y < image.height(); ++y)
                     for (int x = 0; x < image.width(); ++x)
                     {
-                        image(x,y) = Color4(normalDist(g_rand), normalDist(g_rand),
-                                      normalDist(g_rand), 1.0f);
+                        image(x,y) = Color4(dist(rand), dist(rand), dist(rand), 1.0f);
                     }
             }
 
@@ -551,9 +914,11 @@ int main(int argc, char **argv)
                     image.height() != referenceImage.height())
                 {
                     console->error("Images must have same dimensions!");
-                    continue;
+                    return;
                 }
 
+                applyPending();
+
                 if (errorType == "squared")
                     image = (image-referenceImage).square();
                 else if (errorType == "absolute")
@@ -571,9 +936,7 @@ int main(int argc, char **argv)
             }
 
             if (invert)
-            {
-                image = Color4(1.0f, 1.0f, 1.0f, 2.0f) - image;
-            }
+                pending.thenMap([](const Color4 & c) {return Color4(1.0f, 1.0f, 1.0f, 2.0f) - c;});
 
             if (saveFiles)
             {
@@ -589,34 +952,79 @@ int main(int argc, char **argv)
                 console->info("Writing image to \"{}\"...", filename);
 
                 if (!dryRun)
-                    image.save(filename, powf(2.0f, exposure), gamma, sRGB, dither);
+                    image.save(filename, powf(2.0f, exposure), gamma, sRGB, dither, pending);
             }
+        };
+
+        auto processChunk = [&](size_t c)
+        {
+            PixelStatistics chunkStatistics;
+            for (size_t i = c * chunkSize; i < min(inFiles.size(), (c + 1) * chunkSize); ++i)
+                processFile(i, chunkStatistics);
+
+            if (computeStatistics)
+            {
+                FileOrder::Turn mergeTurn(mergeOrder, c);
+                if (mergeTurn.take())
+                    statistics.merge(chunkStatistics);
+            }
+        };
+
+        if (jobs == 1)
+        {
+            for (size_t c = 0; c < numChunks; ++c)
+                processChunk(c);
+        }
+        else
+        {
+            // each job processes one chunk at a time, which bounds the number of images in memory
+            atomic<size_t> nextChunk(0);
+            exception_ptr error;
+            mutex errorMutex;
+            vector<thread> workers;
+            for (int j = 0; j < min(jobs, int(numChunks)); ++j)
+                workers.emplace_back([&]()
+                {
+                    for (size_t c = nextChunk++; c < numChunks; c = nextChunk++)
+                    {
+                        try
+                        {
+                            processChunk(c);
+                        }
+                        catch (...)
+                        {
+                            lock_guard<mutex> lock(errorMutex);
+                            if (!error)
+                                error = current_exception();
+                            // don't start on any more files, and don't let the others wait for
+                            // turns that will never be passed
+                            nextChunk = numChunks;
+                            mergeOrder.abort();
+                        }
+                    }
+                });
+
+            for (auto & worker : workers)
+                worker.join();
+
+            if (error)
+                rethrow_exception(error);
         }
 
         if (!avgFilename.empty())
         {
-            // avgImg *= Color4(1.0f/inFiles.size());
-
             console->info("Writing average image to \"{}\"...", avgFilename);
 
             if (!dryRun)
-                avgImg.save(avgFilename, powf(2.0f, exposure), gamma, sRGB, dither);
+                statistics.mean().save(avgFilename, powf(2.0f, exposure), gamma, sRGB, dither);
         }
 
         if (!varFilename.empty())
         {
-            varImg /= Color4(varN - 1, varN - 1, varN - 1, varN - 1);
-
-            // set alpha channel to 1
-            varImg = varImg.unaryExpr([](const Color4 & c)
-            {
-                return Color4(c.r,c.g,c.b,1);
-            });
-
             console->info("Writing variance image to \"{}\"...", varFilename);
 
             if (!dryRun)
-                varImg.save(varFilename, powf(2.0f, exposure), gamma, sRGB, dither);
+                statistics.variance().save(varFilename, powf(2.0f, exposure), gamma, sRGB, dither);
         }
     }
     // Exceptions will only be thrown upon failed logger or sink construction (not during logging)
@@ -8,21 +8,26 @@
 #include <ctype.h>               // for tolower
 #include <stdlib.h>              // for abs
 #include <algorithm>             // for nth_element, transform
+#include <bitset>                // for bitset
+#include <climits>               // for INT_MIN
 #include <cmath>                 // for floor, pow, exp, ceil, round, sqrt
+#include <complex>               // for complex
+#include <cstdint>               // for uint32_t, uint64_t
+#include <cstring>               // for memcpy
 #include <exception>             // for exception
 #include <functional>            // for pointer_to_unary_function, function
+#include <limits>                // for numeric_limits
 #include <stdexcept>             // for runtime_error, out_of_range
 #include <string>                // for allocator, operator==, basic_string
 #include <vector>                // for vector
 #include "Common.h"              // for lerp, mod, clamp, getExtension
 #include "Colorspace.h"
 #include "ParallelFor.h"
+#include "PixelPipeline.h"
+#include "ThreadPool.h"
 #include "Timer.h"
 #include <spdlog/spdlog.h>
-
-
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include "stb_image_resize.h"    // for stbir_resize_float
+#include <unsupported/Eigen/FFT>
 
 
 using namespace std;
@@ -37,21 +42,100 @@ const Color4 g_blackPixel(0,0,0,0);
 // create a vector containing the normalized values of a 1D Gaussian filter
 ArrayXXf horizontalGaussianKernel(float sigma, float truncate);
 int wrapCoord(int p, int maxP, HDRImage::BorderMode m);
-void bilinearGreen(HDRImage &raw, int offsetX, int offsetY);
+void bilinearGreen(HDRImage::ChannelView G, int offsetX, int offsetY);
 void PhelippeauGreen(HDRImage &raw, const Vector2i & redOffset);
 void MalvarGreen(HDRImage &raw, int c, const Vector2i & redOffset);
 void MalvarRedOrBlueAtGreen(HDRImage &raw, int c, const Vector2i &redOffset, bool horizontal);
 void MalvarRedOrBlue(HDRImage &raw, int c1, int c2, const Vector2i &redOffset);
-void bilinearRedBlue(HDRImage &raw, int c, const Vector2i & redOffset);
+void bilinearRedBlue(HDRImage::ChannelView C, const Vector2i & redOffset);
 void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset);
 inline float clamp2(float value, float mn, float mx);
 inline float clamp4(float value, float a, float b, float c, float d);
-inline float interpGreenH(const HDRImage &raw, int x, int y);
-inline float interpGreenV(const HDRImage &raw, int x, int y);
+template <typename Channel> inline float interpGreenH(const Channel &G, int x, int y);
+template <typename Channel> inline float interpGreenV(const Channel &G, int x, int y);
 inline float ghG(const ArrayXXf & G, int i, int j);
 inline float gvG(const ArrayXXf & G, int i, int j);
 inline int bayerColor(int x, int y);
 inline Vector3f cameraToLab(const Vector3f c, const Matrix3f & cameraToXYZ, const vector<float> & LUT);
+
+// The intermediate results of AHD demosaicing for one tile and its surroundings, reused by each thread
+struct AHDScratch
+{
+    ArrayXXf greenH, greenV;                    //!< green, interpolated horizontally and vertically
+    Array<Vector3f,Dynamic,Dynamic> rgbH, rgbV; //!< the two candidate demosaiced colors
+    Array<Vector3f,Dynamic,Dynamic> labH, labV; //!< the candidates in CIE L*a*b*
+    Array<int8_t,Dynamic,Dynamic> homogeneity;  //!< the homogeneity of the horizontal minus that of the vertical candidate
+};
+void demosaicAHDTile(HDRImage & img, const HDRImage::Plane & rawG, const Vector2i & redOffset,
+                     const Matrix3f & cameraToXYZ, float scale, const vector<float> & labLUT,
+                     int x0, int x1, int y0, int y1, AHDScratch & s);
+void recursiveGaussianLines(Color4 * lines, int length, int numLines, float sigma);
+
+// how one axis of an image is cut into blocks for overlap-add FFT convolution
+struct FFTBlocks
+{
+    int start;          //!< first input coordinate of the first block
+    int blockSize;      //!< number of input pixels per block
+    int fftSize;        //!< length of the (zero-padded) transform of each block
+    int numBlocks;
+};
+FFTBlocks fftBlocks(int length, int kernelSize, int center);
+void convolveRows(const HDRImage & src, HDRImage & dst, const ArrayXXf & kernel,
+                  HDRImage::BorderMode mX, AtomicProgress & progress);
+void convolveColumns(const HDRImage & src, HDRImage & dst, const ArrayXXf & kernel,
+                     HDRImage::BorderMode mY, AtomicProgress & progress);
+void medianFilterTile(const HDRImage & src, HDRImage & dst, int channelBegin, int channelEnd,
+                      float radius, bool round, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                      int x0, int x1, int y0, int y1);
+HDRImage medianFilteredChannels(const HDRImage & src, int channelBegin, int channelEnd,
+                                float radius, AtomicProgress progress,
+                                HDRImage::BorderMode mX, HDRImage::BorderMode mY, bool round);
+float fftCostPerPixel(const FFTBlocks & bx, const FFTBlocks & by, int width, int height);
+
+// A region of an image, with the log2 luminance of each pixel that guides the bilateral grid filter
+struct BilateralRegion
+{
+    int x0, y0, width, height;  //!< the region in image coordinates, which may extend past the borders
+    vector<Color4> colors;      //!< the pixels, in scanline order
+    vector<float> guide;        //!< the log2 luminance of each pixel
+    float gMin, gMax;           //!< the range of the guide
+};
+void readBilateralRegion(const HDRImage & img, int x0, int y0, int width, int height,
+                         HDRImage::BorderMode mX, HDRImage::BorderMode mY, BilateralRegion & region);
+// The bilateral grid of a region has cells one sigma across along x, y and log2 luminance, of
+// which only the luminance slices that some pixel falls into are stored
+struct BilateralGridLayout
+{
+    int nx, ny, nz;         //!< the number of cells along x, y and log2 luminance
+    vector<int> sliceIndex; //!< the index among the stored slices of each luminance slice, or -1
+    vector<int> sliceZ;     //!< the luminance slice of each stored slice, in increasing order
+};
+void bilateralGridLayout(const BilateralRegion & region, float sigmaRange, float sigmaDomain,
+                         BilateralGridLayout & layout);
+void bilateralGridTile(const BilateralRegion & region, const BilateralGridLayout & layout, HDRImage & dst,
+                       int x0, int x1, int y0, int y1, float sigmaRange, float sigmaDomain);
+void bilateralDirectTile(const BilateralRegion & region, HDRImage & dst, int x0, int x1, int y0, int y1,
+                         float sigmaRange, float sigmaDomain, int radius);
+
+// The weights with which each output pixel of a resize reads a run of consecutive source pixels
+// along one axis. Source pixels outside the image are resolved with the border mode when filtering.
+struct ResizeTaps
+{
+    int stride = 0;         //!< the weights of output pixel i start at weight[i * stride]
+    vector<int> first;      //!< the first source pixel read by each output pixel
+    vector<int> count;      //!< the number of source pixels read by each output pixel
+    vector<float> weight;   //!< normalized weights
+    vector<int> lobeFirst;  //!< offset of the first tap under the central (positive) lobe of the filter
+    vector<int> lobeCount;  //!< the number of taps under the central lobe
+    int begin = 0, end = 0; //!< the range of source pixels read by all output pixels
+};
+float resizeFilterValue(HDRImage::ResizeFilter filter, float x);
+float resizeFilterRadius(HDRImage::ResizeFilter filter);
+ResizeTaps resizeTaps(int srcSize, int dstSize, HDRImage::ResizeFilter filter);
+void resizeRows(const HDRImage & src, HDRImage & dst, const ResizeTaps & taps, bool clampRinging,
+                HDRImage::BorderMode mX, AtomicProgress progress);
+void resizeColumns(const HDRImage & src, HDRImage & dst, const ResizeTaps & taps, bool clampRinging,
+                   HDRImage::BorderMode mY, AtomicProgress progress);
 } // namespace
 
 
@@ -78,6 +162,19 @@ const vector<string> & HDRImage::samplerNames()
 	return names;
 }
 
+const vector<string> & HDRImage::resizeFilterNames()
+{
+	static const vector<string> names =
+		{
+			"Box",
+			"Tent",
+			"Mitchell",
+			"Lanczos3",
+			"Gaussian"
+		};
+	return names;
+}
+
 const Color4 & HDRImage::pixel(int x, int y, BorderMode mX, BorderMode mY) const
 {
 	x = wrapCoord(x, width(), mX);
@@ -98,6 +195,34 @@ Color4 & HDRImage::pixel(int x, int y, BorderMode mX, BorderMode mY)
 	return (*this)(x, y);
 }
 
+int HDRImage::wrapCoordinate(int p, int size, BorderMode m)
+{
+	return wrapCoord(p, size, m);
+}
+
+HDRImage::Plane HDRImage::channel(int c) const
+{
+    Plane plane(width(), height());
+    ConstChannelView src = channelView(c);
+    parallel_for_range(0, height(), [&plane,&src](int y0, int y1)
+    {
+        plane.middleCols(y0, y1-y0) = src.middleCols(y0, y1-y0);
+    });
+    return plane;
+}
+
+void HDRImage::setChannel(int c, const Plane & plane)
+{
+    if (plane.rows() != width() || plane.cols() != height())
+        throw invalid_argument("Plane and image dimensions do not match.");
+
+    ChannelView dst = channelView(c);
+    parallel_for_range(0, height(), [&plane,&dst](int y0, int y1)
+    {
+        dst.middleCols(y0, y1-y0) = plane.middleCols(y0, y1-y0);
+    });
+}
+
 Color4 HDRImage::sample(float sx, float sy, Sampler s, BorderMode mX, BorderMode mY) const
 {
 	switch (s)
@@ -176,25 +301,33 @@ HDRImage HDRImage::resampled(int w, int h,
 
     Timer timer;
     progress.setNumSteps(result.height());
-    // for every pixel in the image
-    parallel_for(0, result.height(), [this,w,h,&progress,&warpFn,&result,superSample,sampler,mX,mY](int y)
+    // for every pixel in the image, one tile at a time
+    parallel_for_2d(0, result.width(), 0, result.height(),
+                    [this,w,h,&progress,&warpFn,&result,superSample,sampler,mX,mY](int x0, int x1, int y0, int y1)
     {
-        for (int x = 0; x < result.width(); ++x)
+        for (int y = y0; y < y1; ++y)
         {
-            Color4 sum(0, 0, 0, 0);
-            for (int yy = 0; yy < superSample; ++yy)
+            progress.checkCanceled();
+
+            for (int x = x0; x < x1; ++x)
             {
-                float j = (yy + 0.5f) / superSample;
-                for (int xx = 0; xx < superSample; ++xx)
+                Color4 sum(0, 0, 0, 0);
+                for (int yy = 0; yy < superSample; ++yy)
                 {
-                    float i = (xx + 0.5f) / superSample;
-                    Vector2f srcUV = warpFn(Vector2f((x + i) / w, (y + j) / h)).array() * Array2f(width(), height());
-                    sum += sample(srcUV(0), srcUV(1), sampler, mX, mY);
+                    float j = (yy + 0.5f) / superSample;
+                    for (int xx = 0; xx < superSample; ++xx)
+                    {
+                        float i = (xx + 0.5f) / superSample;
+                        Vector2f srcUV = warpFn(Vector2f((x + i) / w, (y + j) / h)).array() * Array2f(width(), height());
+                        sum += sample(srcUV(0), srcUV(1), sampler, mX, mY);
+                    }
                 }
+                result(x, y) = sum / (superSample * superSample);
             }
-            result(x, y) = sum / (superSample * superSample);
         }
-        ++progress;
+        // count a whole row once its last tile is done
+        if (x1 == result.width())
+            progress += y1 - y0;
     });
     spdlog::get("console")->trace("Resampling took: {} seconds.", (timer.elapsed()/1000.f));
     return result;
@@ -203,44 +336,241 @@ HDRImage HDRImage::resampled(int w, int h,
 
 HDRImage HDRImage::convolved(const ArrayXXf &kernel, AtomicProgress progress,
                              BorderMode mX, BorderMode mY) const
+{
+    int centerX = int((kernel.rows()-1.0)/2.0);
+    int centerY = int((kernel.cols()-1.0)/2.0);
+    float fftCost = fftCostPerPixel(fftBlocks(width(), kernel.rows(), centerX),
+                                    fftBlocks(height(), kernel.cols(), centerY), width(), height());
+
+    // convolvedDirect's dedicated loops for 1D kernels take about a quarter as long per tap
+    float directCost = kernel.size() * (kernel.rows() == 1 || kernel.cols() == 1 ? 0.25f : 1.f);
+
+    return fftCost < directCost ? convolvedFFT(kernel, progress, mX, mY) :
+                                  convolvedDirect(kernel, progress, mX, mY);
+}
+
+HDRImage HDRImage::convolvedDirect(const ArrayXXf &kernel, AtomicProgress progress,
+                                   BorderMode mX, BorderMode mY) const
 {
     HDRImage result(width(), height());
 
+    // 1D kernels get dedicated loops along contiguous rows
+    if (kernel.cols() == 1 || kernel.rows() == 1)
+    {
+        Timer timer;
+        if (kernel.cols() == 1)
+            convolveRows(*this, result, kernel, mX, progress);
+        else
+            convolveColumns(*this, result, kernel, mY, progress);
+        spdlog::get("console")->trace("Convolution took: {} seconds.", (timer.elapsed()/1000.f));
+        return result;
+    }
+
     int centerX = int((kernel.rows()-1.0)/2.0);
     int centerY = int((kernel.cols()-1.0)/2.0);
 
     Timer timer;
-	progress.setNumSteps(result.width());
-    // for every pixel in the image
-    parallel_for(0, result.width(), [this,&progress,kernel,mX,mY,&result,centerX,centerY](int x)
+	progress.setNumSteps(result.height());
+    // for every pixel in the image, one tile at a time
+    parallel_for_2d(0, result.width(), 0, result.height(),
+                    [this,&progress,&kernel,mX,mY,&result,centerX,centerY](int x0, int x1, int y0, int y1)
     {
-        for (int y = 0; y < result.height(); y++)
+        for (int y = y0; y < y1; y++)
         {
-            Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
-            float weightSum = 0.0f;
-            // for every pixel in the kernel
-            for (int xFilter = 0; xFilter < kernel.rows(); xFilter++)
-            {
-                int xx = x-xFilter+centerX;
+            progress.checkCanceled();
 
-                for (int yFilter = 0; yFilter < kernel.cols(); yFilter++)
+            for (int x = x0; x < x1; x++)
+            {
+                Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
+                float weightSum = 0.0f;
+                // for every pixel in the kernel
+                for (int xFilter = 0; xFilter < kernel.rows(); xFilter++)
                 {
-                    int yy = y-yFilter+centerY;
-                    accum += kernel(xFilter, yFilter) * pixel(xx, yy, mX, mY);
-                    weightSum += kernel(xFilter, yFilter);
+                    int xx = x-xFilter+centerX;
+
+                    for (int yFilter = 0; yFilter < kernel.cols(); yFilter++)
+                    {
+                        int yy = y-yFilter+centerY;
+                        accum += kernel(xFilter, yFilter) * pixel(xx, yy, mX, mY);
+                        weightSum += kernel(xFilter, yFilter);
+                    }
                 }
-            }
 
-            // assign the pixel the value from convolution
-            result(x,y) = accum / weightSum;
+                // assign the pixel the value from convolution
+                result(x,y) = accum / weightSum;
+            }
         }
-        ++progress;
+        if (x1 == result.width())
+            progress += y1 - y0;
     });
     spdlog::get("console")->trace("Convolution took: {} seconds.", (timer.elapsed()/1000.f));
 
     return result;
 }
 
+HDRImage HDRImage::convolvedFFT(const ArrayXXf &kernel, AtomicProgress progress,
+                                BorderMode mX, BorderMode mY) const
+{
+    typedef complex<float> Complex;
+
+    int kw = kernel.rows(), kh = kernel.cols();
+    int centerX = int((kw-1.0)/2.0);
+    int centerY = int((kh-1.0)/2.0);
+    FFTBlocks bx = fftBlocks(width(), kw, centerX);
+    FFTBlocks by = fftBlocks(height(), kh, centerY);
+    int nw = bx.fftSize, nh = by.fftSize;
+    bool alongX = kw > 1, alongY = kh > 1;
+
+    Timer timer;
+
+    // Transform the kernel, zero-padded to the block transform size. Along an axis where the
+    // kernel is just one pixel wide we don't transform at all, and the spectrum has a single
+    // entry along that axis. The normalization of both the kernel and the inverse transforms
+    // is folded into the spectrum.
+    int sw = alongX ? nw : 1, sh = alongY ? nh : 1;
+    vector<Complex> spectrum(size_t(sw) * sh, Complex(0.f));
+    {
+        float scale = 1.f / (kernel.sum() * sw * sh);
+        for (int y = 0; y < kh; ++y)
+            for (int x = 0; x < kw; ++x)
+                spectrum[x + size_t(sw) * y] = scale * kernel(x, y);
+
+        FFT<float> fft;
+        vector<Complex> line(std::max(sw, sh)), transformed(std::max(sw, sh));
+        if (alongX)
+            for (int y = 0; y < kh; ++y)
+            {
+                fft.fwd(transformed.data(), &spectrum[size_t(sw) * y], sw);
+                copy(transformed.begin(), transformed.begin() + sw, &spectrum[size_t(sw) * y]);
+            }
+        if (alongY)
+            for (int x = 0; x < sw; ++x)
+            {
+                for (int y = 0; y < sh; ++y)
+                    line[y] = spectrum[x + size_t(sw) * y];
+                fft.fwd(transformed.data(), line.data(), sh);
+                for (int y = 0; y < sh; ++y)
+                    spectrum[x + size_t(sw) * y] = transformed[y];
+            }
+    }
+
+    // Per-thread scratch space for transforming one block. Since the kernel is real, we can
+    // transform two color channels at once, one in the real part and one in the imaginary part.
+    struct Scratch
+    {
+        FFT<float> fft;
+        vector<Complex> rg, ba, line, transformed;
+    };
+    vector<Scratch> scratch(ThreadPool::global().numThreads() + 1);
+
+    HDRImage result(width(), height());
+    result.setConstant(Color4(0.f));
+
+    auto convolveBlock = [&](int blockX, int blockY, size_t cpu)
+    {
+        Scratch & s = scratch[cpu];
+        if (s.rg.empty())
+        {
+            s.fft.SetFlag(FFT<float>::Unscaled);
+            s.rg.resize(size_t(nw) * nh);
+            s.ba.resize(size_t(nw) * nh);
+            s.line.resize(std::max(nw, nh));
+            s.transformed.resize(std::max(nw, nh));
+        }
+        std::fill(s.rg.begin(), s.rg.end(), Complex(0.f));
+        std::fill(s.ba.begin(), s.ba.end(), Complex(0.f));
+
+        // gather the block's input, which may extend past the image into the border
+        int x0 = bx.start + blockX * bx.blockSize, y0 = by.start + blockY * by.blockSize;
+        int bw = std::min(bx.blockSize, width() + kw - 1 - blockX * bx.blockSize);
+        int bh = std::min(by.blockSize, height() + kh - 1 - blockY * by.blockSize);
+        for (int y = 0; y < bh; ++y)
+            for (int x = 0; x < bw; ++x)
+            {
+                const Color4 & c = pixel(x0 + x, y0 + y, mX, mY);
+                s.rg[x + size_t(nw) * y] = Complex(c.r, c.g);
+                s.ba[x + size_t(nw) * y] = Complex(c.b, c.a);
+            }
+
+        // transform along x, then along y; rows past the block's input are zero before the first pass
+        auto transformRows = [&s,nw](vector<Complex> & data, int y0, int y1, bool inverse)
+        {
+            for (int y = y0; y < y1; ++y)
+            {
+                Complex * row = &data[size_t(nw) * y];
+                if (inverse)
+                    s.fft.inv(s.transformed.data(), row, nw);
+                else
+                    s.fft.fwd(s.transformed.data(), row, nw);
+                copy(s.transformed.begin(), s.transformed.begin() + nw, row);
+            }
+        };
+        auto transformColumns = [&s,nw,nh](vector<Complex> & data, bool inverse)
+        {
+            for (int x = 0; x < nw; ++x)
+            {
+                for (int y = 0; y < nh; ++y)
+                    s.line[y] = data[x + size_t(nw) * y];
+                if (inverse)
+                    s.fft.inv(s.transformed.data(), s.line.data(), nh);
+                else
+                    s.fft.fwd(s.transformed.data(), s.line.data(), nh);
+                for (int y = 0; y < nh; ++y)
+                    data[x + size_t(nw) * y] = s.transformed[y];
+            }
+        };
+
+        // the output pixels covered by the block's linear convolution
+        int outX0 = x0 - centerX, outY0 = y0 - centerY;
+        int m0 = std::max(0, -outY0), m1 = std::min(bh + kh - 1, height() - outY0);
+        int n0 = std::max(0, -outX0), n1 = std::min(bw + kw - 1, width() - outX0);
+
+        for (auto * data : {&s.rg, &s.ba})
+        {
+            if (alongX)
+                transformRows(*data, 0, bh, false);
+            if (alongY)
+                transformColumns(*data, false);
+
+            for (int y = 0; y < nh; ++y)
+                for (int x = 0; x < nw; ++x)
+                    (*data)[x + size_t(nw) * y] *= spectrum[(alongX ? x : 0) + size_t(sw) * (alongY ? y : 0)];
+
+            if (alongY)
+                transformColumns(*data, true);
+            if (alongX)
+                transformRows(*data, m0, m1, true);
+        }
+
+        // add the block's full linear convolution into the output
+        for (int m = m0; m < m1; ++m)
+            for (int n = n0; n < n1; ++n)
+            {
+                const Complex & rg = s.rg[n + size_t(nw) * m];
+                const Complex & ba = s.ba[n + size_t(nw) * m];
+                result(outX0 + n, outY0 + m) += Color4(rg.real(), rg.imag(), ba.real(), ba.imag());
+            }
+    };
+
+    // The output of a block overlaps the output of its immediate neighbors, but no others, since
+    // blocks are at least as large as the kernel. Processing the blocks in four phases according
+    // to the parity of their position means that blocks processed concurrently never overlap.
+    progress.setNumSteps(bx.numBlocks * by.numBlocks);
+    for (int phase = 0; phase < 4; ++phase)
+    {
+        int px = phase % 2, py = phase / 2;
+        int numX = (bx.numBlocks - px + 1) / 2, numY = (by.numBlocks - py + 1) / 2;
+        parallel_for(0, numX * numY, [&convolveBlock,&progress,numX,px,py](int i, size_t cpu)
+        {
+            convolveBlock(2 * (i % numX) + px, 2 * (i / numX) + py, cpu);
+            ++progress;
+        });
+    }
+    spdlog::get("console")->trace("FFT convolution took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return result;
+}
+
 HDRImage HDRImage::GaussianBlurredX(float sigmaX, AtomicProgress progress, BorderMode mX, float truncateX) const
 {
     return convolved(horizontalGaussianKernel(sigmaX, truncateX), progress, mX, mX);
@@ -272,48 +602,13 @@ HDRImage HDRImage::unsharpMasked(float sigma, float strength, AtomicProgress pro
 HDRImage HDRImage::medianFiltered(float radius, int channel, AtomicProgress progress,
                                   BorderMode mX, BorderMode mY, bool round) const
 {
-    int radiusi = int(std::ceil(radius));
-    HDRImage tempBuffer = *this;
-
-    Timer timer;
-    progress.setNumSteps(height());
-    // for every pixel in the image
-    parallel_for(0, height(), [this,&tempBuffer,&progress,radius,radiusi,channel,mX,mY,round](int y)
-    {
-        vector<float> mBuffer;
-        mBuffer.reserve((2*radiusi)*(2*radiusi));
-        for (int x = 0; x < tempBuffer.width(); x++)
-        {
-            mBuffer.clear();
-
-            int xCoord, yCoord;
-            // over all pixels in the neighborhood kernel
-            for (int i = -radiusi; i <= radiusi; i++)
-            {
-                xCoord = x + i;
-                for (int j = -radiusi; j <= radiusi; j++)
-                {
-                    if (round && i*i + j*j > radius*radius)
-                        continue;
-
-                    yCoord = y + j;
-                    mBuffer.push_back(pixel(xCoord, yCoord, mX, mY)[channel]);
-                }
-            }
-
-            int num = mBuffer.size();
-            int med = (num-1)/2;
-
-            nth_element(mBuffer.begin() + 0,
-                        mBuffer.begin() + med,
-                        mBuffer.begin() + mBuffer.size());
-            tempBuffer(x,y)[channel] = mBuffer[med];
-        }
-        ++progress;
-    });
-    spdlog::get("console")->trace("Median filter took: {} seconds.", (timer.elapsed()/1000.f));
+    return medianFilteredChannels(*this, channel, channel + 1, radius, progress, mX, mY, round);
+}
 
-    return tempBuffer;
+HDRImage HDRImage::medianFiltered(float radius, AtomicProgress progress,
+                                  BorderMode mX, BorderMode mY, bool round) const
+{
+    return medianFilteredChannels(*this, 0, 4, radius, progress, mX, mY, round);
 }
 
 
@@ -329,36 +624,43 @@ HDRImage HDRImage::bilateralFiltered(float sigmaRange, float sigmaDomain,
     Timer timer;
     progress.setNumSteps(height());
     // for every pixel in the image
-    parallel_for(0, filtered.height(), [this,&filtered,&progress,radius,sigmaRange,sigmaDomain,mX,mY](int y)
+    parallel_for_2d(0, filtered.width(), 0, filtered.height(),
+                    [this,&filtered,&progress,radius,sigmaRange,sigmaDomain,mX,mY](int x0, int x1, int y0, int y1)
     {
-        for (int x = 0; x < filtered.width(); x++)
+        for (int y = y0; y < y1; y++)
         {
-            // initilize normalizer and sum value to 0 for every pixel location
-            float weightSum = 0.0f;
-            Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
+            progress.checkCanceled();
 
-            for (int yFilter = -radius; yFilter <= radius; yFilter++)
+            for (int x = x0; x < x1; x++)
             {
-                int yy = y+yFilter;
-                for (int xFilter = -radius; xFilter <= radius; xFilter++)
+                // initilize normalizer and sum value to 0 for every pixel location
+                float weightSum = 0.0f;
+                Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
+
+                for (int yFilter = -radius; yFilter <= radius; yFilter++)
                 {
-                    int xx = x+xFilter;
-                    // calculate the squared distance between the 2 pixels (in range)
-                    float rangeExp = ::pow(pixel(xx,yy,mX,mY) - (*this)(x,y), 2).sum();
-                    float domainExp = std::pow(xFilter,2) + std::pow(yFilter,2);
-
-                    // calculate the exponentiated weighting factor from the domain and range
-                    float factorDomain = std::exp(-domainExp / (2.0 * std::pow(sigmaDomain,2)));
-                    float factorRange = std::exp(-rangeExp / (2.0 * std::pow(sigmaRange,2)));
-                    weightSum += factorDomain * factorRange;
-                    accum += factorDomain * factorRange * pixel(xx,yy,mX,mY);
+                    int yy = y+yFilter;
+                    for (int xFilter = -radius; xFilter <= radius; xFilter++)
+                    {
+                        int xx = x+xFilter;
+                        // calculate the squared distance between the 2 pixels (in range)
+                        float rangeExp = ::pow(pixel(xx,yy,mX,mY) - (*this)(x,y), 2).sum();
+                        float domainExp = std::pow(xFilter,2) + std::pow(yFilter,2);
+
+                        // calculate the exponentiated weighting factor from the domain and range
+                        float factorDomain = std::exp(-domainExp / (2.0 * std::pow(sigmaDomain,2)));
+                        float factorRange = std::exp(-rangeExp / (2.0 * std::pow(sigmaRange,2)));
+                        weightSum += factorDomain * factorRange;
+                        accum += factorDomain * factorRange * pixel(xx,yy,mX,mY);
+                    }
                 }
-            }
 
-            // set pixel in filtered image to weighted sum of values in the filter region
-            filtered(x,y) = accum/weightSum;
+                // set pixel in filtered image to weighted sum of values in the filter region
+                filtered(x,y) = accum/weightSum;
+            }
         }
-        ++progress;
+        if (x1 == filtered.width())
+            progress += y1 - y0;
     });
     spdlog::get("console")->trace("Bilateral filter took: {} seconds.", (timer.elapsed()/1000.f));
 
@@ -366,6 +668,57 @@ HDRImage HDRImage::bilateralFiltered(float sigmaRange, float sigmaDomain,
 }
 
 
+HDRImage HDRImage::bilateralGridFiltered(float sigmaRange, float sigmaDomain,
+                                         AtomicProgress progress,
+                                         BorderMode mX, BorderMode mY) const
+{
+    // also rejects NaNs
+    if (!(sigmaRange > 0.f) || !(sigmaDomain > 0.f))
+        throw invalid_argument(fmt::format("Bilateral grid sigmas must be positive, not {} and {}.",
+                                           sigmaRange, sigmaDomain));
+
+    // every tile reads the surrounding pixels that its pixels are filtered with, which
+    // covers both the grid's cells and the neighbors that are weighed directly; tiles several
+    // aprons across keep this overlap, which is splatted by every tile, small
+    int radius = int(std::ceil(3.f * sigmaDomain));
+    int apron = int(std::ceil(4.f * sigmaDomain));
+    int tileSize = std::max(128, 4 * apron);
+
+    HDRImage filtered(width(), height());
+
+    Timer timer;
+    progress.setNumSteps(height());
+    parallel_for_2d(0, width(), 0, height(),
+                    [this,&filtered,&progress,radius,apron,sigmaRange,sigmaDomain,mX,mY](int x0, int x1, int y0, int y1)
+    {
+        progress.checkCanceled();
+
+        BilateralRegion region;
+        readBilateralRegion(*this, x0 - apron, y0 - apron, x1 - x0 + 2 * apron, y1 - y0 + 2 * apron, mX, mY, region);
+
+        // The grid has cells one sigma across, so for small sigmas it has about as many cells
+        // per luminance slice as the region has pixels, and it is faster to weigh each pixel's
+        // few neighbors directly. In units of one neighbor weighed directly, splatting and
+        // slicing a pixel takes about 6, and blurring a stored cell along all three axes about 15.
+        BilateralGridLayout layout;
+        bilateralGridLayout(region, sigmaRange, sigmaDomain, layout);
+        float gridCost = 6.f * region.colors.size() + 15.f * float(layout.nx) * layout.ny * layout.sliceZ.size();
+        float directCost = float(x1 - x0) * (y1 - y0) * (2 * radius + 1) * (2 * radius + 1);
+
+        if (directCost < gridCost)
+            bilateralDirectTile(region, filtered, x0, x1, y0, y1, sigmaRange, sigmaDomain, radius);
+        else
+            bilateralGridTile(region, layout, filtered, x0, x1, y0, y1, sigmaRange, sigmaDomain);
+
+        if (x1 == filtered.width())
+            progress += y1 - y0;
+    }, tileSize, tileSize);
+    spdlog::get("console")->trace("Bilateral grid filter took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return filtered;
+}
+
+
 static int nextOddInt(int i)
 {
   return (i % 2 == 0) ? i+1 : i;
@@ -453,65 +806,176 @@ HDRImage HDRImage::fastGaussianBlurred(float sigmaX, float sigmaY,
 }
 
 
+HDRImage HDRImage::recursiveGaussianBlurred(float sigmaX, float sigmaY,
+                                            AtomicProgress progress,
+                                            BorderMode mX, BorderMode mY) const
+{
+    // below this, the recursive filter's response noticeably deviates from a Gaussian
+    const float minSigma = 2.f;
+    // number of columns filtered together in the vertical pass
+    const int chunkWidth = 16;
+
+    Timer timer;
+    bool recursiveX = sigmaX >= minSigma, recursiveY = sigmaY >= minSigma;
+
+    // the recursion needs to run in from outside the image for the border mode to take effect,
+    // so each line is padded with enough border pixels for the filter's response to decay
+    int padX = int(std::ceil(4.f * sigmaX));
+    int padY = int(std::ceil(4.f * sigmaY));
+    int lineX = width() + 2 * padX;
+    int lineY = height() + 2 * padY;
+
+    // a single scratch buffer, with one slot per thread, serves both passes
+    size_t slotSize = std::max(recursiveX ? size_t(lineX) : 0, recursiveY ? size_t(lineY) * chunkWidth : 0);
+    vector<Color4> scratch(slotSize * (ThreadPool::global().numThreads() + 1));
+
+    HDRImage result;
+    if (recursiveX)
+    {
+        result = *this;
+        const HDRImage & src = result;
+        AtomicProgress xProgress(progress, 0.5f);
+        xProgress.setNumSteps(height());
+        parallel_for(0, height(), [&result,&src,&scratch,&xProgress,slotSize,padX,lineX,sigmaX,mX](int y, size_t cpu)
+        {
+            Color4 * line = &scratch[cpu * slotSize];
+            for (int i = 0; i < lineX; ++i)
+                line[i] = src.pixel(i - padX, y, mX, mX);
+
+            recursiveGaussianLines(line, lineX, 1, sigmaX);
+
+            for (int x = 0; x < result.width(); ++x)
+                result(x, y) = line[x + padX];
+            ++xProgress;
+        });
+    }
+    else if (sigmaX > 0.f)
+        result = GaussianBlurredX(sigmaX, AtomicProgress(progress, 0.5f), mX);
+    else
+        result = *this;
+
+    if (recursiveY)
+    {
+        // filter chunks of columns at once, interleaved so that each step of the recursion
+        // runs along a contiguous row of the chunk
+        const HDRImage & src = result;
+        int numChunks = (width() + chunkWidth - 1) / chunkWidth;
+        AtomicProgress yProgress(progress, 0.5f);
+        yProgress.setNumSteps(numChunks);
+        parallel_for(0, numChunks, [&result,&src,&scratch,&yProgress,slotSize,chunkWidth,padY,lineY,sigmaY,mY](int chunk, size_t cpu)
+        {
+            Color4 * lines = &scratch[cpu * slotSize];
+            int x0 = chunk * chunkWidth;
+            int n = std::min(chunkWidth, result.width() - x0);
+            for (int i = 0; i < lineY; ++i)
+                for (int k = 0; k < n; ++k)
+                    lines[i * n + k] = src.pixel(x0 + k, i - padY, mY, mY);
+
+            recursiveGaussianLines(lines, lineY, n, sigmaY);
+
+            for (int y = 0; y < result.height(); ++y)
+                for (int k = 0; k < n; ++k)
+                    result(x0 + k, y) = lines[(y + padY) * n + k];
+            ++yProgress;
+        });
+    }
+    else if (sigmaY > 0.f)
+        result = result.GaussianBlurredY(sigmaY, AtomicProgress(progress, 0.5f), mY);
+
+    spdlog::get("console")->trace("recursiveGaussianBlurred filter took: {} seconds.", (timer.elapsed()/1000.f));
+    return result;
+}
+
+
 HDRImage HDRImage::boxBlurredX(int leftSize, int rightSize, AtomicProgress progress, BorderMode mX) const
 {
     HDRImage filtered(width(), height());
+    float scale = 1.f/(leftSize + rightSize + 1);
 
     Timer timer;
 	progress.setNumSteps(filtered.height());
     // for every pixel in the image
-    parallel_for(0, filtered.height(), [this,&filtered,&progress,leftSize,rightSize,mX](int y)
-    {
-        // fill up the accumulator
-        filtered(0, y) = 0;
-        for (int dx = -leftSize; dx <= rightSize; ++dx)
-            filtered(0, y) += pixel(dx, y, mX, mX);
-
-        for (int x = 1; x < width(); ++x)
-            filtered(x, y) = filtered(x-1, y) -
-                             pixel(x-1-leftSize, y, mX, mX) +
-                             pixel(x+rightSize, y, mX, mX);
-	    ++progress;
+    parallel_for_range(0, filtered.height(), [this,&filtered,&progress,leftSize,rightSize,scale,mX](int y0, int y1)
+    {
+        // each row, extended by the box on either side, is gathered once so the running sum
+        // can be updated without going through the border mode logic
+        vector<Color4> line(width() + leftSize + rightSize);
+        for (int y = y0; y < y1; ++y)
+        {
+            for (int i = 0; i < int(line.size()); ++i)
+                line[i] = pixel(i - leftSize, y, mX, mX);
+
+            // fill up the accumulator
+            Color4 sum(0.f);
+            for (int i = 0; i <= leftSize + rightSize; ++i)
+                sum += line[i];
+            filtered(0, y) = sum * scale;
+
+            for (int x = 1; x < width(); ++x)
+            {
+                sum += line[x + leftSize + rightSize] - line[x - 1];
+                filtered(x, y) = sum * scale;
+            }
+        }
+	    progress += y1 - y0;
     });
     spdlog::get("console")->trace("boxBlurredX filter took: {} seconds.", (timer.elapsed()/1000.f));
 
-    return filtered * Color4(1.f/(leftSize + rightSize + 1));
+    return filtered;
 }
 
 
 HDRImage HDRImage::boxBlurredY(int leftSize, int rightSize, AtomicProgress progress, BorderMode mY) const
 {
     HDRImage filtered(width(), height());
+    float scale = 1.f/(leftSize + rightSize + 1);
 
     Timer timer;
 	progress.setNumSteps(filtered.width());
     // for every pixel in the image
-    parallel_for(0, filtered.width(), [this,&filtered,&progress,leftSize,rightSize,mY](int x)
+    // each strip of columns is swept top-to-bottom one row at a time, so that the
+    // running sums are updated along contiguous memory instead of striding down a column
+    parallel_for_range(0, filtered.width(), 128, [this,&filtered,&progress,leftSize,rightSize,scale,mY](int x0, int x1)
     {
-        // fill up the accumulator
-        filtered(x, 0) = 0;
+        int n = 4 * (x1 - x0);
+        vector<float> sums(n, 0.f);
+
+        // add (sign = 1) or subtract (sign = -1) row y of the strip to the running sums
+        auto accumulate = [this,&sums,x0,n,mY](int y, float sign)
+        {
+            y = wrapCoord(y, height(), mY);
+            if (y < 0)
+                return;
+            const float * row = &(*this)(x0, y)[0];
+            for (int i = 0; i < n; ++i)
+                sums[i] += sign * row[i];
+        };
+
+        // fill up the accumulators
         for (int dy = -leftSize; dy <= rightSize; ++dy)
-            filtered(x, 0) += pixel(x, dy, mY, mY);
+            accumulate(dy, 1.f);
+
+        for (int y = 0; y < height(); ++y)
+        {
+            if (y > 0)
+            {
+                accumulate(y + rightSize, 1.f);
+                accumulate(y - 1 - leftSize, -1.f);
+            }
 
-        for (int y = 1; y < height(); ++y)
-            filtered(x, y) = filtered(x, y-1) -
-                             pixel(x, y-1-leftSize, mY, mY) +
-                             pixel(x, y+rightSize, mY, mY);
-	    ++progress;
+            float * out = &filtered(x0, y)[0];
+            for (int i = 0; i < n; ++i)
+                out[i] = sums[i] * scale;
+        }
+	    progress += x1 - x0;
     });
-    spdlog::get("console")->trace("boxBlurredX filter took: {} seconds.", (timer.elapsed()/1000.f));
+    spdlog::get("console")->trace("boxBlurredY filter took: {} seconds.", (timer.elapsed()/1000.f));
 
-    return filtered * Color4(1.f/(leftSize + rightSize + 1));
+    return filtered;
 }
 
-HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const Color4 & bgColor) const
+Vector2i HDRImage::canvasOffset(const Vector2i & oldSize, const Vector2i & newSize, CanvasAnchor anchor)
 {
-    int oldW = width();
-    int oldH = height();
-
-    // fill in new regions with border value
-    HDRImage img = HDRImage::Constant(newW, newH, bgColor);
-
     Vector2i tlDst(0,0);
     // find top-left corner
     switch (anchor)
@@ -519,13 +983,13 @@ HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const
         case HDRImage::TOP_RIGHT:
         case HDRImage::MIDDLE_RIGHT:
         case HDRImage::BOTTOM_RIGHT:
-            tlDst.x() = newW-oldW;
+            tlDst.x() = newSize.x()-oldSize.x();
             break;
 
         case HDRImage::TOP_CENTER:
         case HDRImage::MIDDLE_CENTER:
         case HDRImage::BOTTOM_CENTER:
-            tlDst.x() = (newW-oldW)/2;
+            tlDst.x() = (newSize.x()-oldSize.x())/2;
             break;
 
         case HDRImage::TOP_LEFT:
@@ -540,13 +1004,13 @@ HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const
         case HDRImage::BOTTOM_LEFT:
         case HDRImage::BOTTOM_CENTER:
         case HDRImage::BOTTOM_RIGHT:
-            tlDst.y() = newH-oldH;
+            tlDst.y() = newSize.y()-oldSize.y();
             break;
 
         case HDRImage::MIDDLE_LEFT:
         case HDRImage::MIDDLE_CENTER:
         case HDRImage::MIDDLE_RIGHT:
-            tlDst.y() = (newH-oldH)/2;
+            tlDst.y() = (newSize.y()-oldSize.y())/2;
             break;
 
         case HDRImage::TOP_LEFT:
@@ -557,6 +1021,19 @@ HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const
             break;
     }
 
+    return tlDst;
+}
+
+HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const Color4 & bgColor) const
+{
+    int oldW = width();
+    int oldH = height();
+
+    // fill in new regions with border value
+    HDRImage img = HDRImage::Constant(newW, newH, bgColor);
+
+    Vector2i tlDst = canvasOffset(Vector2i(oldW, oldH), Vector2i(newW, newH), anchor);
+
     Vector2i tlSrc(0,0);
     if (tlDst.x() < 0)
     {
@@ -578,15 +1055,40 @@ HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const
 }
 
 
-HDRImage HDRImage::resized(int w, int h) const
+HDRImage HDRImage::resized(int w, int h, ResizeFilter filter, AtomicProgress progress,
+                           BorderMode mX, BorderMode mY) const
 {
-    HDRImage newImage(w, h);
+    if (w <= 0 || h <= 0)
+        throw invalid_argument(fmt::format("Cannot resize an image to {:d}x{:d} pixels.", w, h));
+
+    Timer timer;
+    ResizeTaps tapsX = resizeTaps(width(), w, filter);
+    ResizeTaps tapsY = resizeTaps(height(), h, filter);
+    // the other filters have no negative weights, so they cannot overshoot anyway
+    bool clampRinging = filter == MITCHELL_FILTER || filter == LANCZOS3_FILTER;
 
-    if (!stbir_resize_float((const float *)data(), width(), height(), 0,
-                            (float *) newImage.data(), w, h, 0, 4))
-        throw runtime_error("Failed to resize image.");
+    // Each pass reads every tap once per row (or column) it filters. Resize along the axis that
+    // leaves the cheaper intermediate image for the second pass first.
+    double rowsFirst = double(tapsX.weight.size()) * height() + double(tapsY.weight.size()) * w;
+    double columnsFirst = double(tapsY.weight.size()) * width() + double(tapsX.weight.size()) * h;
 
-    return newImage;
+    HDRImage result(w, h);
+    if (rowsFirst <= columnsFirst)
+    {
+        HDRImage tmp(w, height());
+        resizeRows(*this, tmp, tapsX, clampRinging, mX, AtomicProgress(progress, 0.5f));
+        resizeColumns(tmp, result, tapsY, clampRinging, mY, AtomicProgress(progress, 0.5f));
+    }
+    else
+    {
+        HDRImage tmp(width(), h);
+        resizeColumns(*this, tmp, tapsY, clampRinging, mY, AtomicProgress(progress, 0.5f));
+        resizeRows(tmp, result, tapsX, clampRinging, mX, AtomicProgress(progress, 0.5f));
+    }
+    spdlog::get("console")->trace("Resizing from {:d}x{:d} to {:d}x{:d} with a {} filter took: {} seconds.",
+                                  width(), height(), w, h, resizeFilterNames()[filter], (timer.elapsed()/1000.f));
+
+    return result;
 }
 
 /*!
@@ -632,7 +1134,7 @@ void HDRImage::bayerMosaic(const Vector2i &redOffset)
  */
 void HDRImage::demosaicGreenLinear(const Vector2i &redOffset)
 {
-    bilinearGreen(*this, redOffset.x(), redOffset.y());
+    bilinearGreen(channelView(1), redOffset.x(), redOffset.y());
 }
 
 /*!
@@ -643,13 +1145,14 @@ void HDRImage::demosaicGreenLinear(const Vector2i &redOffset)
  */
 void HDRImage::demosaicGreenHorizontal(const HDRImage &raw, const Vector2i &redOffset)
 {
-    parallel_for(redOffset.y(), height(), 2, [this,&raw,&redOffset](int y)
+    const ConstChannelView rawG = raw.channelView(1);
+    parallel_for(redOffset.y(), height(), 2, [this,&rawG,&redOffset](int y)
     {
         for (int x = 2+redOffset.x(); x < width()-2; x += 2)
         {
             // populate the green channel into the red and blue pixels
-            (*this)(x  , y  ).g = interpGreenH(raw, x, y);
-            (*this)(x+1, y+1).g = interpGreenH(raw, x + 1, y + 1);
+            (*this)(x  , y  ).g = interpGreenH(rawG, x, y);
+            (*this)(x+1, y+1).g = interpGreenH(rawG, x + 1, y + 1);
         }
     });
 }
@@ -662,12 +1165,13 @@ void HDRImage::demosaicGreenHorizontal(const HDRImage &raw, const Vector2i &redO
  */
 void HDRImage::demosaicGreenVertical(const HDRImage &raw, const Vector2i &redOffset)
 {
-    parallel_for(2+redOffset.y(), height()-2, 2, [this,&raw,&redOffset](int y)
+    const ConstChannelView rawG = raw.channelView(1);
+    parallel_for(2+redOffset.y(), height()-2, 2, [this,&rawG,&redOffset](int y)
     {
         for (int x = redOffset.x(); x < width(); x += 2)
         {
-            (*this)(x  , y  ).g = interpGreenV(raw, x, y);
-            (*this)(x+1, y+1).g = interpGreenV(raw, x + 1, y + 1);
+            (*this)(x  , y  ).g = interpGreenV(rawG, x, y);
+            (*this)(x+1, y+1).g = interpGreenV(rawG, x + 1, y + 1);
         }
     });
 }
@@ -706,8 +1210,8 @@ void HDRImage::demosaicGreenPhelippeau(const Vector2i &redOffset)
  */
 void HDRImage::demosaicRedBlueLinear(const Vector2i &redOffset)
 {
-    bilinearRedBlue(*this, 0, redOffset);
-    bilinearRedBlue(*this, 2, Vector2i((redOffset.x() + 1) % 2, (redOffset.y() + 1) % 2));
+    bilinearRedBlue(channelView(0), redOffset);
+    bilinearRedBlue(channelView(2), Vector2i((redOffset.x() + 1) % 2, (redOffset.y() + 1) % 2));
 }
 
 /*!
@@ -790,127 +1294,52 @@ HDRImage HDRImage::medianFilterBayerArtifacts() const
  * Finally, the output image is formed by choosing for each pixel the demosaiced
  * result which has the most homogeneous "votes" in the surrounding 3x3 neighborhood.
  *
+ * All these steps run back to back on one tile of the image at a time, so the intermediate
+ * results only take memory proportional to the tile size, for each thread.
+ *
  * @param redOffset     The x,y offset to the first red pixel in the Bayer pattern.
  * @param cameraToXYZ   The matrix that transforms from sensor values to XYZ with
  *                      D65 white point.
  */
 void HDRImage::demosaicAHD(const Vector2i &redOffset, const Matrix3f &cameraToXYZ)
 {
-    using Image3f = Array<Vector3f,Dynamic,Dynamic>;
-    using HomoMap = Array<uint8_t,Dynamic,Dynamic>;
-    HDRImage rgbH = *this;
-    HDRImage rgbV = *this;
-    Image3f labH(width(), height());
-    Image3f labV(width(), height());
-    HomoMap homoH = HomoMap::Zero(width(), height());
-    HomoMap homoV = HomoMap::Zero(width(), height());
-
-    // interpolate green channel both horizontally and vertically
-    rgbH.demosaicGreenHorizontal(*this, redOffset);
-    rgbV.demosaicGreenVertical(*this, redOffset);
-
-    // interpolate the red and blue using the green as a guide
-    rgbH.demosaicRedBlueGreenGuidedLinear(redOffset);
-    rgbV.demosaicRedBlueGreenGuidedLinear(redOffset);
+    Timer timer;
 
     // Scale factor to push XYZ values to [0,1] range
     float scale = 1.0 / (maxCoeff().max() * cameraToXYZ.maxCoeff());
 
     // Precompute a table for the nonlinear part of the CIELab conversion
-    vector<float> labLUT;
-    labLUT.reserve(0xFFFF);
+    vector<float> labLUT(0xFFFF);
     parallel_for(0, labLUT.size(), [&labLUT](int i)
     {
         float r = i * 1.0f / (labLUT.size()-1);
         labLUT[i] = r > 0.008856 ? std::pow(r, 1.0f / 3.0f) : 7.787f*r + 4.0f/29.0f;
     });
 
-    // convert both interpolated images to CIE L*a*b* so we can compute perceptual differences
-    parallel_for(0, height(), [&rgbH,&labH,&cameraToXYZ,&labLUT,scale](int y)
-    {
-        for (int x = 0; x < rgbH.width(); ++x)
-            labH(x,y) = cameraToLab(Vector3f(rgbH(x,y)[0], rgbH(x,y)[1], rgbH(x,y)[2])*scale, cameraToXYZ, labLUT);
-    });
-    parallel_for(0, height(), [&rgbV,&labV,&cameraToXYZ,&labLUT,scale](int y)
-    {
-        for (int x = 0; x < rgbV.width(); ++x)
-            labV(x,y) = cameraToLab(Vector3f(rgbV(x,y)[0], rgbV(x,y)[1], rgbV(x,y)[2])*scale, cameraToXYZ, labLUT);
-    });
-
-    // Build homogeneity maps from the CIELab images which count, for each pixel,
-    // the number of visually similar neighboring pixels
-    static const int neighbor[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
-    parallel_for(1, height()-1, [&homoH,&homoV,&labH,&labV](int y)
-    {
-        for (int x = 1; x < labH.rows()-1; ++x)
-        {
-            float ldiffH[4], ldiffV[4], abdiffH[4], abdiffV[4];
-
-            for (int i = 0; i < 4; i++)
-            {
-                int dx = neighbor[i][0];
-                int dy = neighbor[i][1];
-
-                // Local luminance and chromaticity differences to the 4 neighbors for both interpolations directions
-                ldiffH[i] = std::abs(labH(x,y)[0] - labH(x+dx,y+dy)[0]);
-                ldiffV[i] = std::abs(labV(x,y)[0] - labV(x+dx,y+dy)[0]);
-                abdiffH[i] = ::square(labH(x,y)[1] - labH(x+dx,y+dy)[1]) +
-                             ::square(labH(x,y)[2] - labH(x+dx,y+dy)[2]);
-                abdiffV[i] = ::square(labV(x,y)[1] - labV(x+dx,y+dy)[1]) +
-                             ::square(labV(x,y)[2] - labV(x+dx,y+dy)[2]);
-            }
-
-            float leps = std::min(std::max(ldiffH[0], ldiffH[1]),
-                                  std::max(ldiffV[2], ldiffV[3]));
-            float abeps = std::min(std::max(abdiffH[0], abdiffH[1]),
-                                   std::max(abdiffV[2], abdiffV[3]));
-
-            // Count number of neighboring pixels that are visually similar
-            for (int i = 0; i < 4; i++)
-            {
-                if (ldiffH[i] <= leps && abdiffH[i] <= abeps)
-                    homoH(x,y)++;
-                if (ldiffV[i] <= leps && abdiffV[i] <= abeps)
-                    homoV(x,y)++;
-            }
-        }
-    });
-
-    // Combine the most homogenous pixels for the final result
-    parallel_for(1, height()-1, [this,&homoH,&homoV,&rgbH,&rgbV](int y)
-    {
-        for (int x = 1; x < this->width()-1; ++x)
+    // Each tile is demosaiced in place, writing only the missing colors of its pixels. Tiles also read the
+    // green of the red and blue pixels around them, so that is kept aside before any of it is overwritten.
+    const Plane rawG = channel(1);
+
+    // The tiles cover the pixels at least 3 pixels away from the boundary, since the result at each pixel
+    // depends on the raw values up to 5 pixels away. The boundary pixels are handled separately below.
+    const int border = 3, tileSize = 64;
+    int numTilesX = (width() - 2 * border + tileSize - 1) / tileSize;
+    int numTilesY = (height() - 2 * border + tileSize - 1) / tileSize;
+    vector<AHDScratch> scratch(ThreadPool::global().numThreads() + 1);
+    if (numTilesX > 0 && numTilesY > 0)
+        parallel_for(0, numTilesX * numTilesY,
+                     [this,&rawG,&redOffset,&cameraToXYZ,scale,&labLUT,&scratch,numTilesX](int t, size_t cpu)
         {
-            // Sum up the homogeneity of both images in a 3x3 window
-            int hmH = 0, hmV = 0;
-            for (int j = y-1; j <= y+1; j++)
-                for (int i = x-1; i <= x+1; i++)
-                {
-                    hmH += homoH(i, j);
-                    hmV += homoV(i, j);
-                }
-
-            if (hmH > hmV)
-            {
-                // horizontal interpolation is more homogeneous
-                (*this)(x,y) = rgbH(x,y);
-            }
-            else if (hmV > hmH)
-            {
-                // vertical interpolation is more homogeneous
-                (*this)(x,y) = rgbV(x,y);
-            }
-            else
-            {
-                // No clear winner, blend
-                Color4 blend = (rgbH(x,y) + rgbV(x,y)) * 0.5f;
-                (*this)(x,y) = blend;
-            }
-        }
-    });
+            int x0 = border + (t % numTilesX) * tileSize;
+            int y0 = border + (t / numTilesX) * tileSize;
+            demosaicAHDTile(*this, rawG, redOffset, cameraToXYZ, scale, labLUT,
+                            x0, std::min(x0 + tileSize, width() - border),
+                            y0, std::min(y0 + tileSize, height() - border), scratch[cpu]);
+        });
 
     // Now handle the boundary pixels
-    demosaicBorder(3);
+    demosaicBorder(border);
+    spdlog::get("console")->debug("AHD demosaicing took: {} seconds.", (timer.elapsed()/1000.f));
 }
 
 /*!
@@ -981,82 +1410,13 @@ void HDRImage::demosaicBorder(size_t border)
  */
 HDRImage HDRImage::brightnessContrast(float b, float c, bool linear, EChannel channel) const
 {
-    float slope = float(std::tan(lerp(0.0, M_PI_2, c/2.0 + 0.5)));
-    // Perlin's version
-    //float slope = c >= 0 ? -log2(1.f - c) + 1.f : 1.f / (-log2(1.f + c) + 1.f);
-    
-    if (linear)
-    {
-        float midpoint = (1.f-b)/2.f;
-
-        if (channel == RGB)
-            return unaryExpr(
-                [slope,midpoint](const Color4 &c)
-                {
-                    return Color4(brightnessContrastL(c.r, slope, midpoint),
-                                  brightnessContrastL(c.g, slope, midpoint),
-                                  brightnessContrastL(c.b, slope, midpoint), c.a);
-                });
-        else if (channel == LUMINANCE || channel == CIE_L)
-            return unaryExpr(
-                [slope,midpoint](const Color4 &c)
-                {
-                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
-                    return Color4(brightnessContrastL(lab.r, slope, midpoint),
-                                  lab.g, lab.b, c.a).convert(LinearSRGB_CS, CIELab_CS);
-                });
-        else if (channel == CIE_CHROMATICITY)
-            return unaryExpr(
-                [slope,midpoint](const Color4 &c)
-                {
-                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
-                    return Color4(lab.r,
-                                  brightnessContrastL(lab.g, slope, midpoint),
-                                  brightnessContrastL(lab.b, slope, midpoint),
-                                  c.a).convert(LinearSRGB_CS, CIELab_CS);
-                });
-        else
-            return *this;
-    }
-    else
-    {
-        float aB = (b + 1.f) / 2.f;
-
-        if (channel == RGB)
-            return unaryExpr(
-                [aB, slope](const Color4 &c)
-                {
-                    return Color4(brightnessContrastNL(c.r, slope, aB),
-                                  brightnessContrastNL(c.g, slope, aB),
-                                  brightnessContrastNL(c.b, slope, aB),
-                                  c.a);
-                });
-        else if (channel == LUMINANCE || channel == CIE_L)
-            return unaryExpr(
-                [aB, slope](const Color4 &c)
-                {
-                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
-                    return Color4(brightnessContrastNL(lab.r, slope, aB),
-                                  lab.g, lab.b, c.a).convert(LinearSRGB_CS, CIELab_CS);
-                });
-        else if (channel == CIE_CHROMATICITY)
-            return unaryExpr(
-                [aB, slope](const Color4 &c)
-                {
-                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
-                    return Color4(lab.r,
-                                  brightnessContrastNL(lab.g, slope, aB),
-                                  brightnessContrastNL(lab.b, slope, aB),
-                                  c.a).convert(LinearSRGB_CS, CIELab_CS);
-                });
-        else
-            return *this;
-    }
-}
+    PixelPipeline::Op op = PixelPipeline::brightnessContrast(b, c, linear, channel);
+    return op ? PixelPipeline().then(op).applied(*this) : *this;
+}
 
 HDRImage HDRImage::inverted() const
 {
-	return unaryExpr([](const Color4 &c) { return Color4(1.f - c.r, 1.f - c.g, 1.f - c.b, c.a); });
+    return PixelPipeline().then(PixelPipeline::invert()).applied(*this);
 }
 
 
@@ -1089,6 +1449,486 @@ ArrayXXf horizontalGaussianKernel(float sigma, float truncate)
     return fData;
 }
 
+// convolve with the horizontal kernel (a single column of weights, indexed by x)
+void convolveRows(const HDRImage & src, HDRImage & dst, const ArrayXXf & kernel,
+                  HDRImage::BorderMode mX, AtomicProgress & progress)
+{
+    int size = kernel.rows();
+    int center = (size - 1) / 2;
+
+    // Pixel x is the sum over j of kernel(j) * src(x - j + center). With each row extended by
+    // size - 1 - center pixels on the left, that is a sum of whole rows shifted by size - 1 - j,
+    // which we accumulate one weight at a time along contiguous memory.
+    vector<float> weights(size);
+    for (int j = 0; j < size; ++j)
+        weights[size - 1 - j] = kernel(j, 0) / kernel.sum();
+
+    progress.setNumSteps(src.height());
+    parallel_for_range(0, src.height(), [&src,&dst,&weights,&progress,size,center,mX](int y0, int y1)
+    {
+        int n = 4 * src.width();
+        vector<Color4> line(src.width() + size - 1);
+        for (int y = y0; y < y1; ++y)
+        {
+            for (int i = 0; i < int(line.size()); ++i)
+                line[i] = src.pixel(i - (size - 1 - center), y, mX, mX);
+
+            float * out = &dst(0, y)[0];
+            fill_n(out, n, 0.f);
+            for (int t = 0; t < size; ++t)
+            {
+                const float * in = &line[t][0];
+                float w = weights[t];
+                for (int i = 0; i < n; ++i)
+                    out[i] += w * in[i];
+            }
+        }
+        progress += y1 - y0;
+    });
+}
+
+// convolve with the vertical kernel (a single row of weights, indexed by y)
+void convolveColumns(const HDRImage & src, HDRImage & dst, const ArrayXXf & kernel,
+                     HDRImage::BorderMode mY, AtomicProgress & progress)
+{
+    int size = kernel.cols();
+    int center = (size - 1) / 2;
+    ArrayXXf weights = kernel / kernel.sum();
+
+    // Each strip of columns is processed one output row at a time, adding up whole rows of the
+    // input, so memory is accessed contiguously and the few input rows the kernel spans stay
+    // in cache from one output row to the next.
+    progress.setNumSteps(src.width());
+    parallel_for_range(0, src.width(), 128, [&src,&dst,&weights,&progress,size,center,mY](int x0, int x1)
+    {
+        int n = 4 * (x1 - x0);
+        for (int y = 0; y < src.height(); ++y)
+        {
+            float * out = &dst(x0, y)[0];
+            fill_n(out, n, 0.f);
+            for (int j = 0; j < size; ++j)
+            {
+                int yy = wrapCoord(y - j + center, src.height(), mY);
+                if (yy < 0)
+                    continue;
+
+                const float * in = &src(x0, yy)[0];
+                float w = weights(0, j);
+                for (int i = 0; i < n; ++i)
+                    out[i] += w * in[i];
+            }
+        }
+        progress += x1 - x0;
+    });
+}
+
+HDRImage medianFilteredChannels(const HDRImage & src, int channelBegin, int channelEnd,
+                                float radius, AtomicProgress progress,
+                                HDRImage::BorderMode mX, HDRImage::BorderMode mY, bool round)
+{
+    Timer timer;
+    HDRImage result = src;
+
+    // tiles at least as large as the window keep the overhead of ranking the pixels around
+    // each tile, and of starting each row of the sliding window, independent of the radius
+    int tileSize = std::max(64, 2 * int(std::ceil(radius)));
+    progress.setNumSteps(src.height());
+    parallel_for_2d(0, src.width(), 0, src.height(),
+                    [&src,&result,&progress,channelBegin,channelEnd,radius,round,mX,mY](int x0, int x1, int y0, int y1)
+    {
+        progress.checkCanceled();
+        medianFilterTile(src, result, channelBegin, channelEnd, radius, round, mX, mY, x0, x1, y0, y1);
+        if (x1 == src.width())
+            progress += y1 - y0;
+    }, tileSize, tileSize);
+    spdlog::get("console")->trace("Median filter took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return result;
+}
+
+// order-preserving map of floats to unsigned integers, so that sorting needs no special cases for NaNs
+inline uint32_t sortableBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(float));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+// index of the k-th (counting from 0) set bit of w
+inline int selectBit(uint64_t w, int k)
+{
+    for (int i = 0; ; ++i)
+        if ((w >> i) & 1u && k-- == 0)
+            return i;
+}
+
+/*!
+ * Median filter the pixels in [x0,x1) x [y0,y1) of \a src into \a dst, one channel at a time.
+ *
+ * This is a sliding-window histogram median in the spirit of Perreault and Hebert, "Median
+ * Filtering in Constant Time" (2007). To be exact on floating-point values, the histograms
+ * count the ranks of the pixels among all the pixels the tile's windows cover, instead of
+ * quantized values. Each median is found in two steps:
+ *   - a coarse histogram of the window, over bins of consecutive ranks, locates the bin
+ *     holding the median and the median's position within it;
+ *   - a bitset of which of the bin's ranks are in the window then gives the exact rank.
+ *
+ * For square windows, the coarse window histogram is updated in constant time per pixel by
+ * adding and subtracting per-column histograms, and the bitset of a bin is only brought up to
+ * date when the median falls into it, one column at a time. Round windows don't decompose
+ * into columns, so their histogram and bitsets are updated one pixel at a time along the
+ * window's left and right edges.
+ */
+void medianFilterTile(const HDRImage & src, HDRImage & dst, int channelBegin, int channelEnd,
+                      float radius, bool round, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                      int x0, int x1, int y0, int y1)
+{
+    int r = int(std::ceil(radius));
+    int d = 2 * r + 1;
+    int tw = x1 - x0, th = y1 - y0;
+
+    // the region covered by the windows of all pixels in the tile
+    int rw = tw + 2 * r, rh = th + 2 * r;
+    int n = rw * rh;
+
+    // Bins hold a whole number of bitset words. Their number balances the cost of updating
+    // the coarse histogram against that of searching a bin, and is capped so the former stays
+    // bounded for large radii.
+    int numWords = (n + 63) / 64;
+    int wordsPerBin = (numWords + std::min(128, int(std::ceil(2.f * std::sqrt(float(numWords))))) - 1) /
+                      std::min(128, int(std::ceil(2.f * std::sqrt(float(numWords)))));
+    int binSize = 64 * wordsPerBin;
+    int numBins = (n + binSize - 1) / binSize;
+
+    // the extent of the window along each row
+    vector<int> halfWidth(d, r);
+    int windowSize = d * d;
+    if (round)
+    {
+        windowSize = 0;
+        for (int dy = -r; dy <= r; ++dy)
+        {
+            int & h = halfWidth[dy + r];
+            h = int(std::floor(std::sqrt(std::max(0.f, radius * radius - dy * dy))));
+            while (h >= 0 && h * h + dy * dy > radius * radius)
+                --h;
+            if (h >= 0)
+                windowSize += 2 * h + 1;
+        }
+    }
+    int median = (windowSize - 1) / 2;
+
+    // for tiny windows, selecting each median directly is faster than ranking the region
+    if (r <= 1)
+    {
+        vector<float> window;
+        window.reserve(windowSize);
+        for (int c = channelBegin; c < channelEnd; ++c)
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                {
+                    window.clear();
+                    for (int dy = -r; dy <= r; ++dy)
+                        for (int dx = -halfWidth[dy + r]; dx <= halfWidth[dy + r]; ++dx)
+                            window.push_back(src.pixel(x + dx, y + dy, mX, mY)[c]);
+                    nth_element(window.begin(), window.begin() + median, window.end());
+                    dst(x, y)[c] = window[median];
+                }
+        return;
+    }
+
+    vector<uint64_t> keys(n);
+    vector<float> values(n), sortedValues(n);
+    vector<int> rankAt(n), positionOf(n);
+    vector<int> windowHist(numBins);
+    vector<uint64_t> inWindow(size_t(numBins) * wordsPerBin);
+
+    // square windows: per-column histograms, and the ranks in each bin of each column
+    vector<int> columnHist, columnBinStart, columnBinRanks, binColumn;
+    if (!round)
+    {
+        columnHist.resize(size_t(rw) * numBins);
+        columnBinStart.resize(size_t(rw) * numBins + 1);
+        columnBinRanks.resize(n);
+        binColumn.resize(numBins);
+    }
+
+    // find the bin holding the median, and the median's position within the bin
+    auto locateMedian = [&windowHist,median](int & bin, int & k)
+    {
+        k = median;
+        for (bin = 0; k >= windowHist[bin]; ++bin)
+            k -= windowHist[bin];
+    };
+
+    // the value of the k-th smallest rank in the window within bin
+    auto selectValue = [&inWindow,&sortedValues,wordsPerBin,binSize](int bin, int k)
+    {
+        const uint64_t * words = &inWindow[size_t(bin) * wordsPerBin];
+        for (int w = 0; ; ++w)
+        {
+            int count = int(bitset<64>(words[w]).count());
+            if (k < count)
+                return sortedValues[bin * binSize + 64 * w + selectBit(words[w], k)];
+            k -= count;
+        }
+    };
+
+    for (int c = channelBegin; c < channelEnd; ++c)
+    {
+        // rank the pixels of the region; ties are broken by position, so all ranks are distinct
+        for (int ry = 0; ry < rh; ++ry)
+            for (int rx = 0; rx < rw; ++rx)
+            {
+                int i = rx + rw * ry;
+                values[i] = src.pixel(x0 - r + rx, y0 - r + ry, mX, mY)[c];
+                keys[i] = uint64_t(sortableBits(values[i])) << 32 | uint32_t(i);
+            }
+        sort(keys.begin(), keys.end());
+        for (int rank = 0; rank < n; ++rank)
+        {
+            int i = int(keys[rank] & 0xffffffffu);
+            rankAt[i] = rank;
+            positionOf[rank] = i;
+            sortedValues[rank] = values[i];
+        }
+
+        if (!round)
+        {
+            // group the ranks by column and bin
+            fill(columnBinStart.begin(), columnBinStart.end(), 0);
+            for (int rank = 0; rank < n; ++rank)
+                ++columnBinStart[(positionOf[rank] % rw) * numBins + rank / binSize + 1];
+            for (size_t i = 1; i < columnBinStart.size(); ++i)
+                columnBinStart[i] += columnBinStart[i - 1];
+            vector<int> next(columnBinStart.begin(), columnBinStart.end() - 1);
+            for (int rank = 0; rank < n; ++rank)
+                columnBinRanks[next[(positionOf[rank] % rw) * numBins + rank / binSize]++] = rank;
+        }
+
+        for (int ly = 0; ly < th; ++ly)
+        {
+            if (round)
+            {
+                auto toggle = [&](int rx, int ry, int count)
+                {
+                    int rank = rankAt[rx + rw * ry];
+                    windowHist[rank / binSize] += count;
+                    inWindow[rank / 64] ^= uint64_t(1) << (rank % 64);
+                };
+
+                fill(windowHist.begin(), windowHist.end(), 0);
+                fill(inWindow.begin(), inWindow.end(), 0);
+                for (int dy = 0; dy < d; ++dy)
+                    for (int dx = -halfWidth[dy]; dx <= halfWidth[dy]; ++dx)
+                        toggle(r + dx, ly + dy, 1);
+
+                for (int lx = 0; lx < tw; ++lx)
+                {
+                    if (lx > 0)
+                        for (int dy = 0; dy < d; ++dy)
+                            if (halfWidth[dy] >= 0)
+                            {
+                                toggle(lx - 1 + r - halfWidth[dy], ly + dy, -1);
+                                toggle(lx + r + halfWidth[dy], ly + dy, 1);
+                            }
+
+                    int bin, k;
+                    locateMedian(bin, k);
+                    dst(x0 + lx, y0 + ly)[c] = selectValue(bin, k);
+                }
+            }
+            else
+            {
+                // slide the column histograms down to rows [ly, ly + 2r]
+                if (ly == 0)
+                {
+                    fill(columnHist.begin(), columnHist.end(), 0);
+                    for (int ry = 0; ry < d; ++ry)
+                        for (int rx = 0; rx < rw; ++rx)
+                            ++columnHist[rx * numBins + rankAt[rx + rw * ry] / binSize];
+                }
+                else
+                    for (int rx = 0; rx < rw; ++rx)
+                    {
+                        --columnHist[rx * numBins + rankAt[rx + rw * (ly - 1)] / binSize];
+                        ++columnHist[rx * numBins + rankAt[rx + rw * (ly + 2 * r)] / binSize];
+                    }
+
+                fill(windowHist.begin(), windowHist.end(), 0);
+                for (int rx = 0; rx < d; ++rx)
+                    for (int b = 0; b < numBins; ++b)
+                        windowHist[b] += columnHist[rx * numBins + b];
+
+                // the bitsets are out of date once the rows change
+                fill(binColumn.begin(), binColumn.end(), INT_MIN);
+
+                // add or remove the ranks in column rx and rows [ly, ly + 2r] to the bitset of bin
+                auto toggleColumn = [&](int rx, int bin)
+                {
+                    size_t i = size_t(rx) * numBins + bin;
+                    for (int j = columnBinStart[i]; j < columnBinStart[i + 1]; ++j)
+                    {
+                        int rank = columnBinRanks[j];
+                        int ry = positionOf[rank] / rw;
+                        if (ry >= ly && ry < ly + d)
+                            inWindow[rank / 64] ^= uint64_t(1) << (rank % 64);
+                    }
+                };
+
+                for (int lx = 0; lx < tw; ++lx)
+                {
+                    if (lx > 0)
+                    {
+                        const int * added = &columnHist[(lx + 2 * r) * numBins];
+                        const int * removed = &columnHist[(lx - 1) * numBins];
+                        for (int b = 0; b < numBins; ++b)
+                            windowHist[b] += added[b] - removed[b];
+                    }
+
+                    int bin, k;
+                    locateMedian(bin, k);
+
+                    // bring the bin's bitset from columns [from, from + 2r] to [lx, lx + 2r]
+                    int from = binColumn[bin];
+                    if (from == INT_MIN || lx - from >= d)
+                    {
+                        fill_n(&inWindow[size_t(bin) * wordsPerBin], wordsPerBin, 0);
+                        for (int rx = lx; rx < lx + d; ++rx)
+                            toggleColumn(rx, bin);
+                    }
+                    else
+                        for (int rx = from; rx < lx; ++rx)
+                        {
+                            toggleColumn(rx, bin);
+                            toggleColumn(rx + d, bin);
+                        }
+                    binColumn[bin] = lx;
+
+                    dst(x0 + lx, y0 + ly)[c] = selectValue(bin, k);
+                }
+            }
+        }
+    }
+}
+
+// the smallest integer >= n whose only prime factors are 2, 3 and 5, for which FFTs are fast
+int fftFriendlySize(int n)
+{
+    for (;; ++n)
+    {
+        int m = n;
+        for (int p : {2, 3, 5})
+            while (m % p == 0)
+                m /= p;
+        if (m == 1)
+            return n;
+    }
+}
+
+FFTBlocks fftBlocks(int length, int kernelSize, int center)
+{
+    FFTBlocks b;
+    // the outputs depend on inputs extending kernelSize-1 pixels past the image in total
+    int extendedLength = length + kernelSize - 1;
+    b.start = center - (kernelSize - 1);
+
+    if (kernelSize == 1)
+    {
+        // nothing to transform along this axis, so there is no need for padding
+        b.blockSize = b.fftSize = std::min(extendedLength, 32);
+    }
+    else
+    {
+        // The full linear convolution of a block needs blockSize + kernelSize - 1 entries.
+        // Making the blocks at least as large as the kernel keeps the fraction of each
+        // transform spent on padding low, and means a block's output only overlaps its
+        // immediate neighbors.
+        b.fftSize = fftFriendlySize(std::max(2 * (kernelSize - 1), 64));
+        int singleBlockSize = fftFriendlySize(extendedLength + kernelSize - 1);
+        if (singleBlockSize <= b.fftSize)
+            b.fftSize = singleBlockSize;
+        b.blockSize = std::min(b.fftSize - (kernelSize - 1), extendedLength);
+    }
+    b.numBlocks = (extendedLength + b.blockSize - 1) / b.blockSize;
+    return b;
+}
+
+// rough number of multiply-adds per pixel of convolvedFFT, comparable to the kernel size for direct convolution
+float fftCostPerPixel(const FFTBlocks & bx, const FFTBlocks & by, int width, int height)
+{
+    float nw = bx.fftSize, nh = by.fftSize;
+    // multiplying two complex buffers by the spectrum, plus forward and inverse transforms
+    // of both, taking ~5 N log2(N) flops each, along the axes that are padded for transforming
+    float perBlock = 4.f * nw * nh;
+    if (bx.blockSize < bx.fftSize)
+        perBlock += 2.f * 2.f * 5.f * nw * nh * std::log2(nw);
+    if (by.blockSize < by.fftSize)
+        perBlock += 2.f * 2.f * 5.f * nw * nh * std::log2(nh);
+    // a multiply-add of direct convolution (four channels, plus border handling) takes about as long as 16 flops here
+    return perBlock * bx.numBlocks * by.numBlocks / (16.f * width * height);
+}
+
+/*!
+ * Blur \a numLines interleaved lines of \a length pixels in place, where pixel i of line k is
+ * stored at lines[i * numLines + k].
+ *
+ * This is the third-order recursive Gaussian of Young and van Vliet, "Recursive implementation
+ * of the Gaussian filter" (Signal Processing, 1995), run forward and then backward along each
+ * line. Both passes start out in the steady state for a constant input equal to the first pixel
+ * they see. Stepping through all lines at once keeps the innermost loop on contiguous memory.
+ *
+ * For the large sigmas this filter is meant for, the poles approach 1: the feedback coefficients
+ * tend to 3, -3 and 1, and the gain B becomes tiny. The coefficients and the recursion state are
+ * therefore kept in double precision, and B is computed in closed form instead of as
+ * 1 - (a1 + a2 + a3), which would cancel almost completely.
+ */
+void recursiveGaussianLines(Color4 * lines, int length, int numLines, float sigma)
+{
+    double q = sigma >= 2.5f ? 0.98711 * sigma - 0.96330
+                             : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+    double q2 = q * q, q3 = q2 * q;
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    double a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+    double a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+    double a3 = 0.422205 * q3 / b0;
+    // equal to 1 - (a1 + a2 + a3), so that constant lines are preserved
+    double B = (1.57825 + 0.00001 * q2) / b0;
+
+    // the last three outputs of each channel of each line
+    const size_t numValues = size_t(numLines) * 4;
+    vector<double> y1(numValues), y2(numValues), y3(numValues);
+
+    // runs the recursion over all lines, starting at pixel first and moving by step pixels
+    auto pass = [&](int first, int step)
+    {
+        // the output at the boundary equals the input there, which stands in for the outputs
+        // before the first step
+        const Color4 * start = lines + size_t(first) * numLines;
+        for (int k = 0; k < numLines; ++k)
+            for (int c = 0; c < 4; ++c)
+                y1[4 * k + c] = y2[4 * k + c] = y3[4 * k + c] = start[k][c];
+
+        for (int n = 0, i = first; n < length; ++n, i += step)
+        {
+            Color4 * w = lines + size_t(i) * numLines;
+            for (int k = 0; k < numLines; ++k)
+                for (int c = 0; c < 4; ++c)
+                {
+                    size_t v = 4 * k + c;
+                    double y = B * w[k][c] + a1 * y1[v] + a2 * y2[v] + a3 * y3[v];
+                    y3[v] = y2[v];
+                    y2[v] = y1[v];
+                    y1[v] = y;
+                    w[k][c] = float(y);
+                }
+        }
+    };
+
+    pass(0, 1);
+    pass(length - 1, -1);
+}
+
 int wrapCoord(int p, int maxP, HDRImage::BorderMode m)
 {
     if (p >= 0 && p < maxP)
@@ -1141,20 +1981,22 @@ inline float clamp4(float value, float a, float b, float c, float d)
     return clamp(value, mn, mx);
 }
 
-inline float interpGreenH(const HDRImage &raw, int x, int y)
+template <typename Channel>
+inline float interpGreenH(const Channel &G, int x, int y)
 {
-    float v = 0.50f * (raw(x - 1, y).g + raw(x + 1, y).g + raw(x, y).g) -
-              0.25f * (raw(x - 2, y).g + raw(x + 2, y).g);
+    float v = 0.50f * (G(x - 1, y) + G(x + 1, y) + G(x, y)) -
+              0.25f * (G(x - 2, y) + G(x + 2, y));
     // Don't extrapolate past the neighboring green values
-    return clamp2(v, raw(x - 1, y).g, raw(x + 1, y).g);
+    return clamp2(v, G(x - 1, y), G(x + 1, y));
 }
 
-inline float interpGreenV(const HDRImage &raw, int x, int y)
+template <typename Channel>
+inline float interpGreenV(const Channel &G, int x, int y)
 {
-    float v = 0.50f * (raw(x, y - 1).g + raw(x, y + 1).g + raw(x, y).g) -
-              0.25f * (raw(x, y - 2).g + raw(x, y + 2).g);
+    float v = 0.50f * (G(x, y - 1) + G(x, y + 1) + G(x, y)) -
+              0.25f * (G(x, y - 2) + G(x, y + 2));
     // Don't extrapolate past the neighboring green values
-    return clamp2(v, raw(x, y - 1).g, raw(x, y + 1).g);
+    return clamp2(v, G(x, y - 1), G(x, y + 1));
 }
 
 inline float ghG(const ArrayXXf & G, int i, int j)
@@ -1167,12 +2009,12 @@ inline float gvG(const ArrayXXf & G, int i, int j)
     return fabs(G(i,j-1) - G(i,j)) + fabs(G(i,j+1) - G(i,j));
 }
 
-void bilinearGreen(HDRImage &raw, int offsetX, int offsetY)
+void bilinearGreen(HDRImage::ChannelView G, int offsetX, int offsetY)
 {
-    parallel_for(1, raw.height()-1-offsetY, 2, [&raw,offsetX,offsetY](int yy)
+    parallel_for(1, G.cols()-1-offsetY, 2, [&G,offsetX,offsetY](int yy)
     {
         int t = yy + offsetY;
-        for (int xx = 1; xx < raw.width()-1-offsetX; xx += 2)
+        for (int xx = 1; xx < G.rows()-1-offsetX; xx += 2)
         {
             int l = xx + offsetX;
 
@@ -1181,10 +2023,10 @@ void bilinearGreen(HDRImage &raw, int offsetX, int offsetY)
             int r = l+1;
             int b = t+1;
 
-            raw(l, t).g = 0.25f * (raw(l, t - 1).g + raw(l, t + 1).g +
-                                   raw(l - 1, t).g + raw(l + 1, t).g);
-            raw(r, b).g = 0.25f * (raw(r, b - 1).g + raw(r, b + 1).g +
-                                   raw(r - 1, b).g + raw(r + 1, b).g);
+            G(l, t) = 0.25f * (G(l, t - 1) + G(l, t + 1) +
+                               G(l - 1, t) + G(l + 1, t));
+            G(r, b) = 0.25f * (G(r, b - 1) + G(r, b + 1) +
+                               G(r - 1, b) + G(r + 1, b));
         }
     });
 }
@@ -1192,26 +2034,28 @@ void bilinearGreen(HDRImage &raw, int offsetX, int offsetY)
 
 void PhelippeauGreen(HDRImage &raw, const Vector2i & redOffset)
 {
-    ArrayXXf Gh(raw.width(), raw.height());
-    ArrayXXf Gv(raw.width(), raw.height());
+    const HDRImage::ConstChannelView G = static_cast<const HDRImage &>(raw).channelView(1);
+    // start from the known green values, so the gradients below see them at the green pixels
+    ArrayXXf Gh = G;
+    ArrayXXf Gv = G;
 
     // populate horizontally interpolated green
-    parallel_for(redOffset.y(), raw.height(), 2, [&raw,&Gh,&redOffset](int y)
+    parallel_for(redOffset.y(), raw.height(), 2, [&raw,&G,&Gh,&redOffset](int y)
     {
         for (int x = 2+redOffset.x(); x < raw.width() - 2; x += 2)
         {
-            Gh(x  , y  ) = interpGreenH(raw, x, y);
-            Gh(x+1, y+1) = interpGreenH(raw, x + 1, y + 1);
+            Gh(x  , y  ) = interpGreenH(G, x, y);
+            Gh(x+1, y+1) = interpGreenH(G, x + 1, y + 1);
         }
     });
 
     // populate vertically interpolated green
-    parallel_for(2+redOffset.y(), raw.height()-2, 2, [&raw,&Gv,&redOffset](int y)
+    parallel_for(2+redOffset.y(), raw.height()-2, 2, [&raw,&G,&Gv,&redOffset](int y)
     {
         for (int x = redOffset.x(); x < raw.width(); x += 2)
         {
-            Gv(x  , y  ) = interpGreenV(raw, x, y);
-            Gv(x+1, y+1) = interpGreenV(raw, x + 1, y + 1);
+            Gv(x  , y  ) = interpGreenV(G, x, y);
+            Gv(x+1, y+1) = interpGreenV(G, x + 1, y + 1);
         }
     });
 
@@ -1226,15 +2070,16 @@ void PhelippeauGreen(HDRImage &raw, const Vector2i & redOffset)
 
             raw(x, y).g = (ghGh + gvGh <= gvGv + ghGv) ? Gh(x, y) : Gv(x, y);
 
-            x++;
-            y++;
+            // the other missing green pixel in this Bayer tile
+            int x2 = x+1;
+            int y2 = y+1;
 
-            ghGh = ghG(Gh, x, y);
-            ghGv = ghG(Gv, x, y);
-            gvGh = gvG(Gh, x, y);
-            gvGv = gvG(Gv, x, y);
+            ghGh = ghG(Gh, x2, y2);
+            ghGv = ghG(Gv, x2, y2);
+            gvGh = gvG(Gh, x2, y2);
+            gvGv = gvG(Gv, x2, y2);
 
-            raw(x, y).g = (ghGh + gvGh <= gvGv + ghGv) ? Gh(x, y) : Gv(x, y);
+            raw(x2, y2).g = (ghGh + gvGh <= gvGv + ghGv) ? Gh(x2, y2) : Gv(x2, y2);
         }
     });
 }
@@ -1292,30 +2137,30 @@ void MalvarRedOrBlue(HDRImage &raw, int c1, int c2, const Vector2i &redOffset)
 }
 
 
-// takes as input a raw image and returns a single-channel
-// 2D image corresponding to the red or blue channel using simple interpolation
-void bilinearRedBlue(HDRImage &raw, int c, const Vector2i & redOffset)
+// takes as input a view of the red or blue channel of a raw image
+// and fills in its missing values using simple interpolation
+void bilinearRedBlue(HDRImage::ChannelView C, const Vector2i & redOffset)
 {
     // diagonal interpolation
-    parallel_for(redOffset.y() + 1, raw.height()-1, 2, [&raw,c,&redOffset](int y)
+    parallel_for(redOffset.y() + 1, C.cols()-1, 2, [&C,&redOffset](int y)
     {
-        for (int x = redOffset.x() + 1; x < raw.width() - 1; x += 2)
-            raw(x, y)[c] = 0.25f * (raw(x - 1, y - 1)[c] + raw(x + 1, y - 1)[c] +
-                                    raw(x - 1, y + 1)[c] + raw(x + 1, y + 1)[c]);
+        for (int x = redOffset.x() + 1; x < C.rows() - 1; x += 2)
+            C(x, y) = 0.25f * (C(x - 1, y - 1) + C(x + 1, y - 1) +
+                               C(x - 1, y + 1) + C(x + 1, y + 1));
     });
 
     // horizontal interpolation
-    parallel_for(redOffset.y(), raw.height(), 2, [&raw,c,&redOffset](int y)
+    parallel_for(redOffset.y(), C.cols(), 2, [&C,&redOffset](int y)
     {
-        for (int x = redOffset.x() + 1; x < raw.width() - 1; x += 2)
-            raw(x, y)[c] = 0.5f * (raw(x - 1, y)[c] + raw(x + 1, y)[c]);
+        for (int x = redOffset.x() + 1; x < C.rows() - 1; x += 2)
+            C(x, y) = 0.5f * (C(x - 1, y) + C(x + 1, y));
     });
 
     // vertical interpolation
-    parallel_for(redOffset.y() + 1, raw.height() - 1, 2, [&raw,c,&redOffset](int y)
+    parallel_for(redOffset.y() + 1, C.cols() - 1, 2, [&C,&redOffset](int y)
     {
-        for (int x = redOffset.x(); x < raw.width(); x += 2)
-            raw(x, y)[c] = 0.5f * (raw(x, y - 1)[c] + raw(x, y + 1)[c]);
+        for (int x = redOffset.x(); x < C.rows(); x += 2)
+            C(x, y) = 0.5f * (C(x, y - 1) + C(x, y + 1));
     });
 }
 
@@ -1351,4 +2196,633 @@ void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset)
     });
 }
 
-} // namespace
\ No newline at end of file
+/*!
+ * AHD-demosaic the pixels in [x0,x1) x [y0,y1) of \a img, which have to be at least 3 pixels away from its boundary.
+ *
+ * All steps of HDRImage::demosaicAHD run back to back on the tile and the pixels around it, so the
+ * intermediate results stay in the cache, and take memory proportional to the tile only.
+ *
+ * @param rawG      The green channel of the raw image, also at the red and blue pixels
+ * @param s         Scratch space, resized as needed
+ */
+void demosaicAHDTile(HDRImage & img, const HDRImage::Plane & rawG, const Vector2i & redOffset,
+                     const Matrix3f & cameraToXYZ, float scale, const vector<float> & labLUT,
+                     int x0, int x1, int y0, int y1, AHDScratch & s)
+{
+    const int w = img.width(), h = img.height();
+
+    // the area of each step: the homogeneity of the 3x3 neighborhood decides the result at each pixel,
+    // the homogeneity compares the colors at the 4 neighbors, and guiding red and blue by green uses
+    // the green of the 8 neighbors
+    const int hx = x0 - 1, hy = y0 - 1, hw = x1 - x0 + 2, hh = y1 - y0 + 2;
+    const int cx = x0 - 2, cy = y0 - 2, cw = x1 - x0 + 4, ch = y1 - y0 + 4;
+    const int gx = x0 - 3, gy = y0 - 3, gw = x1 - x0 + 6, gh = y1 - y0 + 6;
+    s.greenH.resize(gw, gh);
+    s.greenV.resize(gw, gh);
+    s.rgbH.resize(cw, ch);
+    s.rgbV.resize(cw, ch);
+    s.labH.resize(cw, ch);
+    s.labV.resize(cw, ch);
+    s.homogeneity.resize(hw, hh);
+
+    // interpolate the green channel both horizontally and vertically
+    for (int j = 0; j < gh; ++j)
+    {
+        int y = gy + j;
+        for (int i = 0; i < gw; ++i)
+        {
+            int x = gx + i;
+            s.greenH(i, j) = s.greenV(i, j) = rawG(x, y);
+            if (((x ^ redOffset.x()) & 1) != ((y ^ redOffset.y()) & 1))
+                continue;   // a green pixel
+            if (x >= 2 && x < w - 2)
+                s.greenH(i, j) = interpGreenH(rawG, x, y);
+            if (y >= 2 && y < h - 2)
+                s.greenV(i, j) = interpGreenV(rawG, x, y);
+        }
+    }
+
+    // Interpolate the red and blue using the green as a guide, like greenBasedRorB. All pixels
+    // around the tile are at least one pixel away from the boundary, so all their neighbors exist.
+    auto guided = [&img,&redOffset](const ArrayXXf & G, int x, int y, int i, int j)
+    {
+        // from the pixels of color c at offsets -(dx,dy) and (dx,dy)
+        auto pair = [&img,&G,x,y,i,j](int c, int dx, int dy)
+        {
+            return std::max(0.f, 0.5f * (img(x - dx, y - dy)[c] + img(x + dx, y + dy)[c] -
+                                         G(i - dx, j - dy) - G(i + dx, j + dy)) + G(i, j));
+        };
+        // from the pixels of color c at the 4 diagonal neighbors
+        auto diagonal = [&img,&G,x,y,i,j](int c)
+        {
+            return std::max(0.f, 0.25f * (img(x - 1, y - 1)[c] + img(x + 1, y - 1)[c] +
+                                          img(x - 1, y + 1)[c] + img(x + 1, y + 1)[c] -
+                                          G(i - 1, j - 1) - G(i + 1, j - 1) -
+                                          G(i - 1, j + 1) - G(i + 1, j + 1)) + G(i, j));
+        };
+
+        int rx = (x ^ redOffset.x()) & 1, ry = (y ^ redOffset.y()) & 1;
+        if (rx == ry)
+            return rx == 0 ? Vector3f(img(x, y)[0], G(i, j), diagonal(2)) :     // a red pixel
+                             Vector3f(diagonal(0), G(i, j), img(x, y)[2]);      // a blue pixel
+        return ry == 0 ? Vector3f(pair(0, 1, 0), G(i, j), pair(2, 0, 1)) :      // a green pixel in a red row
+                         Vector3f(pair(0, 0, 1), G(i, j), pair(2, 1, 0));       // a green pixel in a blue row
+    };
+
+    // convert both candidates to CIE L*a*b* so we can compute perceptual differences
+    for (int j = 0; j < ch; ++j)
+    {
+        int y = cy + j;
+        for (int i = 0; i < cw; ++i)
+        {
+            int x = cx + i;
+            s.rgbH(i, j) = guided(s.greenH, x, y, i + 1, j + 1);
+            s.rgbV(i, j) = guided(s.greenV, x, y, i + 1, j + 1);
+            s.labH(i, j) = cameraToLab(s.rgbH(i, j) * scale, cameraToXYZ, labLUT);
+            s.labV(i, j) = cameraToLab(s.rgbV(i, j) * scale, cameraToXYZ, labLUT);
+        }
+    }
+
+    // Build homogeneity maps from the CIELab images which count, for each pixel,
+    // the number of visually similar neighboring pixels. Only their difference matters below.
+    static const int neighbor[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+    for (int j = 0; j < hh; ++j)
+    {
+        for (int i = 0; i < hw; ++i)
+        {
+            // the position of the pixel in the L*a*b* images
+            int x = i + 1, y = j + 1;
+            float ldiffH[4], ldiffV[4], abdiffH[4], abdiffV[4];
+
+            for (int k = 0; k < 4; k++)
+            {
+                int dx = neighbor[k][0];
+                int dy = neighbor[k][1];
+
+                // Local luminance and chromaticity differences to the 4 neighbors for both interpolations directions
+                ldiffH[k] = std::abs(s.labH(x,y)[0] - s.labH(x+dx,y+dy)[0]);
+                ldiffV[k] = std::abs(s.labV(x,y)[0] - s.labV(x+dx,y+dy)[0]);
+                abdiffH[k] = ::square(s.labH(x,y)[1] - s.labH(x+dx,y+dy)[1]) +
+                             ::square(s.labH(x,y)[2] - s.labH(x+dx,y+dy)[2]);
+                abdiffV[k] = ::square(s.labV(x,y)[1] - s.labV(x+dx,y+dy)[1]) +
+                             ::square(s.labV(x,y)[2] - s.labV(x+dx,y+dy)[2]);
+            }
+
+            float leps = std::min(std::max(ldiffH[0], ldiffH[1]),
+                                  std::max(ldiffV[2], ldiffV[3]));
+            float abeps = std::min(std::max(abdiffH[0], abdiffH[1]),
+                                   std::max(abdiffV[2], abdiffV[3]));
+
+            // Count number of neighboring pixels that are visually similar
+            int homoH = 0, homoV = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                if (ldiffH[k] <= leps && abdiffH[k] <= abeps)
+                    homoH++;
+                if (ldiffV[k] <= leps && abdiffV[k] <= abeps)
+                    homoV++;
+            }
+            s.homogeneity(i, j) = int8_t(homoH - homoV);
+        }
+    }
+
+    // Combine the most homogenous pixels for the final result
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            // Sum up the homogeneity of both images in a 3x3 window
+            int hm = 0;
+            for (int j = y - 1 - hy; j <= y + 1 - hy; j++)
+                for (int i = x - 1 - hx; i <= x + 1 - hx; i++)
+                    hm += s.homogeneity(i, j);
+
+            const Vector3f & H = s.rgbH(x - cx, y - cy);
+            const Vector3f & V = s.rgbV(x - cx, y - cy);
+            // horizontal or vertical interpolation is more homogeneous, or there is no clear winner and we blend
+            Vector3f rgb = hm > 0 ? H : (hm < 0 ? V : Vector3f((H + V) * 0.5f));
+
+            // leave the raw color of the pixel untouched, since neighboring tiles read it
+            int rx = (x ^ redOffset.x()) & 1, ry = (y ^ redOffset.y()) & 1;
+            int own = rx != ry ? 1 : (rx == 0 ? 0 : 2);
+            for (int c = 0; c < 3; ++c)
+                if (c != own)
+                    img(x, y)[c] = rgb[c];
+        }
+    }
+}
+
+// the value at x of a resize filter, in units of output pixels
+float resizeFilterValue(HDRImage::ResizeFilter filter, float x)
+{
+    x = std::fabs(x);
+    switch (filter)
+    {
+        case HDRImage::BOX_FILTER:
+            return x <= 0.5f ? 1.f : 0.f;
+
+        case HDRImage::TENT_FILTER:
+            return std::max(0.f, 1.f - x);
+
+        case HDRImage::MITCHELL_FILTER:
+        {
+            // Mitchell-Netravali with B = C = 1/3
+            const float B = 1.f/3.f, C = 1.f/3.f;
+            if (x < 1.f)
+                return ((12 - 9*B - 6*C) * x*x*x + (-18 + 12*B + 6*C) * x*x + (6 - 2*B)) / 6.f;
+            if (x < 2.f)
+                return ((-B - 6*C) * x*x*x + (6*B + 30*C) * x*x + (-12*B - 48*C) * x + (8*B + 24*C)) / 6.f;
+            return 0.f;
+        }
+
+        case HDRImage::LANCZOS3_FILTER:
+        {
+            if (x < 1e-6f)
+                return 1.f;
+            if (x >= 3.f)
+                return 0.f;
+            float px = float(M_PI) * x;
+            return 3.f * std::sin(px) * std::sin(px / 3.f) / (px * px);
+        }
+
+        case HDRImage::GAUSSIAN_FILTER:
+            // standard deviation of half a pixel, truncated at 2 pixels
+            return x < 2.f ? std::exp(-2.f * x * x) : 0.f;
+    }
+    return 0.f;
+}
+
+float resizeFilterRadius(HDRImage::ResizeFilter filter)
+{
+    switch (filter)
+    {
+        case HDRImage::BOX_FILTER:      return 0.5f;
+        case HDRImage::TENT_FILTER:     return 1.f;
+        case HDRImage::MITCHELL_FILTER: return 2.f;
+        case HDRImage::LANCZOS3_FILTER: return 3.f;
+        case HDRImage::GAUSSIAN_FILTER: return 2.f;
+    }
+    return 1.f;
+}
+
+ResizeTaps resizeTaps(int srcSize, int dstSize, HDRImage::ResizeFilter filter)
+{
+    // When shrinking, the filter is stretched by the reduction factor so that it covers (and
+    // band-limits) all source pixels under each output pixel. When enlarging, it keeps its size
+    // and interpolates.
+    double scale = double(dstSize) / srcSize;
+    double filterScale = std::min(scale, 1.0);
+    double support = resizeFilterRadius(filter) / filterScale;
+
+    ResizeTaps taps;
+    taps.stride = int(std::ceil(2 * support)) + 2;
+    taps.first.resize(dstSize);
+    taps.count.resize(dstSize);
+    taps.lobeFirst.resize(dstSize);
+    taps.lobeCount.resize(dstSize);
+    taps.weight.assign(size_t(dstSize) * taps.stride, 0.f);
+    taps.begin = numeric_limits<int>::max();
+    taps.end = numeric_limits<int>::min();
+    for (int i = 0; i < dstSize; ++i)
+    {
+        // center of output pixel i, in source pixels
+        double center = (i + 0.5) / scale;
+        int begin = int(std::floor(center - support));
+        int end = std::min(int(std::ceil(center + support)) + 1, begin + taps.stride);
+
+        float * weights = &taps.weight[size_t(i) * taps.stride];
+        float total = 0.f;
+        int first = end, last = begin, lobeFirst = end, lobeLast = begin;
+        for (int j = begin; j < end; ++j)
+        {
+            float x = float((j + 0.5 - center) * filterScale);
+            float w = resizeFilterValue(filter, x);
+            weights[j - begin] = w;
+            total += w;
+            if (w != 0.f)
+            {
+                first = std::min(first, j);
+                last = j;
+            }
+            if (std::fabs(x) < 1.f)
+            {
+                lobeFirst = std::min(lobeFirst, j);
+                lobeLast = j;
+            }
+        }
+        // when enlarging, the central lobe may fall between two source pixels
+        if (lobeFirst > lobeLast)
+            lobeFirst = lobeLast = int(std::floor(center));
+
+        // keep only the run of nonzero weights
+        int n = last - first + 1;
+        copy(weights + (first - begin), weights + (first - begin) + n, weights);
+        fill(weights + n, weights + taps.stride, 0.f);
+        for (int k = 0; k < n; ++k)
+            weights[k] /= total;
+
+        taps.first[i] = first;
+        taps.count[i] = n;
+        taps.lobeFirst[i] = std::max(lobeFirst, first) - first;
+        taps.lobeCount[i] = std::min(lobeLast, last) - std::max(lobeFirst, first) + 1;
+        taps.begin = std::min(taps.begin, first);
+        taps.end = std::max(taps.end, first + n);
+    }
+    return taps;
+}
+
+// resize each row of src to the width of dst
+void resizeRows(const HDRImage & src, HDRImage & dst, const ResizeTaps & taps, bool clampRinging,
+                HDRImage::BorderMode mX, AtomicProgress progress)
+{
+    progress.setNumSteps(src.height());
+    parallel_for_range(0, src.height(), [&src,&dst,&taps,&progress,clampRinging,mX](int y0, int y1)
+    {
+        // each row is extended by the border pixels the filter reaches, so that all output
+        // pixels read plain runs of consecutive pixels
+        vector<Color4> line(taps.end - taps.begin);
+        for (int y = y0; y < y1; ++y)
+        {
+            progress.checkCanceled();
+
+            int inside0 = std::max(0, -taps.begin), inside1 = std::min(int(line.size()), src.width() - taps.begin);
+            for (int i = 0; i < inside0; ++i)
+                line[i] = src.pixel(i + taps.begin, y, mX, mX);
+            copy(&src(inside0 + taps.begin, y), &src(inside1 + taps.begin - 1, y) + 1, line.begin() + inside0);
+            for (int i = inside1; i < int(line.size()); ++i)
+                line[i] = src.pixel(i + taps.begin, y, mX, mX);
+
+            float * out = &dst(0, y)[0];
+            for (int x = 0; x < dst.width(); ++x, out += 4)
+            {
+                // a pixel fits in an Eigen packet, so each tap is a single vector operation
+                const float * in = &line[taps.first[x] - taps.begin][0];
+                const float * weights = &taps.weight[size_t(x) * taps.stride];
+                Array4f sum = Array4f::Zero();
+                for (int k = 0; k < taps.count[x]; ++k)
+                    sum += weights[k] * Array4f::Map(in + 4 * k);
+
+                if (clampRinging)
+                {
+                    // clamp to the range of the pixels under the central lobe
+                    const float * lobe = in + 4 * taps.lobeFirst[x];
+                    Array4f lo = Array4f::Map(lobe), hi = lo;
+                    for (int k = 1; k < taps.lobeCount[x]; ++k)
+                    {
+                        lo = lo.min(Array4f::Map(lobe + 4 * k));
+                        hi = hi.max(Array4f::Map(lobe + 4 * k));
+                    }
+                    sum = sum.max(lo).min(hi);
+                }
+
+                Array4f::Map(out) = sum;
+            }
+        }
+        progress += y1 - y0;
+    });
+}
+
+// resize each column of src to the height of dst
+void resizeColumns(const HDRImage & src, HDRImage & dst, const ResizeTaps & taps, bool clampRinging,
+                   HDRImage::BorderMode mY, AtomicProgress progress)
+{
+    // As in convolveColumns, each strip of columns is processed one output row at a time,
+    // adding up whole (contiguous) rows of the input.
+    progress.setNumSteps(src.width());
+    parallel_for_range(0, src.width(), 128, [&src,&dst,&taps,&progress,clampRinging,mY](int x0, int x1)
+    {
+        progress.checkCanceled();
+
+        int n = 4 * (x1 - x0);
+        vector<float> zeros(n, 0.f), lo, hi;
+        if (clampRinging)
+        {
+            lo.resize(n);
+            hi.resize(n);
+        }
+        for (int y = 0; y < dst.height(); ++y)
+        {
+            float * out = &dst(x0, y)[0];
+            fill_n(out, n, 0.f);
+            if (clampRinging)
+            {
+                fill(lo.begin(), lo.end(), numeric_limits<float>::infinity());
+                fill(hi.begin(), hi.end(), -numeric_limits<float>::infinity());
+            }
+            const float * weights = &taps.weight[size_t(y) * taps.stride];
+            int lobeBegin = taps.lobeFirst[y], lobeEnd = lobeBegin + taps.lobeCount[y];
+            for (int k = 0; k < taps.count[y]; ++k)
+            {
+                // pixels outside a BLACK border are zero
+                int yy = HDRImage::wrapCoordinate(taps.first[y] + k, src.height(), mY);
+                const float * in = yy < 0 ? zeros.data() : &src(x0, yy)[0];
+
+                float w = weights[k];
+                for (int i = 0; i < n; ++i)
+                    out[i] += w * in[i];
+
+                // clamp to the range of the pixels under the central lobe
+                if (clampRinging && k >= lobeBegin && k < lobeEnd)
+                    for (int i = 0; i < n; ++i)
+                    {
+                        lo[i] = std::min(lo[i], in[i]);
+                        hi[i] = std::max(hi[i], in[i]);
+                    }
+            }
+            if (clampRinging)
+                for (int i = 0; i < n; ++i)
+                    out[i] = std::max(lo[i], std::min(hi[i], out[i]));
+        }
+        progress += x1 - x0;
+    });
+}
+
+void readBilateralRegion(const HDRImage & img, int x0, int y0, int width, int height,
+                         HDRImage::BorderMode mX, HDRImage::BorderMode mY, BilateralRegion & region)
+{
+    // Black, negative and non-finite pixels are guided as if they had a tiny luminance. Pixels far
+    // darker than the brightest one around are all alike to the eye, so the guide is also clamped
+    // to a window below its maximum, which bounds the depth of the grid.
+    const float minLuminance = std::pow(2.f, -24.f);
+    const float maxStops = 24.f;
+
+    region.x0 = x0;
+    region.y0 = y0;
+    region.width = width;
+    region.height = height;
+    region.colors.resize(size_t(width) * height);
+    region.guide.resize(size_t(width) * height);
+
+    region.gMax = std::log2(minLuminance);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            size_t i = x + size_t(width) * y;
+            region.colors[i] = img.pixel(x0 + x, y0 + y, mX, mY);
+            float luminance = region.colors[i].luminance();
+            region.guide[i] = std::log2(std::isfinite(luminance) ? std::max(luminance, minLuminance) : minLuminance);
+            region.gMax = std::max(region.gMax, region.guide[i]);
+        }
+
+    float floor = region.gMax - maxStops;
+    region.gMin = region.gMax;
+    for (float & g : region.guide)
+    {
+        g = std::max(g, floor);
+        region.gMin = std::min(region.gMin, g);
+    }
+}
+
+void bilateralGridLayout(const BilateralRegion & region, float sigmaRange, float sigmaDomain,
+                         BilateralGridLayout & layout)
+{
+    layout.nx = int((region.width - 1) / sigmaDomain) + 2;
+    layout.ny = int((region.height - 1) / sigmaDomain) + 2;
+    layout.nz = int((region.gMax - region.gMin) / sigmaRange) + 2;
+
+    // each pixel is splatted into the slice below its luminance and the one above
+    layout.sliceIndex.assign(layout.nz, -1);
+    layout.sliceZ.clear();
+    for (float g : region.guide)
+    {
+        int iz = std::min(int((g - region.gMin) / sigmaRange), layout.nz - 2);
+        layout.sliceIndex[iz] = layout.sliceIndex[iz + 1] = 0;
+    }
+    for (int iz = 0; iz < layout.nz; ++iz)
+        if (layout.sliceIndex[iz] >= 0)
+        {
+            layout.sliceIndex[iz] = int(layout.sliceZ.size());
+            layout.sliceZ.push_back(iz);
+        }
+}
+
+/*!
+ * Filter the pixels [x0,x1) x [y0,y1) of \a region with a bilateral grid.
+ *
+ * See Chen et al., "Real-time Edge-Aware Image Processing with the Bilateral Grid" (2007). The
+ * pixels are splatted into a 3D grid over x, y and log2 luminance with cells one sigma across,
+ * which is blurred and then sampled at each pixel's position. Splatting and slicing with tents
+ * already blur by a variance of 1/6 cell^2 each, so the grid itself only needs to be blurred by
+ * the remainder.
+ *
+ * Only the luminance slices of the grid that some pixel falls into are stored and blurred: the
+ * others would only become non-empty through the blur along the luminance axis, and are never
+ * sampled. The memory and time therefore depend on the luminance levels actually present, rather
+ * than on the dynamic range of the region.
+ */
+void bilateralGridTile(const BilateralRegion & region, const BilateralGridLayout & layout, HDRImage & dst,
+                       int x0, int x1, int y0, int y1, float sigmaRange, float sigmaDomain)
+{
+    const int blurRadius = 3;
+    float blurKernel[2 * blurRadius + 1];
+    {
+        float sigma = std::sqrt(1.f - 2.f / 6.f), sum = 0.f;
+        for (int i = -blurRadius; i <= blurRadius; ++i)
+            sum += blurKernel[i + blurRadius] = std::exp(-i * i / (2.f * sigma * sigma));
+        for (float & k : blurKernel)
+            k /= sum;
+    }
+
+    // each cell holds the weighted sum of RGBA values, and the sum of weights
+    const int cellSize = 5;
+    int nx = layout.nx, ny = layout.ny, nz = layout.nz;
+    const vector<int> & sliceIndex = layout.sliceIndex, & sliceZ = layout.sliceZ;
+    int numSlices = int(sliceZ.size());
+
+    // the cell below and to the left of a region pixel's grid position, and the position within it
+    auto locate = [&](int rx, int ry, int & ix, int & iy, int & iz, float & tx, float & ty, float & tz)
+    {
+        float fx = rx / sigmaDomain, fy = ry / sigmaDomain;
+        float fz = (region.guide[rx + size_t(region.width) * ry] - region.gMin) / sigmaRange;
+        ix = std::min(int(fx), nx - 2);
+        iy = std::min(int(fy), ny - 2);
+        iz = std::min(int(fz), nz - 2);
+        tx = fx - ix;
+        ty = fy - iy;
+        tz = fz - iz;
+    };
+
+    size_t sliceStride = size_t(nx) * ny;
+    vector<float> grid(sliceStride * numSlices * cellSize, 0.f);
+
+    // the 8 cells surrounding the grid position of a region pixel, and their trilinear interpolation weights
+    auto corners = [&](int rx, int ry, size_t cells[8], float w[8])
+    {
+        int ix, iy, iz;
+        float tx, ty, tz;
+        locate(rx, ry, ix, iy, iz, tx, ty, tz);
+        size_t xy = ix + size_t(nx) * iy;
+        size_t z0 = sliceIndex[iz] * sliceStride, z1 = sliceIndex[iz + 1] * sliceStride;
+        for (int c = 0; c < 8; ++c)
+        {
+            cells[c] = xy + (c & 1) + (c & 2 ? size_t(nx) : 0) + (c & 4 ? z1 : z0);
+            w[c] = (c & 1 ? tx : 1.f - tx) * (c & 2 ? ty : 1.f - ty) * (c & 4 ? tz : 1.f - tz);
+        }
+    };
+
+    // splat
+    for (int ry = 0; ry < region.height; ++ry)
+        for (int rx = 0; rx < region.width; ++rx)
+        {
+            size_t cells[8];
+            float w[8];
+            corners(rx, ry, cells, w);
+            const Color4 & color = region.colors[rx + size_t(region.width) * ry];
+            for (int c = 0; c < 8; ++c)
+            {
+                float * cell = &grid[cells[c] * cellSize];
+                for (int k = 0; k < 4; ++k)
+                    cell[k] += w[c] * color[k];
+                cell[4] += w[c];
+            }
+        }
+
+    // blur along x and y; cells outside the grid are empty
+    int sizes[2] = {nx, ny};
+    size_t strides[2] = {1, size_t(nx)};
+    vector<float> line;
+    for (int axis = 0; axis < 2; ++axis)
+    {
+        int n = sizes[axis];
+        size_t stride = strides[axis];
+        line.resize(size_t(n) * cellSize);
+        for (size_t first = 0; first < grid.size() / cellSize; ++first)
+        {
+            // visit each line of cells along the axis once, starting from its first cell
+            if ((first / stride) % n != 0)
+                continue;
+
+            for (int i = 0; i < n; ++i)
+                copy_n(&grid[(first + i * stride) * cellSize], cellSize, &line[i * cellSize]);
+            for (int i = 0; i < n; ++i)
+            {
+                float * cell = &grid[(first + i * stride) * cellSize];
+                fill_n(cell, cellSize, 0.f);
+                for (int j = std::max(0, i - blurRadius); j <= std::min(n - 1, i + blurRadius); ++j)
+                    for (int k = 0; k < cellSize; ++k)
+                        cell[k] += blurKernel[j - i + blurRadius] * line[j * cellSize + k];
+            }
+        }
+    }
+
+    // blur along z, where the slices that are not stored are empty
+    line.resize(size_t(numSlices) * cellSize);
+    for (size_t xy = 0; xy < sliceStride; ++xy)
+    {
+        for (int s = 0; s < numSlices; ++s)
+            copy_n(&grid[(xy + s * sliceStride) * cellSize], cellSize, &line[s * cellSize]);
+        for (int s = 0; s < numSlices; ++s)
+        {
+            float * cell = &grid[(xy + s * sliceStride) * cellSize];
+            fill_n(cell, cellSize, 0.f);
+            int first = s, last = s;
+            while (first > 0 && sliceZ[s] - sliceZ[first - 1] <= blurRadius)
+                --first;
+            while (last + 1 < numSlices && sliceZ[last + 1] - sliceZ[s] <= blurRadius)
+                ++last;
+            for (int t = first; t <= last; ++t)
+                for (int k = 0; k < cellSize; ++k)
+                    cell[k] += blurKernel[sliceZ[t] - sliceZ[s] + blurRadius] * line[t * cellSize + k];
+        }
+    }
+
+    // slice
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+        {
+            size_t cells[8];
+            float w[8];
+            corners(x - region.x0, y - region.y0, cells, w);
+            float sum[cellSize] = {0.f, 0.f, 0.f, 0.f, 0.f};
+            for (int c = 0; c < 8; ++c)
+            {
+                const float * cell = &grid[cells[c] * cellSize];
+                for (int k = 0; k < cellSize; ++k)
+                    sum[k] += w[c] * cell[k];
+            }
+            dst(x, y) = Color4(sum[0], sum[1], sum[2], sum[3]) / sum[4];
+        }
+}
+
+/*!
+ * Filter the pixels [x0,x1) x [y0,y1) of \a region by directly weighing all neighbors within
+ * \a radius, with the same spatial and log2 luminance Gaussians that the bilateral grid approximates.
+ */
+void bilateralDirectTile(const BilateralRegion & region, HDRImage & dst, int x0, int x1, int y0, int y1,
+                         float sigmaRange, float sigmaDomain, int radius)
+{
+    // the weight of each neighbor is exp(domainExponent + rangeFactor * d^2)
+    int size = 2 * radius + 1;
+    vector<float> domainExponents(size_t(size) * size);
+    for (int dy = -radius; dy <= radius; ++dy)
+        for (int dx = -radius; dx <= radius; ++dx)
+            domainExponents[(dx + radius) + size_t(size) * (dy + radius)] =
+                -(dx * dx + dy * dy) / (2.f * sigmaDomain * sigmaDomain);
+    float rangeFactor = -1.f / (2.f * sigmaRange * sigmaRange);
+    // negligible weights are clamped to stay clear of denormals, which make exp very slow
+    const float minExponent = -80.f;
+
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+        {
+            int rx = x - region.x0, ry = y - region.y0;
+            float g = region.guide[rx + size_t(region.width) * ry];
+            Color4 accum(0.f, 0.f, 0.f, 0.f);
+            float weightSum = 0.f;
+            for (int dy = -radius; dy <= radius; ++dy)
+            {
+                size_t row = size_t(region.width) * (ry + dy);
+                const float * domainRow = &domainExponents[size_t(size) * (dy + radius)];
+                for (int dx = -radius; dx <= radius; ++dx)
+                {
+                    float d = region.guide[row + rx + dx] - g;
+                    float w = std::exp(std::max(domainRow[dx + radius] + rangeFactor * d * d, minExponent));
+                    accum += w * region.colors[row + rx + dx];
+                    weightSum += w;
+                }
+            }
+            dst(x, y) = accum / weightSum;
+        }
+}
+
+} // namespace
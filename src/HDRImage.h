@@ -71,6 +71,31 @@ public:
         return m;
     }
 
+    //-----------------------------------------------------------------------
+    //@{ \name Planar (single channel) access.
+    //-----------------------------------------------------------------------
+    //! A single channel stored as a contiguous plane of floats, indexed by (x,y) just like the image
+    using Plane = Eigen::ArrayXXf;
+    using ChannelStride = Eigen::Stride<Eigen::Dynamic, 4>;
+    //! A zero-copy, strided view of a single channel of the interleaved pixels
+    using ChannelView = Eigen::Map<Eigen::ArrayXXf, 0, ChannelStride>;
+    using ConstChannelView = Eigen::Map<const Eigen::ArrayXXf, 0, ChannelStride>;
+
+    ChannelView channelView(int c)
+    {
+        return ChannelView(reinterpret_cast<float*>(data()) + c, width(), height(), ChannelStride(4*width(), 4));
+    }
+    ConstChannelView channelView(int c) const
+    {
+        return ConstChannelView(reinterpret_cast<const float*>(data()) + c, width(), height(), ChannelStride(4*width(), 4));
+    }
+
+    //! Copy channel \a c into a contiguous plane
+    Plane channel(int c) const;
+    //! Overwrite channel \a c with the contents of \a plane, which must have the same size as the image
+    void setChannel(int c, const Plane & plane);
+    //@}
+
     //-----------------------------------------------------------------------
     //@{ \name Pixel accessors.
     //-----------------------------------------------------------------------
@@ -84,6 +109,8 @@ public:
     static const std::vector<std::string> & borderModeNames();
     Color4 & pixel(int x, int y, BorderMode mX = EDGE, BorderMode mY = EDGE);
     const Color4 & pixel(int x, int y, BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    //! The pixel index that coordinate \a p refers to along an axis of \a size pixels, or -1 outside a BLACK border
+    static int wrapCoordinate(int p, int size, BorderMode m);
     //@}
 
     //-----------------------------------------------------------------------
@@ -120,7 +147,29 @@ public:
         NUM_CANVAS_ANCHORS
     };
     HDRImage resizedCanvas(int width, int height, CanvasAnchor anchor, const Color4 & bgColor) const;
-    HDRImage resized(int width, int height) const;
+    //! Where pixel (0,0) of the old image ends up in a canvas resized from \a oldSize to \a newSize
+    static Eigen::Vector2i canvasOffset(const Eigen::Vector2i & oldSize, const Eigen::Vector2i & newSize,
+                                        CanvasAnchor anchor);
+    enum ResizeFilter : int
+    {
+        BOX_FILTER = 0,
+        TENT_FILTER,
+        MITCHELL_FILTER,
+        LANCZOS3_FILTER,
+        GAUSSIAN_FILTER
+    };
+    static const std::vector<std::string> & resizeFilterNames();
+    /*!
+     * Resize the image with a separable filter, one horizontal and one vertical pass.
+     *
+     * When shrinking, the filter is stretched to cover all the source pixels under each output
+     * pixel, so any reduction is done in a single pass without aliasing. The outputs of the
+     * filters with negative lobes (Mitchell and Lanczos) are clamped to the range of the pixels
+     * under the central lobe, so bright highlights do not ring into dark or negative halos.
+     */
+    HDRImage resized(int width, int height, ResizeFilter filter = MITCHELL_FILTER,
+                     AtomicProgress progress = AtomicProgress(),
+                     BorderMode mX = EDGE, BorderMode mY = EDGE) const;
     HDRImage resampled(int width, int height,
                        AtomicProgress progress = AtomicProgress(),
                        std::function<Eigen::Vector2f(const Eigen::Vector2f &)> warpFn =
@@ -134,6 +183,8 @@ public:
     //-----------------------------------------------------------------------
     HDRImage flippedVertical() const    {return rowwise().reverse().eval();}
     HDRImage flippedHorizontal() const  {return colwise().reverse().eval();}
+    void flipVertical()                 {rowwise().reverseInPlace();}
+    void flipHorizontal()               {colwise().reverseInPlace();}
     HDRImage rotated90CW() const        {return transpose().colwise().reverse().eval();}
     HDRImage rotated90CCW() const       {return transpose().rowwise().reverse().eval();}
     //@}
@@ -184,9 +235,28 @@ public:
     //-----------------------------------------------------------------------
     HDRImage inverted() const;
 	HDRImage brightnessContrast(float brightness, float contrast, bool linear, EChannel c) const;
+    /*!
+     * @brief Convolve with a 2D \a kernel, normalized to sum to one.
+     *
+     * Picks whichever of @ref convolvedDirect and @ref convolvedFFT is estimated to be
+     * faster for the size of the kernel.
+     */
     HDRImage convolved(const Eigen::ArrayXXf &kernel,
                        AtomicProgress progress,
                        BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    //! Convolution by direct summation over the kernel, O(kernel size) per pixel
+    HDRImage convolvedDirect(const Eigen::ArrayXXf &kernel,
+                             AtomicProgress progress,
+                             BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    /*!
+     * @brief Convolution in the frequency domain, O(log(kernel size)) per pixel.
+     *
+     * Uses overlap-add: the image is processed in blocks, each transformed on its own,
+     * so the memory used is bounded by the kernel size rather than the image size.
+     */
+    HDRImage convolvedFFT(const Eigen::ArrayXXf &kernel,
+                          AtomicProgress progress,
+                          BorderMode mX = EDGE, BorderMode mY = EDGE) const;
     HDRImage GaussianBlurred(float sigmaX, float sigmaY,
                              AtomicProgress progress,
                              BorderMode mX = EDGE, BorderMode mY = EDGE,
@@ -201,6 +271,17 @@ public:
     HDRImage fastGaussianBlurred(float sigmaX, float sigmaY,
                                  AtomicProgress progress,
                                  BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    /*!
+     * @brief Gaussian blur using the recursive (IIR) filter of Young and van Vliet.
+     *
+     * The cost per filtered pixel is constant regardless of sigma, but each row and column is
+     * padded by 4 sigma on both sides for the border mode to take effect, so the total cost
+     * grows with sigma once it is comparable to the image size. Blurs with a sigma below 2
+     * pixels, where the recursive approximation degrades, use the exact separable filter instead.
+     */
+    HDRImage recursiveGaussianBlurred(float sigmaX, float sigmaY,
+                                      AtomicProgress progress,
+                                      BorderMode mX = EDGE, BorderMode mY = EDGE) const;
     HDRImage boxBlurred(int w, AtomicProgress progress,
                         BorderMode mX = EDGE, BorderMode mY = EDGE) const
     {
@@ -218,22 +299,70 @@ public:
     HDRImage boxBlurredY(int halfSize, AtomicProgress progress,
                          BorderMode mode = EDGE) const {return boxBlurredY(halfSize, halfSize, progress, mode);}
     HDRImage unsharpMasked(float sigma, float strength, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    /*!
+     * @brief Median filter a single \a channel over a square (or, if \a round, circular) window.
+     *
+     * Uses a sliding-window histogram of each pixel's rank among its neighbors, so the result
+     * is exact, and the cost per pixel is nearly independent of the radius.
+     */
     HDRImage medianFiltered(float radius, int channel, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE, bool round = false) const;
-    HDRImage medianFiltered(float r, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE, bool round = false) const
-    {
-        return medianFiltered(r, 0, AtomicProgress(progress, 0.25f), mX, mY, round)
-            .medianFiltered(r, 1, AtomicProgress(progress, 0.25f), mX, mY, round)
-            .medianFiltered(r, 2, AtomicProgress(progress, 0.25f), mX, mY, round)
-            .medianFiltered(r, 3, AtomicProgress(progress, 0.25f), mX, mY, round);
-    }
+    //! Median filter all four channels (independently, but in a single pass)
+    HDRImage medianFiltered(float r, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE, bool round = false) const;
     HDRImage bilateralFiltered(float sigmaRange/* = 0.1f*/,
                                float sigmaDomain/* = 1.0f*/,
                                AtomicProgress progress,
                                BorderMode mX = EDGE, BorderMode mY = EDGE,
                                float truncateDomain = 6.0f) const;
+    /*!
+     * @brief Fast approximate bilateral filter using a bilateral grid.
+     *
+     * Unlike @ref bilateralFiltered, pixel similarity is measured by the difference in log2
+     * luminance, so \a sigmaRange is in stops and edges are preserved equally well in the
+     * shadows and highlights of HDR images. The cost per pixel decreases as the sigmas grow.
+     * Where the grid would take longer than weighing each pixel's neighbors directly, as for
+     * spatial sigmas of a pixel or two, the filter is evaluated directly instead.
+     *
+     * Throws std::invalid_argument unless both sigmas are positive.
+     */
+    HDRImage bilateralGridFiltered(float sigmaRange, float sigmaDomain,
+                                   AtomicProgress progress,
+                                   BorderMode mX = EDGE, BorderMode mY = EDGE) const;
     //@}
 
     bool load(const std::string & filename);
+
+    /*!
+     * @brief           Load only a sub-rectangle of an OpenEXR file, optionally from a reduced resolution level.
+     *
+     * For tiled files only the tiles overlapping the region are read and decoded, so the cost is
+     * proportional to the size of the region instead of the size of the whole image. Scanline files
+     * have just a single level, and are read one band of scanlines spanning the region.
+     *
+     * @param filename  Filename of the OpenEXR file to load from
+     * @param x, y      Top-left corner of the region, relative to the data window of the level
+     * @param w, h      Size of the region, which is clipped to the data window of the level
+     * @param levelX    The mip (levelX == levelY) or rip map level to load from
+     * @param levelY    The mip (levelX == levelY) or rip map level to load from
+     * @return          True if loading was successful
+     */
+    bool loadEXRRegion(const std::string & filename, int x, int y, int w, int h, int levelX = 0, int levelY = 0);
+
+    //! The resolution levels of an OpenEXR file, as reported by @ref queryEXRLevels
+    struct EXRLevels
+    {
+        bool tiled = false;         ///< Whether regions can be read tile by tile
+        std::vector<int> widths;    ///< The width of each x level, finest first
+        std::vector<int> heights;   ///< The height of each y level, finest first
+    };
+
+    /*!
+     * @brief           Read just the header of an OpenEXR file to determine its resolution levels.
+     *
+     * @param filename  Filename of the OpenEXR file
+     * @param levels    Receives the sizes of the levels. Scanline and single-level files have one level
+     * @return          False if \a filename is not a readable OpenEXR file
+     */
+    static bool queryEXRLevels(const std::string & filename, EXRLevels & levels);
     /*!
      * @brief           Write the file to disk.
      *
@@ -249,6 +378,16 @@ public:
     bool save(const std::string & filename,
               float gain, float gamma,
               bool sRGB, bool dither) const;
+    /*!
+     * @brief           Write the file to disk, after applying \a adjustments.
+     *
+     * Same as above, but the pointwise \a adjustments are fused with the tonemapping into
+     * a single pass, which is done one row at a time for LDR formats, without copying the image.
+     */
+    bool save(const std::string & filename,
+              float gain, float gamma,
+              bool sRGB, bool dither,
+              const PixelPipeline & adjustments) const;
 
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -5,9 +5,14 @@
 //
 
 #include "HDRImage.h"
+#include "HalfImage.h"           // for HalfImage
 #include "DitherMatrix256.h"    // for dither_matrix256
-#include <ImfArray.h>            // for Array2D
 #include <ImfRgbaFile.h>         // for RgbaInputFile, RgbaOutputFile
+#include <ImfInputFile.h>        // for InputFile
+#include <ImfTiledInputFile.h>   // for TiledInputFile
+#include <ImfFrameBuffer.h>      // for FrameBuffer, Slice
+#include <ImfChannelList.h>      // for ChannelList
+#include <ImfHeader.h>           // for Header
 #include <ImathBox.h>            // for Box2i
 #include <ImfTestFile.h>         // for isOpenExrFile
 #include <ImathVec.h>            // for Vec2
@@ -17,6 +22,7 @@
 #include <stdlib.h>              // for abs
 #include <algorithm>             // for nth_element, transform
 #include <cmath>                 // for floor, pow, exp, ceil, round, sqrt
+#include <cstdint>               // for int64_t
 #include <exception>             // for exception
 #include <functional>            // for pointer_to_unary_function, function
 #include <stdexcept>             // for runtime_error, out_of_range
@@ -25,6 +31,8 @@
 #include "Common.h"              // for lerp, mod, clamp, getExtension
 #include "Colorspace.h"
 #include "ParallelFor.h"
+#include "PixelKernels.h"
+#include "PixelPipeline.h"
 #include "Timer.h"
 #include <Eigen/Dense>
 #include <spdlog/spdlog.h>
@@ -76,6 +84,11 @@ void decode12BitToFloat(vector<float> &image, unsigned char *data, int width, in
 void decode14BitToFloat(vector<float> &image, unsigned char *data, int width, int height, bool swapEndian);
 void decode16BitToFloat(vector<float> &image, unsigned char *data, int width, int height, bool swapEndian);
 void printImageInfo(const tinydng::DNGImage & image);
+bool isChromaEXR(const Imf::Header & header);
+Imath::Box2i clippedRegion(const Imath::Box2i & dataWindow, int x, int y, int w, int h);
+bool insertColor4Slices(Imf::FrameBuffer & frameBuffer, HDRImage & img, const Imath::Box2i & window,
+                        const Imf::ChannelList & channels);
+void replicateRedChannel(HDRImage & img);
 HDRImage develop(vector<float> & raw,
                  const tinydng::DNGImage & param1,
                  const tinydng::DNGImage & param2);
@@ -84,17 +97,13 @@ void copyPixelsFromArray(HDRImage & img, float * data, int w, int h, int n, bool
 	if (n != 3 && n != 4)
 		throw runtime_error("Only 3- and 4-channel images are supported.");
 
-	// for every pixel in the image
+	// for every row in the image
 	parallel_for(0, h, [&img,w,n,data,convertToLinear](int y)
 	{
-		for (int x = 0; x < w; ++x)
-		{
-			Color4 c(data[n * (x + y * w) + 0],
-			         data[n * (x + y * w) + 1],
-			         data[n * (x + y * w) + 2],
-			         (n == 3) ? 1.f : data[4 * (x + y * w) + 3]);
-			img(x, y) = convertToLinear ? SRGBToLinear(c) : c;
-		}
+		expandToRGBA(data + size_t(n) * w * y, n, &img(0, y), w);
+		if (convertToLinear)
+			for (int x = 0; x < w; ++x)
+				img(x, y) = SRGBToLinear(img(x, y));
 	});
 }
 
@@ -171,36 +180,20 @@ bool HDRImage::load(const string & filename)
     // then try pfm
 	if (isPFMImage(filename.c_str()))
     {
-	    float * float_data = 0;
 	    try
 	    {
-		    w = 0;
-		    h = 0;
-
-		    if ((float_data = loadPFMImage(filename.c_str(), &w, &h, &n)))
+		    Timer timer;
+		    // decode straight into our pixels, without any intermediate buffer
+		    loadPFMImage(filename.c_str(), [this](int width, int height) -> float *
 		    {
-			    if (n == 3)
-			    {
-				    resize(w, h);
-
-				    Timer timer;
-				    // convert 3-channel pfm data to 4-channel internal representation
-				    copyPixelsFromArray(*this, float_data, w, h, 3, false);
-				    console->debug("Copying image data took: {} seconds.", (timer.elapsed() / 1000.f));
-
-				    delete [] float_data;
-				    return true;
-			    }
-			    else
-				    throw runtime_error("Only 3-channel PFMs are currently supported.");
-			    return true;
-		    }
-		    else
-			    throw runtime_error("Could not load PFM image.");
+			    resize(width, height);
+			    return reinterpret_cast<float *>(data());
+		    });
+		    console->debug("Reading PFM image took: {} seconds.", (timer.elapsed() / 1000.f));
+		    return true;
 	    }
 	    catch (const exception &e)
 	    {
-		    delete [] float_data;
 		    resize(0, 0);
 		    errors += string("\t") + e.what() + "\n";
 	    }
@@ -216,32 +209,42 @@ bool HDRImage::load(const string & filename)
 		    Imf::setGlobalThreadCount(thread::hardware_concurrency());
 		    Timer timer;
 
-		    Imf::RgbaInputFile file(filename.c_str());
-		    Imath::Box2i dw = file.dataWindow();
+		    Imf::InputFile file(filename.c_str());
+		    Imath::Box2i dw = file.header().dataWindow();
 
 		    w = dw.max.x - dw.min.x + 1;
 		    h = dw.max.y - dw.min.y + 1;
 
-		    Imf::Array2D<Imf::Rgba> pixels(h, w);
+		    if (isChromaEXR(file.header()))
+		    {
+			    // subsampled luminance/chroma images need the conversion done by the RGBA interface;
+			    // its half-float pixels have the same layout as a HalfImage, so read straight into one
+			    Imf::RgbaInputFile rgbaFile(filename.c_str());
+			    HalfImage pixels(w, h);
 
-		    file.setFrameBuffer(&pixels[0][0] - dw.min.x - dw.min.y * w, 1, w);
-		    file.readPixels(dw.min.y, dw.max.y);
+			    rgbaFile.setFrameBuffer(pixels.data() - dw.min.x - dw.min.y * w, 1, w);
+			    rgbaFile.readPixels(dw.min.y, dw.max.y);
 
-		    console->debug("Reading EXR image took: {} seconds.", (timer.lap() / 1000.f));
+			    console->debug("Reading EXR image took: {} seconds.", (timer.lap() / 1000.f));
 
+			    *this = pixels.decoded();
+
+			    console->debug("Converting EXR image data took: {} seconds.", (timer.lap() / 1000.f));
+			    return true;
+		    }
+
+		    // decode straight into our pixels, without any intermediate buffer
 		    resize(w, h);
+		    Imf::FrameBuffer frameBuffer;
+		    bool luminanceOnly = insertColor4Slices(frameBuffer, *this, dw, file.header().channels());
 
-		    // copy pixels over to the Image
-		    parallel_for(0, h, [this, w, &pixels](int y)
-		    {
-			    for (int x = 0; x < w; ++x)
-			    {
-				    const Imf::Rgba &p = pixels[y][x];
-				    (*this)(x, y) = Color4(p.r, p.g, p.b, p.a);
-			    }
-		    });
+		    file.setFrameBuffer(frameBuffer);
+		    file.readPixels(dw.min.y, dw.max.y);
 
-		    console->debug("Copying EXR image data took: {} seconds.", (timer.lap() / 1000.f));
+		    if (luminanceOnly)
+			    replicateRedChannel(*this);
+
+		    console->debug("Reading EXR image took: {} seconds.", (timer.lap() / 1000.f));
 		    return true;
 	    }
 	    catch (const exception &e)
@@ -415,9 +418,146 @@ shared_ptr<HDRImage> loadImage(const string & filename)
 }
 
 
+bool HDRImage::loadEXRRegion(const string & filename, int x, int y, int w, int h, int levelX, int levelY)
+{
+	auto console = spdlog::get("console");
+	try
+	{
+		bool tiled;
+		if (!Imf::isOpenExrFile(filename.c_str(), tiled))
+			throw runtime_error("Not an OpenEXR file.");
+
+		Imf::setGlobalThreadCount(thread::hardware_concurrency());
+		Timer timer;
+
+		// the pixels we decode cover the region, but may extend past it to whole tiles or scanlines
+		HDRImage buffer;
+		Imath::Box2i region, bufferWindow;
+		bool luminanceOnly = false;
+
+		if (tiled)
+		{
+			Imf::TiledInputFile file(filename.c_str());
+			if (!file.isValidLevel(levelX, levelY))
+				throw runtime_error(fmt::format("The file has no resolution level ({}, {}).", levelX, levelY));
+
+			Imath::Box2i dw = file.dataWindowForLevel(levelX, levelY);
+			region = clippedRegion(dw, x, y, w, h);
+
+			// only read the tiles overlapping the region
+			int tw = file.tileXSize(), th = file.tileYSize();
+			int tx0 = (region.min.x - dw.min.x) / tw, tx1 = (region.max.x - dw.min.x) / tw;
+			int ty0 = (region.min.y - dw.min.y) / th, ty1 = (region.max.y - dw.min.y) / th;
+			bufferWindow = Imath::Box2i(Imath::V2i(dw.min.x + tx0 * tw, dw.min.y + ty0 * th),
+			                            Imath::V2i(std::min(dw.max.x, dw.min.x + (tx1 + 1) * tw - 1),
+			                                       std::min(dw.max.y, dw.min.y + (ty1 + 1) * th - 1)));
+
+			buffer.resize(bufferWindow.max.x - bufferWindow.min.x + 1, bufferWindow.max.y - bufferWindow.min.y + 1);
+			Imf::FrameBuffer frameBuffer;
+			luminanceOnly = insertColor4Slices(frameBuffer, buffer, bufferWindow, file.header().channels());
+
+			file.setFrameBuffer(frameBuffer);
+			file.readTiles(tx0, tx1, ty0, ty1, levelX, levelY);
+		}
+		else
+		{
+			if (levelX != 0 || levelY != 0)
+				throw runtime_error("Scanline files only have a single resolution level.");
+
+			Imf::InputFile file(filename.c_str());
+			Imath::Box2i dw = file.header().dataWindow();
+			region = clippedRegion(dw, x, y, w, h);
+
+			if (isChromaEXR(file.header()))
+			{
+				// the luminance/chroma conversion needs the whole image
+				if (!load(filename))
+					return false;
+				buffer.swap(*this);
+				bufferWindow = dw;
+			}
+			else
+			{
+				// only read the scanlines spanning the region
+				bufferWindow = Imath::Box2i(Imath::V2i(dw.min.x, region.min.y), Imath::V2i(dw.max.x, region.max.y));
+				buffer.resize(dw.max.x - dw.min.x + 1, region.max.y - region.min.y + 1);
+				Imf::FrameBuffer frameBuffer;
+				luminanceOnly = insertColor4Slices(frameBuffer, buffer, bufferWindow, file.header().channels());
+
+				file.setFrameBuffer(frameBuffer);
+				file.readPixels(region.min.y, region.max.y);
+			}
+		}
+
+		console->debug("Reading EXR region took: {} seconds.", (timer.lap() / 1000.f));
+
+		if (bufferWindow == region)
+			swap(buffer);
+		else
+			*this = buffer.block(region.min.x - bufferWindow.min.x, region.min.y - bufferWindow.min.y,
+			                     region.max.x - region.min.x + 1, region.max.y - region.min.y + 1);
+
+		if (luminanceOnly)
+			replicateRedChannel(*this);
+
+		console->debug("Cropping EXR region took: {} seconds.", (timer.lap() / 1000.f));
+		return true;
+	}
+	catch (const exception &e)
+	{
+		resize(0, 0);
+		console->error("ERROR: Unable to read region of image file \"{}\":\n\t{}", filename, e.what());
+		return false;
+	}
+}
+
+
+bool HDRImage::queryEXRLevels(const string & filename, EXRLevels & levels)
+{
+	try
+	{
+		bool tiled;
+		if (!Imf::isOpenExrFile(filename.c_str(), tiled))
+			return false;
+
+		levels = EXRLevels();
+		levels.tiled = tiled;
+		if (tiled)
+		{
+			Imf::TiledInputFile file(filename.c_str());
+			for (int l = 0; l < file.numXLevels(); ++l)
+				levels.widths.push_back(file.levelWidth(l));
+			for (int l = 0; l < file.numYLevels(); ++l)
+				levels.heights.push_back(file.levelHeight(l));
+		}
+		else
+		{
+			Imf::InputFile file(filename.c_str());
+			Imath::Box2i dw = file.header().dataWindow();
+			levels.widths.push_back(dw.max.x - dw.min.x + 1);
+			levels.heights.push_back(dw.max.y - dw.min.y + 1);
+		}
+		return true;
+	}
+	catch (const exception &e)
+	{
+		spdlog::get("console")->debug("Unable to read OpenEXR header of \"{}\": {}", filename, e.what());
+		return false;
+	}
+}
+
+
 bool HDRImage::save(const string & filename,
                     float gain, float gamma,
                     bool sRGB, bool dither) const
+{
+    return save(filename, gain, gamma, sRGB, dither, PixelPipeline());
+}
+
+bool HDRImage::save(const string & filename,
+                    float gain, float gamma,
+                    bool sRGB, bool dither,
+                    const PixelPipeline & adjustments) const
 {
 	auto console = spdlog::get("console");
     string extension = getExtension(filename);
@@ -432,26 +572,15 @@ bool HDRImage::save(const string & filename,
 
     bool hdrFormat = (extension == "hdr") || (extension == "pfm") || (extension == "exr");
 
-    // if we need to tonemap, then modify a copy of the image data
-    if (gain != 1.0f || sRGB || gamma != 1.0f)
-    {
-        Color4 gainC = Color4(gain, gain, gain, 1.0f);
-        Color4 gammaC = Color4(1.0f / gamma, 1.0f / gamma, 1.0f / gamma, 1.0f);
+    // only do gamma or sRGB tonemapping if we are saving to an LDR format
+    PixelPipeline pipeline = adjustments;
+    pipeline.then(PixelPipeline::tonemap(gain, gamma, sRGB, !hdrFormat));
 
-        imgCopy = *this;
+    // HDR formats need the whole image, so modify a copy of the image data in a single pass
+    if (hdrFormat && !pipeline.empty())
+    {
+        imgCopy = pipeline.applied(*this);
         img = &imgCopy;
-
-        if (gain != 1.0f)
-            imgCopy *= gainC;
-
-        // only do gamma or sRGB tonemapping if we are saving to an LDR format
-        if (!hdrFormat)
-        {
-            if (sRGB)
-                imgCopy = imgCopy.unaryExpr(ptr_fun((Color4 (*)(const Color4 &)) LinearToSRGB));
-            else if (gamma != 1.0f)
-                imgCopy = imgCopy.pow(gammaC);
-        }
     }
 
     if (extension == "hdr")
@@ -464,25 +593,13 @@ bool HDRImage::save(const string & filename,
         {
             Imf::setGlobalThreadCount(thread::hardware_concurrency());
             Imf::RgbaOutputFile file(filename.c_str(), width(), height(), Imf::WRITE_RGBA);
-            Imf::Array2D<Imf::Rgba> pixels(height(), width());
 
             Timer timer;
-            // copy image data over to Rgba pixels
-            parallel_for(0, height(), [this,img,&pixels](int y)
-            {
-                for (int x = 0; x < width(); ++x)
-                {
-                    Imf::Rgba &p = pixels[y][x];
-                    Color4 c = (*img)(x, y);
-                    p.r = c[0];
-                    p.g = c[1];
-                    p.b = c[2];
-                    p.a = c[3];
-                }
-            });
+            // convert image data over to Rgba pixels
+            HalfImage pixels(*img);
             console->debug("Copying pixel data took: {} seconds.", (timer.lap()/1000.f));
 
-            file.setFrameBuffer(&pixels[0][0], 1, width());
+            file.setFrameBuffer(pixels.data(), 1, width());
             file.writePixels(height());
 
             console->debug("Writing EXR image took: {} seconds.", (timer.lap()/1000.f));
@@ -501,25 +618,27 @@ bool HDRImage::save(const string & filename,
 
         Timer timer;
         // convert 3-channel pfm data to 4-channel internal representation
-        parallel_for(0, height(), [this,img,&data,dither](int y)
+        parallel_for_range(0, height(), [this,&pipeline,&data,dither](int y0, int y1)
         {
-            for (int x = 0; x < width(); ++x)
+            // tonemap one row at a time, right before quantizing it
+            vector<Color4> row(pipeline.empty() ? 0 : width());
+            for (int y = y0; y < y1; ++y)
             {
-                Color4 c = (*img)(x, y);
-                if (dither)
+                const Color4 * src = &(*this)(0, y);
+                if (!pipeline.empty())
                 {
-                    int xmod = x % 256;
-                    int ymod = y % 256;
-                    float ditherValue = (dither_matrix256[xmod + ymod * 256] / 65536.0f - 0.5f) / 255.0f;
-                    c += Color4(Color3(ditherValue), 0.0f);
+                    copy(src, src + width(), row.begin());
+                    pipeline.apply(row.data(), row.size());
+                    src = row.data();
                 }
 
-                // convert to [0-255] range
-                c = (c * 255.0f).max(0.0f).min(255.0f);
+                float ditherRow[256];
+                if (dither)
+                    for (int xmod = 0; xmod < 256; ++xmod)
+                        ditherRow[xmod] = (dither_matrix256[xmod + (y % 256) * 256] / 65536.0f - 0.5f) / 255.0f;
 
-                data[3 * x + 3 * y * width() + 0] = (unsigned char) c[0];
-                data[3 * x + 3 * y * width() + 1] = (unsigned char) c[1];
-                data[3 * x + 3 * y * width() + 2] = (unsigned char) c[2];
+                // convert to [0-255] range
+                quantizeToRGB8(src, &data[3 * size_t(y) * width()], width(), dither ? ditherRow : nullptr);
             }
         });
         console->debug("Tonemapping to 8bit took: {} seconds.", (timer.elapsed()/1000.f));
@@ -1000,4 +1119,66 @@ void printImageInfo(const tinydng::DNGImage & image)
 		console->debug("shot_neutral not found!");
 }
 
+bool isChromaEXR(const Imf::Header & header)
+{
+	return header.channels().findChannel("RY") || header.channels().findChannel("BY");
+}
+
+/*!
+ * The \a w x \a h pixels at (\a x, \a y) relative to the top-left of \a dataWindow, clipped to it,
+ * in the absolute pixel coordinates used by OpenEXR
+ */
+Imath::Box2i clippedRegion(const Imath::Box2i & dataWindow, int x, int y, int w, int h)
+{
+	int64_t width = dataWindow.max.x - dataWindow.min.x + 1, height = dataWindow.max.y - dataWindow.min.y + 1;
+	int x0 = std::max(x, 0), y0 = std::max(y, 0);
+	int x1 = int(std::min(int64_t(x) + w, width)), y1 = int(std::min(int64_t(y) + h, height));
+	if (x0 >= x1 || y0 >= y1)
+		throw runtime_error("The requested region lies outside of the image.");
+
+	return Imath::Box2i(Imath::V2i(dataWindow.min.x + x0, dataWindow.min.y + y0),
+	                    Imath::V2i(dataWindow.min.x + x1 - 1, dataWindow.min.y + y1 - 1));
+}
+
+/*!
+ * Set up \a frameBuffer so that OpenEXR decodes straight into the pixels of \a img, which
+ * holds the pixel \a window of the file: each channel is a float slice into the Color4
+ * storage with strides matching its layout. Missing color channels are filled with 0,
+ * and missing alpha with 1.
+ *
+ * @return True if the file only contains luminance, which is decoded into the red channel
+ */
+bool insertColor4Slices(Imf::FrameBuffer & frameBuffer, HDRImage & img, const Imath::Box2i & window,
+                        const Imf::ChannelList & channels)
+{
+	const ptrdiff_t xStride = sizeof(Color4);
+	const ptrdiff_t yStride = xStride * img.width();
+	// OpenEXR addresses pixels by their absolute coordinates, so offset the base pointer accordingly
+	char * base = reinterpret_cast<char *>(img.data()) - window.min.x * xStride - window.min.y * yStride;
+
+	bool luminanceOnly = !channels.findChannel("R") && !channels.findChannel("G") &&
+	                     !channels.findChannel("B") && channels.findChannel("Y");
+
+	const char * names[4] = {luminanceOnly ? "Y" : "R", "G", "B", "A"};
+	for (int c = 0; c < 4; ++c)
+	{
+		if (luminanceOnly && (c == 1 || c == 2))
+			continue;
+
+		frameBuffer.insert(names[c], Imf::Slice(Imf::FLOAT, base + c * sizeof(float), xStride, yStride,
+		                                        1, 1, c == 3 ? 1.0 : 0.0));
+	}
+	return luminanceOnly;
+}
+
+void replicateRedChannel(HDRImage & img)
+{
+	parallel_for_range(0, img.height(), [&img](int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+			for (int x = 0; x < img.width(); ++x)
+				img(x, y).g = img(x, y).b = img(x, y).r;
+	});
+}
+
 } // namespace
\ No newline at end of file
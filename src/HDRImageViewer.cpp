@@ -43,6 +43,12 @@ Vector2f HDRImageViewer::clampedImageCoordinateAt(const Vector2f& position) cons
 	return imageCoordinate.cwiseMax(Vector2f::Zero()).cwiseMin(imageSizeF(m_currentImage));
 }
 
+void HDRImageViewer::visibleImageRegion(Vector2f& topLeft, Vector2f& bottomRight) const
+{
+	topLeft = clampedImageCoordinateAt(Vector2f::Zero());
+	bottomRight = clampedImageCoordinateAt(sizeF());
+}
+
 Vector2f HDRImageViewer::positionForCoordinate(const Vector2f& imageCoordinate) const
 {
 	return m_zoom * imageCoordinate + (m_offset + centerOffset(m_currentImage));
@@ -163,7 +169,7 @@ bool HDRImageViewer::mouseMotionEvent(const Vector2i& p, const Vector2i& rel, in
 	Vector2i pixel = imageCoordinateAt((p - mPos).cast<float>()).cast<int>();
 	Color4 pixelVal(0.f);
 	Color4 iPixelVal(0.f);
-	if (m_currentImage->contains(pixel))
+	if (m_currentImage->contains(pixel) && !m_currentImage->modifyingInPlace())
 	{
 		pixelVal = m_currentImage->image()(pixel.x(), pixel.y());
 		iPixelVal = (pixelVal * pow(2.f, m_exposure) * 255).min(255.f).max(0.f);
@@ -380,6 +386,9 @@ void HDRImageViewer::drawPixelGrid(NVGcontext* ctx) const
 
 void HDRImageViewer::drawPixelInfo(NVGcontext* ctx) const
 {
+	if (m_currentImage->modifyingInPlace())
+		return;
+
 	Vector2f xy0 = screenPositionForCoordinate(Vector2f::Zero());
 	int minJ = max(0, int(-xy0.y() / m_zoom));
 	int maxJ = min(m_currentImage->height() - 1, int(ceil((m_screen->size().y() - xy0.y()) / m_zoom)));
@@ -74,6 +74,9 @@ public:
 	 */
 	Vector2f clampedImageCoordinateAt(const Vector2f& position) const;
 
+	/// Calculates the image coordinates of the top-left and bottom-right corners of the visible part of the image.
+	void visibleImageRegion(Vector2f& topLeft, Vector2f& bottomRight) const;
+
 	/// Calculates the position inside the widget for the given image coordinate.
 	Vector2f positionForCoordinate(const Vector2f& imageCoordinate) const;
 
@@ -8,6 +8,8 @@
 #include <iostream>
 #include <docopt.h>
 #include "HDRViewer.h"
+#include "CommandHistory.h"
+#include "PixelKernels.h"
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/ostr.h>
 
@@ -34,6 +36,13 @@ Options:
   -g G, --gamma=G          Desired gamma value for exposure+gamma tonemapping.
                            An sRGB curve is used if gamma is not specified.
   -d, --no-dither          Disable dithering.
+  -u M, --undo-memory=M    Maximum memory in megabytes kept for undoing the edits
+                           of each image; the oldest edits are forgotten beyond
+                           that [default: 4096].
+  -s M, --undo-spill=M     Memory in megabytes that the edits of each image that
+                           are not about to be undone or redone may occupy; they
+                           are compressed, and moved to a temporary file beyond
+                           that [default: 1024].
   -v T, --verbose=T        Set verbosity threshold with lower values meaning
                            more verbose and higher values removing low-priority
                            messages.
@@ -99,6 +108,7 @@ int main(int argc, char **argv)
 
         console->info("Welcome to HDRView!");
         console->info("Verbosity threshold set to level {:d}.", verbosity);
+        console->debug("Using {} pixel kernels.", simdLevelName(activeSIMDLevel()));
 
         console->debug("Running with the following commands/arguments/options:");
         for (auto const& arg : docargs)
@@ -121,6 +131,14 @@ int main(int argc, char **argv)
         // dithering
         dither = !docargs["--no-dither"].asBool();
 
+        // undo memory budget
+        long undoMemory = max(0L, strtol(docargs["--undo-memory"].asString().c_str(), (char **)NULL, 10));
+        CommandHistory::setDefaultMemoryBudget(size_t(undoMemory) << 20);
+        console->info("Limiting the undo history of each image to {:d} MB.", undoMemory);
+        long undoSpill = max(0L, strtol(docargs["--undo-spill"].asString().c_str(), (char **)NULL, 10));
+        CommandHistory::setDefaultSpillThreshold(size_t(undoSpill) << 20);
+        console->info("Moving undo history beyond {:d} MB per image to disk.", undoSpill);
+
 	    // list of filenames
 	    inFiles = docargs["FILE"].asStringList();
 
@@ -151,7 +151,7 @@ HDRViewScreen::HDRViewScreen(float exposure, float gamma, bool sRGB, bool dither
 	normalizeButton->setCallback([this]()
 	                             {
 		                             auto img = m_imagesPanel->currentImage();
-		                             if (!img)
+		                             if (!img || img->modifyingInPlace())
 			                             return;
 		                             Color4 mC = img->image().max();
 		                             float mCf = max(mC[0], mC[1], mC[2]);
@@ -493,18 +493,18 @@ void HDRViewScreen::saveImage()
 void HDRViewScreen::flipImage(bool h)
 {
     if (h)
-		m_imagesPanel->modifyImage(
-		    [](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+		m_imagesPanel->modifyImageInPlace(
+		    [](HDRImage & img, AtomicProgress &) -> UndoPtr
 		    {
-			    return {make_shared<HDRImage>(img->flippedHorizontal()),
-			            make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->flippedHorizontal(); })};
+			    img.flipHorizontal();
+			    return make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->flippedHorizontal(); });
 		    });
     else
-		m_imagesPanel->modifyImage(
-		    [](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+		m_imagesPanel->modifyImageInPlace(
+		    [](HDRImage & img, AtomicProgress &) -> UndoPtr
 		    {
-			    return {make_shared<HDRImage>(img->flippedVertical()),
-			            make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->flippedVertical(); })};
+			    img.flipVertical();
+			    return make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->flippedVertical(); });
 		    });
 }
 
@@ -521,6 +521,10 @@ bool HDRViewScreen::keyboardEvent(int key, int scancode, int action, int modifie
     {
         case GLFW_KEY_ESCAPE:
         {
+            // first abort any long-running edit of the current image
+            if (m_imagesPanel->cancelModify())
+                return true;
+
             if (!m_okToQuitDialog)
             {
                 m_okToQuitDialog = new MessageDialog(this,
@@ -584,6 +588,10 @@ bool HDRViewScreen::keyboardEvent(int key, int scancode, int action, int modifie
 		    }
 		    return false;
 
+        case 'V':
+            m_imagesPanel->loadVisibleRegion();
+            return true;
+
         case '=':
         case GLFW_KEY_KP_ADD:
 		    m_imageView->zoomIn();
@@ -0,0 +1,62 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "HalfImage.h"
+#include <half.h>                // for half
+#include <atomic>                // for atomic
+#include <cmath>                 // for isnan
+#include "ParallelFor.h"
+
+using namespace std;
+
+HalfImage::HalfImage(const HDRImage & img) :
+    HalfImage(img.width(), img.height())
+{
+    parallel_for_range(0, m_height, [this,&img](int y0, int y1)
+    {
+        for (int y = y0; y < y1; ++y)
+            for (int x = 0; x < m_width; ++x)
+            {
+                const Color4 & c = img(x, y);
+                (*this)(x, y) = Imf::Rgba(c.r, c.g, c.b, c.a);
+            }
+    });
+}
+
+HDRImage HalfImage::decoded() const
+{
+    HDRImage img(m_width, m_height);
+    parallel_for_range(0, m_height, [this,&img](int y0, int y1)
+    {
+        for (int y = y0; y < y1; ++y)
+            for (int x = 0; x < m_width; ++x)
+            {
+                const Imf::Rgba & p = (*this)(x, y);
+                img(x, y) = Color4(p.r, p.g, p.b, p.a);
+            }
+    });
+    return img;
+}
+
+bool HalfImage::isExactlyRepresentable(const HDRImage & img)
+{
+    atomic<bool> exact(true);
+    parallel_for_range(0, img.height(), [&img,&exact](int y0, int y1)
+    {
+        for (int y = y0; y < y1 && exact; ++y)
+            for (int x = 0; x < img.width(); ++x)
+                for (int c = 0; c < 4; ++c)
+                {
+                    float v = img(x, y)[c];
+                    if (float(half(v)) != v && !std::isnan(v))
+                    {
+                        exact = false;
+                        return;
+                    }
+                }
+    });
+    return exact;
+}
@@ -0,0 +1,52 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <ImfRgba.h>             // for Rgba
+#include <cstddef>               // for size_t
+#include <vector>                // for vector
+#include "HDRImage.h"
+
+
+/*!
+ * @brief Compact half-float (fp16) RGBA image storage, using half the memory of an HDRImage.
+ *
+ * Pixels are stored as OpenEXR Imf::Rgba values with x as the fastest-varying coordinate, which
+ * is exactly the layout of a scanline EXR frame buffer, so EXR files can be read straight into
+ * a HalfImage without widening, and written from one.
+ *
+ * This is a storage format only: the images being viewed and edited are always fp32 HDRImages.
+ * A HalfImage holds the EXR frame buffers during I/O and the undo snapshots that fp16
+ * represents exactly, and is converted back with @ref decoded.
+ */
+class HalfImage
+{
+public:
+    HalfImage() = default;
+    HalfImage(int w, int h) : m_width(w), m_height(h), m_pixels(size_t(w) * h) {}
+    explicit HalfImage(const HDRImage & img);
+
+    int width() const                               {return m_width;}
+    int height() const                              {return m_height;}
+    bool isNull() const                             {return m_width == 0 || m_height == 0;}
+    size_t bytes() const                            {return m_pixels.size() * sizeof(Imf::Rgba);}
+
+    Imf::Rgba * data()                              {return m_pixels.data();}
+    const Imf::Rgba * data() const                  {return m_pixels.data();}
+    Imf::Rgba & operator()(int x, int y)            {return m_pixels[x + size_t(y) * m_width];}
+    const Imf::Rgba & operator()(int x, int y) const{return m_pixels[x + size_t(y) * m_width];}
+
+    //! Convert the image to fp32
+    HDRImage decoded() const;
+
+    //! Returns true if every value in \a img survives a round trip through fp16 unchanged
+    static bool isExactlyRepresentable(const HDRImage & img);
+
+private:
+    int m_width = 0, m_height = 0;
+    std::vector<Imf::Rgba> m_pixels;
+};
@@ -83,6 +83,7 @@ HelpWindow::HelpWindow(Widget *parent, function<void()> closeCallback)
 	addRow(imageLoading, COMMAND + "+S", "Save Image");
 	addRow(imageLoading, COMMAND + "+W or Delete", "Close Image");
 	addRow(imageLoading, COMMAND + "+Shift+W", "Close All Images");
+	addRow(imageLoading, "V", "Open the Visible Region of an EXR at the Current Zoom");
 	addRow(imageLoading, "Left Click", "Select Image");
 	addRow(imageLoading, "Shift+Left Click", "Select/Deselect Reference Image");
 	addRow(imageLoading, "1…9", "Select the N-th Image");
@@ -111,6 +112,7 @@ HelpWindow::HelpWindow(Widget *parent, function<void()> closeCallback)
 	addRow(edits, "F", "Flip image about horizontal axis");
 	addRow(edits, "M", "Mirror image about vertical axis");
 	addRow(edits, COMMAND + "+Z / " + COMMAND + "+Shift+Z", "Undo/Redo");
+	addRow(edits, "Esc", "Cancel the running edit");
 
 	new Label(column, "Panning/Zooming", "sans-bold", 16);
 	auto panningZooming = new Widget(column);
@@ -13,8 +13,11 @@
 #include "Well.h"
 #include <spdlog/spdlog.h>
 #include "Timer.h"
+#include "Common.h"
 #include <tinydir.h>
 #include <set>
+#include <climits>
+#include <cmath>
 
 
 using namespace std;
@@ -588,18 +591,42 @@ void ImageListPanel::loadImages(const vector<string> & filenames)
 		tinydir_close(&dir);
 	}
 
+	// multi-resolution EXRs too large for a single texture are opened at the finest level that fits
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+
 	// now start a bunch of asynchronous image loads
 	for (auto filename : allFilenames)
 	{
+		int level = 0;
+		HDRImage::EXRLevels levels;
+		if (HDRImage::queryEXRLevels(filename, levels) && levels.tiled)
+		{
+			int numLevels = int(min(levels.widths.size(), levels.heights.size()));
+			while (level + 1 < numLevels &&
+			       (levels.widths[level] > maxTextureSize || levels.heights[level] > maxTextureSize))
+				++level;
+		}
+
 		shared_ptr<GLImage> image = make_shared<GLImage>();
 		image->setImageModifyDoneCallback([this](){m_imageModifyDoneRequested = true;});
 		image->setFilename(filename);
+		image->setFileRegion(level, Eigen::Vector2i::Zero());
 		image->asyncModify(
-				[filename](const shared_ptr<const HDRImage> &) -> ImageCommandResult
+				[filename,level](const shared_ptr<const HDRImage> &) -> ImageCommandResult
 				{
 					Timer timer;
 					spdlog::get("console")->info("Trying to load image \"{}\"", filename);
-					shared_ptr<HDRImage> ret = loadImage(filename);
+					shared_ptr<HDRImage> ret;
+					if (level == 0)
+						ret = loadImage(filename);
+					else
+					{
+						spdlog::get("console")->info("Image is too large for the GPU, loading resolution level {} instead", level);
+						ret = make_shared<HDRImage>();
+						if (!ret->loadEXRRegion(filename, 0, 0, INT_MAX, INT_MAX, level, level))
+							ret = nullptr;
+					}
 					if (ret)
 						spdlog::get("console")->info("Loaded \"{}\" [{:d}x{:d}] in {} seconds", filename, ret->width(), ret->height(), timer.elapsed() / 1000.f);
 					else
@@ -614,6 +641,79 @@ void ImageListPanel::loadImages(const vector<string> & filenames)
 	setCurrentImageIndex(int(m_images.size() - 1));
 }
 
+bool ImageListPanel::loadVisibleRegion()
+{
+	auto img = currentImage();
+	if (!img || !img->canModify() || img->isNull())
+		return false;
+
+	auto console = spdlog::get("console");
+	string filename = img->filename();
+
+	HDRImage::EXRLevels levels;
+	if (!HDRImage::queryEXRLevels(filename, levels))
+	{
+		console->error("Can only load regions of OpenEXR images.");
+		return false;
+	}
+	if (img->isModified())
+	{
+		console->error("\"{}\" has been modified, so it no longer matches the file on disk.", filename);
+		return false;
+	}
+
+	int numLevels = int(min(levels.widths.size(), levels.heights.size()));
+	int currentLevel = min(img->fileLevel(), numLevels - 1);
+
+	// the visible part of the current image, in pixels of the full resolution image
+	Eigen::Vector2f toFull(float(levels.widths[0]) / levels.widths[currentLevel],
+	                       float(levels.heights[0]) / levels.heights[currentLevel]);
+	Eigen::Vector2f topLeft, bottomRight;
+	m_imageViewer->visibleImageRegion(topLeft, bottomRight);
+	Eigen::Vector2f fullMin = (topLeft + img->fileOrigin().cast<float>()).cwiseProduct(toFull);
+	Eigen::Vector2f fullMax = (bottomRight + img->fileOrigin().cast<float>()).cwiseProduct(toFull);
+
+	// choose the coarsest level that still provides at least one pixel per screen pixel
+	float screenPixelsPerFullPixel = m_imageViewer->scale() * m_screen->pixelRatio() / toFull.minCoeff();
+	int level = levels.tiled ? clamp(int(floor(log2(1.f / screenPixelsPerFullPixel))), 0, numLevels - 1) : 0;
+
+	// ... and the same region, in pixels of that level
+	Eigen::Vector2f toLevel(float(levels.widths[level]) / levels.widths[0],
+	                        float(levels.heights[level]) / levels.heights[0]);
+	Eigen::Vector2i origin = fullMin.cwiseProduct(toLevel).array().floor().cast<int>().matrix();
+	Eigen::Vector2i size = (fullMax.cwiseProduct(toLevel).array().ceil().cast<int>() - origin.array()).max(1).matrix();
+
+	if (level == currentLevel && origin == img->fileOrigin() && size == img->size())
+	{
+		console->info("The visible region of \"{}\" is already loaded at resolution level {}.", filename, level);
+		return false;
+	}
+
+	shared_ptr<GLImage> image = make_shared<GLImage>();
+	image->setImageModifyDoneCallback([this](){m_imageModifyDoneRequested = true;});
+	image->setFilename(filename);
+	image->setFileRegion(level, origin);
+	image->asyncModify(
+			[filename,origin,size,level](const shared_ptr<const HDRImage> &) -> ImageCommandResult
+			{
+				Timer timer;
+				shared_ptr<HDRImage> ret = make_shared<HDRImage>();
+				if (!ret->loadEXRRegion(filename, origin.x(), origin.y(), size.x(), size.y(), level, level))
+					return {nullptr, nullptr};
+
+				spdlog::get("console")->info("Loaded region [{:d}x{:d}] at ({:d}, {:d}) of resolution level {} of \"{}\" in {} seconds",
+				                             ret->width(), ret->height(), origin.x(), origin.y(), level, filename,
+				                             timer.elapsed() / 1000.f);
+				return {ret, nullptr};
+			});
+	image->recomputeHistograms(m_imageViewer->exposure());
+	m_images.emplace_back(image);
+
+	m_numImagesCallback();
+	setCurrentImageIndex(int(m_images.size() - 1));
+	return true;
+}
+
 bool ImageListPanel::saveImage(const string & filename, float exposure, float gamma, bool sRGB, bool dither)
 {
 	if (!currentImage() || !filename.size())
@@ -679,9 +779,9 @@ void ImageListPanel::modifyImage(const ImageCommand & command)
 				{
 					auto ret = command(img);
 
-					// if no undo was provided, just create a FullImageUndo
+					// if no undo was provided, store just what changed
 					if (!ret.second)
-						ret.second = make_shared<FullImageUndo>(*img);
+						ret.second = createUndo(*img, *ret.first);
 
 					return ret;
 				});
@@ -698,9 +798,9 @@ void ImageListPanel::modifyImage(const ImageCommandWithProgress & command)
 				{
 					auto ret = command(img, progress);
 
-					// if no undo was provided, just create a FullImageUndo
+					// if no undo was provided, store just what changed
 					if (!ret.second)
-						ret.second = make_shared<FullImageUndo>(*img);
+						ret.second = createUndo(*img, *ret.first);
 
 					return ret;
 				});
@@ -708,16 +808,40 @@ void ImageListPanel::modifyImage(const ImageCommandWithProgress & command)
 	}
 }
 
+void ImageListPanel::modifyImageInPlace(const ImageInPlaceCommand & command)
+{
+	if (currentImage())
+	{
+		m_images[m_current]->asyncModifyInPlace(command);
+		m_screen->updateCaption();
+	}
+}
+
+void ImageListPanel::adjustImage(const PixelPipeline & adjustment)
+{
+	if (currentImage())
+	{
+		m_images[m_current]->asyncAdjust(adjustment);
+        m_screen->updateCaption();
+	}
+}
+
+bool ImageListPanel::cancelModify()
+{
+	return currentImage() && m_images[m_current]->cancelModify();
+}
+
+// undo and redo run asynchronously, like other modifications, and report back when done
 void ImageListPanel::undo()
 {
 	if (currentImage() && m_images[m_current]->undo())
-		m_imageModifyDoneCallback(m_current);
+		m_screen->updateCaption();
 }
 
 void ImageListPanel::redo()
 {
 	if (currentImage() && m_images[m_current]->redo())
-		m_imageModifyDoneCallback(m_current);
+		m_screen->updateCaption();
 }
 
 
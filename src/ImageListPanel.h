@@ -43,6 +43,7 @@ public:
 
 	// Loading, saving, closing, and rearranging the images in the image stack
 	void loadImages(const std::vector<std::string> & filenames);
+	bool loadVisibleRegion();
 	bool saveImage(const std::string & filename, float exposure = 0.f, float gamma = 2.2f,
 				   bool sRGB = true, bool dither = true);
 	bool closeImage();
@@ -51,6 +52,9 @@ public:
 	// Modify the image data
 	void modifyImage(const ImageCommand & command);
 	void modifyImage(const ImageCommandWithProgress & command);
+	void modifyImageInPlace(const ImageInPlaceCommand & command);
+	void adjustImage(const PixelPipeline & adjustment);
+	bool cancelModify();
 	void undo();
 	void redo();
 
@@ -0,0 +1,191 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "ImagePyramid.h"
+#include <algorithm>             // for min, max
+#include <cmath>                 // for ceil, floor, log2, round, isfinite
+#include <limits>                // for numeric_limits
+#include <stdexcept>             // for invalid_argument
+#include "Common.h"              // for lerp
+#include "ParallelFor.h"         // for parallel_for_range
+#include "Timer.h"               // for Timer
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using namespace Eigen;
+
+
+// local functions
+namespace
+{
+
+// The offset from a to b, in pixels. Along REPEAT axes, this is the shorter way around the image;
+// non-finite offsets are infinitely long.
+Vector2f pixelOffset(const Vector2f & a, const Vector2f & b, const Array2f & size,
+                     HDRImage::BorderMode mX, HDRImage::BorderMode mY)
+{
+    Vector2f d = b - a;
+    if (!std::isfinite(d.x()) || !std::isfinite(d.y()))
+        return Vector2f::Constant(numeric_limits<float>::infinity());
+    if (mX == HDRImage::REPEAT)
+        d.x() -= size.x() * std::round(d.x() / size.x());
+    if (mY == HDRImage::REPEAT)
+        d.y() -= size.y() * std::round(d.y() / size.y());
+    return d;
+}
+
+// the shorter of the two one-sided differences, so that footprints do not span discontinuities of the warp
+Vector2f shorterOffset(const Vector2f & backward, const Vector2f & forward)
+{
+    return backward.squaredNorm() <= forward.squaredNorm() ? backward : forward;
+}
+
+} // namespace
+
+
+ImagePyramid::ImagePyramid(const shared_ptr<const HDRImage> & image,
+                           HDRImage::BorderMode mX, HDRImage::BorderMode mY, AtomicProgress progress) :
+    m_mX(mX), m_mY(mY)
+{
+    if (!image || image->isNull())
+        throw invalid_argument("Cannot build the pyramid of an empty image.");
+
+    Timer timer;
+    m_levels.push_back(image);
+    // each level takes a quarter of the work of the previous one
+    float fraction = 0.75f;
+    while (m_levels.back()->width() > 1 || m_levels.back()->height() > 1)
+    {
+        const HDRImage & prev = *m_levels.back();
+        int w = std::max(1, (prev.width() + 1) / 2), h = std::max(1, (prev.height() + 1) / 2);
+        m_levels.push_back(make_shared<HDRImage>(prev.resized(w, h, HDRImage::BOX_FILTER,
+                                                              AtomicProgress(progress, fraction), mX, mY)));
+        fraction /= 4;
+    }
+    spdlog::get("console")->debug("Building the {:d}-level pyramid of a {:d}x{:d} image took: {} seconds.",
+                                  numLevels(), image->width(), image->height(), (timer.elapsed()/1000.f));
+}
+
+size_t ImagePyramid::bytes() const
+{
+    size_t total = 0;
+    for (int i = 1; i < numLevels(); ++i)
+        total += level(i).size() * sizeof(Color4);
+    return total;
+}
+
+int ImagePyramid::levelAtLeast(int width, int height) const
+{
+    int l = 0;
+    while (l + 1 < numLevels() && level(l + 1).width() >= width && level(l + 1).height() >= height)
+        ++l;
+    return l;
+}
+
+int ImagePyramid::levelAtMost(int width, int height) const
+{
+    int l = 0;
+    while (l + 1 < numLevels() && (level(l).width() > width || level(l).height() > height))
+        ++l;
+    return l;
+}
+
+Color4 ImagePyramid::trilinear(float sx, float sy, float lod) const
+{
+    lod = std::min(std::max(lod, 0.f), float(numLevels() - 1));
+    int l0 = int(std::floor(lod));
+    float t = lod - l0;
+
+    auto bilinear = [this,sx,sy](int l)
+    {
+        const HDRImage & L = level(l);
+        return L.bilinear(sx * L.width() / level(0).width(), sy * L.height() / level(0).height(), m_mX, m_mY);
+    };
+
+    Color4 c0 = bilinear(l0);
+    if (t == 0.f || l0 + 1 >= numLevels())
+        return c0;
+    return lerp(c0, bilinear(l0 + 1), t);
+}
+
+Color4 ImagePyramid::filtered(const Vector2f & p, const Vector2f & dpdx, const Vector2f & dpdy,
+                              int maxAnisotropy) const
+{
+    float lx = dpdx.norm(), ly = dpdy.norm();
+
+    // Cover the parallelogram with a grid of lookups, 6 along the shorter side, and up to maxAnisotropy
+    // times as many along the longer one, but no closer than a third of a pixel. Each lookup filters a
+    // neighborhood about as large as the spacing of the lookups, from the level whose pixels are that large.
+    // Compared to a single lookup from a coarser level, this keeps the result close to the box-filtered
+    // footprint that super-sampling computes, for a cost that does not depend on the size of the footprint.
+    const int lookupsPerSide = 6;
+    float minorLength = std::min(lx, ly), majorLength = std::max(lx, ly);
+    float spacing = std::max(std::max(minorLength, majorLength / std::max(1, maxAnisotropy)) / lookupsPerSide, 1.f / 3.f);
+    int nx = std::max(1, int(std::ceil(lx / spacing - 1e-3f)));
+    int ny = std::max(1, int(std::ceil(ly / spacing - 1e-3f)));
+    float lod = std::log2(spacing);
+
+    if (nx == 1 && ny == 1)
+        return trilinear(p.x(), p.y(), lod);
+
+    Color4 sum(0.f);
+    for (int j = 0; j < ny; ++j)
+        for (int i = 0; i < nx; ++i)
+        {
+            Vector2f q = p + dpdx * ((i + 0.5f) / nx - 0.5f) + dpdy * ((j + 0.5f) / ny - 0.5f);
+            sum += trilinear(q.x(), q.y(), lod);
+        }
+    return sum / float(nx * ny);
+}
+
+HDRImage ImagePyramid::warped(int w, int h, const WarpFn & warpFn, AtomicProgress progress) const
+{
+    if (isNull())
+        throw invalid_argument("Cannot resample an empty pyramid.");
+
+    Timer timer;
+    HDRImage result(w, h);
+    Array2f srcSize(level(0).width(), level(0).height());
+    progress.setNumSteps(h);
+    parallel_for_range(0, h, [this,w,h,&warpFn,&srcSize,&result,&progress](int y0, int y1)
+    {
+        progress.checkCanceled();
+
+        // the warped centers of the rows of this range and of the rows just above and below it
+        int r0 = std::max(0, y0 - 1), r1 = std::min(h, y1 + 1);
+        vector<Vector2f> centers(size_t(w) * (r1 - r0));
+        for (int y = r0; y < r1; ++y)
+            for (int x = 0; x < w; ++x)
+                centers[size_t(y - r0) * w + x] =
+                    warpFn(Vector2f((x + 0.5f) / w, (y + 0.5f) / h)).array() * srcSize;
+
+        auto center = [&centers,w,r0](int x, int y) -> const Vector2f & {return centers[size_t(y - r0) * w + x];};
+        const Vector2f infinite = Vector2f::Constant(numeric_limits<float>::infinity());
+
+        for (int y = y0; y < y1; ++y)
+        {
+            for (int x = 0; x < w; ++x)
+            {
+                // the Jacobian of the warp, in source pixels per output pixel, from the neighbors' centers
+                const Vector2f & p = center(x, y);
+                Vector2f dpdx = shorterOffset(x > 0 ? pixelOffset(center(x - 1, y), p, srcSize, m_mX, m_mY) : infinite,
+                                              x < w - 1 ? pixelOffset(p, center(x + 1, y), srcSize, m_mX, m_mY) : infinite);
+                Vector2f dpdy = shorterOffset(y > 0 ? pixelOffset(center(x, y - 1), p, srcSize, m_mX, m_mY) : infinite,
+                                              y < h - 1 ? pixelOffset(p, center(x, y + 1), srcSize, m_mX, m_mY) : infinite);
+                // a single row or column of output pixels has no neighbors along that axis
+                if (!std::isfinite(dpdx.x()))
+                    dpdx = Vector2f::Zero();
+                if (!std::isfinite(dpdy.x()))
+                    dpdy = Vector2f::Zero();
+
+                result(x, y) = filtered(p, dpdx, dpdy);
+            }
+        }
+        progress += y1 - y0;
+    });
+    spdlog::get("console")->trace("Filtered resampling took: {} seconds.", (timer.elapsed()/1000.f));
+    return result;
+}
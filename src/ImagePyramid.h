@@ -0,0 +1,97 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <functional>            // for function
+#include <memory>                // for shared_ptr
+#include <vector>                // for vector
+#include <Eigen/Core>            // for Vector2f
+#include "HDRImage.h"            // for HDRImage, BorderMode
+#include "Progress.h"            // for AtomicProgress
+
+
+/*!
+ * @brief A mip-map of an image: the image itself, followed by copies of half the size of the previous one.
+ *
+ * Each level is box-filtered from the previous one, down to a single pixel. Lookups take
+ * coordinates in pixels of the full resolution image (level 0), together with a level of
+ * detail, or with the extent of the area to filter, and cost the same however large that area is.
+ */
+class ImagePyramid
+{
+public:
+    using WarpFn = std::function<Eigen::Vector2f(const Eigen::Vector2f &)>;
+
+    ImagePyramid() = default;
+
+    /*!
+     * Build the pyramid of \a image, which becomes level 0 and is not copied.
+     *
+     * @param mX,mY     How to access pixels outside of the image, both to build and to look up the levels
+     */
+    ImagePyramid(const std::shared_ptr<const HDRImage> & image,
+                 HDRImage::BorderMode mX = HDRImage::EDGE, HDRImage::BorderMode mY = HDRImage::EDGE,
+                 AtomicProgress progress = AtomicProgress());
+
+    /*!
+     * Share the levels of \a other, but look up pixels outside of them with different border modes.
+     *
+     * The levels are not rebuilt, so they still reflect the border modes of \a other where a level of
+     * odd size was halved; this only affects its last row or column.
+     */
+    ImagePyramid(const ImagePyramid & other, HDRImage::BorderMode mX, HDRImage::BorderMode mY) :
+        m_levels(other.m_levels), m_mX(mX), m_mY(mY) {}
+
+    bool isNull() const                         {return m_levels.empty();}
+    int numLevels() const                       {return int(m_levels.size());}
+    const HDRImage & level(int i) const         {return *m_levels[i];}
+    const std::shared_ptr<const HDRImage> & levelPtr(int i) const {return m_levels[i];}
+    HDRImage::BorderMode borderModeX() const    {return m_mX;}
+    HDRImage::BorderMode borderModeY() const    {return m_mY;}
+
+    //! The memory taken by the levels other than level 0, in bytes
+    size_t bytes() const;
+
+    //! The coarsest level with at least \a width x \a height pixels, or level 0 if even that one is smaller
+    int levelAtLeast(int width, int height) const;
+
+    //! The finest level with at most \a width x \a height pixels, or the coarsest level if none is that small
+    int levelAtMost(int width, int height) const;
+
+    /*!
+     * Trilinear lookup: a bilinear lookup in the two levels around \a lod, linearly interpolated.
+     *
+     * @param sx,sy     The position in pixels of level 0
+     * @param lod       The (fractional) level; it is clamped to the available levels
+     */
+    Color4 trilinear(float sx, float sy, float lod) const;
+
+    /*!
+     * Average the image over the parallelogram centered at \a p and spanned by \a dpdx and \a dpdy,
+     * all in pixels of level 0.
+     *
+     * Like the anisotropic filtering of GPUs, this combines several trilinear lookups, spread over the
+     * parallelogram. Their number is bounded, so the cost does not grow with the size of the parallelogram;
+     * parallelograms more than \a maxAnisotropy times longer than wide are blurred along the shorter side.
+     */
+    Color4 filtered(const Eigen::Vector2f & p, const Eigen::Vector2f & dpdx, const Eigen::Vector2f & dpdy,
+                    int maxAnisotropy = 8) const;
+
+    /*!
+     * Like HDRImage::resampled, but each output pixel is filtered over its footprint in the source image.
+     *
+     * The footprint of each output pixel is estimated from the Jacobian of \a warpFn, using the warped
+     * positions of the neighboring pixels. Compared to super-sampling, the cost per pixel stays small
+     * where the image is heavily minified, e.g. near the poles of a latitude-longitude map, and the
+     * warp is only evaluated once per pixel.
+     */
+    HDRImage warped(int width, int height, const WarpFn & warpFn, AtomicProgress progress = AtomicProgress()) const;
+
+private:
+    std::vector<std::shared_ptr<const HDRImage>> m_levels;
+    HDRImage::BorderMode m_mX = HDRImage::EDGE, m_mY = HDRImage::EDGE;
+};
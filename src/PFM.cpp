@@ -5,13 +5,32 @@
 //
 
 #include "PFM.h"
+#include "ParallelFor.h"
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include <cmath>
 #include <cstdint>
 
+#if defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
 using namespace std;
 
 
@@ -34,6 +53,84 @@ float reinterpretAsHostEndian(float f, bool bigEndian)
 	return ret;
 }
 
+/*!
+ * Read-only memory mapping of an entire file, so that its contents are paged in on demand
+ * by the OS instead of being copied into an intermediate buffer.
+ */
+class MappedFile
+{
+public:
+	explicit MappedFile(const char *filename)
+	{
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		                          FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw runtime_error("loadPFMImage: Error opening");
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			throw runtime_error("loadPFMImage: Empty file");
+		}
+		m_size = size_t(size.QuadPart);
+
+		// the view keeps the file and the mapping alive, so we can close their handles right away
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (!mapping)
+			throw runtime_error("loadPFMImage: Could not map file into memory");
+
+		m_data = (const unsigned char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+#else
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0)
+			throw runtime_error("loadPFMImage: Error opening");
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			throw runtime_error("loadPFMImage: Empty file");
+		}
+		m_size = size_t(st.st_size);
+
+		// the mapping stays valid after closing the file descriptor
+		void * addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr != MAP_FAILED)
+		{
+			// we are about to read all of it
+			madvise(addr, m_size, MADV_WILLNEED);
+			m_data = (const unsigned char *) addr;
+		}
+#endif
+		if (!m_data)
+			throw runtime_error("loadPFMImage: Could not map file into memory");
+	}
+
+	~MappedFile()
+	{
+#if defined(_WIN32)
+		UnmapViewOfFile(m_data);
+#else
+		munmap((void *) m_data, m_size);
+#endif
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+
+	const unsigned char * data() const  {return m_data;}
+	size_t size() const                 {return m_size;}
+
+private:
+	const unsigned char * m_data = nullptr;
+	size_t m_size = 0;
+};
+
 } // end namespace
 
 bool isPFMImage(const char *filename) noexcept
@@ -76,64 +173,74 @@ bool isPFMImage(const char *filename) noexcept
 	}
 }
 
-float * loadPFMImage(const char *filename, int *width, int *height, int *numChannels)
+int loadPFMImage(const char *filename, const function<float *(int width, int height)> & allocate)
 {
-	float * data = nullptr;
-	FILE *f = nullptr;
-	int numInputsRead = 0;
-
 	try
 	{
-		f = fopen(filename, "rb");
+		MappedFile file(filename);
 
-		if (!f)
-			throw runtime_error("loadPFMImage: Error opening");
+		// the header is short, so parse a null-terminated copy of the beginning of the file
+		string header((const char *) file.data(), min(file.size(), size_t(1024)));
 
-		char buffer[1024];
-		numInputsRead = fscanf(f, "%2s\n", buffer);
-		if (numInputsRead != 1)
+		char magic[3];
+		if (sscanf(header.c_str(), "%2s", magic) != 1)
 			throw runtime_error("loadPFMImage: Could not read number of channels in header");
 
-	    if (strcmp(buffer, "Pf") == 0)
-	        *numChannels = 1;
-	    else if (strcmp(buffer, "PF") == 0)
-	        *numChannels = 3;
-	    else
+		int numChannels;
+		if (strcmp(magic, "Pf") == 0)
+			numChannels = 1;
+		else if (strcmp(magic, "PF") == 0)
+			numChannels = 3;
+		else
 			throw runtime_error("loadPFMImage: Cannot deduce number of channels from header");
 
-
-		numInputsRead = fscanf(f, "%d%d", width, height);
-		if (numInputsRead != 2 || *width <= 0 || *height <= 0)
-	    	throw runtime_error("loadPFMImage: Invalid image width or height");
-
+		int width, height, headerLength = 0;
 		float scale;
-		numInputsRead = fscanf(f, "%f", &scale);
-		if (numInputsRead != 1)
-	    	throw runtime_error("loadPFMImage: Invalid file endianness. Big-Endian files not supported");
-
-	    bool bigEndian = scale > 0.0f;
-
-		data = new float[(*width) * (*height) * 3];
-
-		if (fread(data, 1, 1, f) != 1)
-			throw runtime_error("loadPFMImage: Unknown error");
-
-		size_t numFloats = static_cast<size_t>((*width) * (*height) * (*numChannels));
-		if (fread(data, sizeof(float), numFloats, f) != numFloats)
+		if (sscanf(header.c_str(), "%*2s %d %d %f%n", &width, &height, &scale, &headerLength) != 3 ||
+		    width <= 0 || height <= 0)
+			throw runtime_error("loadPFMImage: Invalid image width, height, or scale");
+
+		// the pixel data starts after the single whitespace character following the scale
+		size_t rowBytes = size_t(width) * numChannels * sizeof(float);
+		size_t dataOffset = size_t(headerLength) + 1;
+		if (file.size() < dataOffset || (file.size() - dataOffset) / rowBytes < size_t(height))
 			throw runtime_error("loadPFMImage: Could not read all pixel data");
 
-		// multiply data by scale factor
+		bool bigEndian = scale > 0.0f;
 		scale = fabsf(scale);
-        for (size_t i = 0; i < numFloats; ++i)
-            data[i] = scale*reinterpretAsHostEndian(data[i], bigEndian);
 
-		fclose(f);
-		return data;
+		const unsigned char * data = file.data() + dataOffset;
+		float * pixels = allocate(width, height);
+
+		parallel_for_range(0, height, [=](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+			{
+				// PFM stores the bottom row first
+				const unsigned char * src = data + size_t(height - 1 - y) * rowBytes;
+				float * dst = pixels + size_t(y) * width * 4;
+				for (int x = 0; x < width; ++x, src += numChannels * sizeof(float), dst += 4)
+				{
+					float v[3];
+					for (int c = 0; c < numChannels; ++c)
+					{
+						float f;
+						memcpy(&f, src + c * sizeof(float), sizeof(float));
+						v[c] = scale * reinterpretAsHostEndian(f, bigEndian);
+					}
+
+					dst[0] = v[0];
+					dst[1] = v[numChannels == 3 ? 1 : 0];
+					dst[2] = v[numChannels == 3 ? 2 : 0];
+					dst[3] = 1.f;
+				}
+			}
+		});
+
+		return numChannels;
 	}
 	catch (const runtime_error & e)
 	{
-		fclose(f);
-		delete [] data;
 		throw runtime_error(string(e.what()) + " in file '" + filename + "'");
 	}
 }
@@ -162,16 +269,7 @@ bool writePFMImage(const char *filename, int width, int height, int numChannels,
 
 	fprintf(f, littleEndian ? "-1.0000000\n" : "1.0000000\n");
 
-	if (numChannels == 3 || numChannels == 1)
-	{
-		fwrite(&data[0], width * height * sizeof(float) * numChannels, 1, f);
-	}
-	else if (numChannels == 4)
-	{
-		for (int i = 0; i < width * height * 4; i += 4)
-			fwrite(&data[i], sizeof(float) * 3, 1, f);
-	}
-	else
+	if (numChannels != 1 && numChannels != 3 && numChannels != 4)
 	{
 		fclose(f);
 		cerr << "writePFMImage: Unsupported number of channels "
@@ -179,6 +277,27 @@ bool writePFMImage(const char *filename, int width, int height, int numChannels,
 		return false;
 	}
 
+	// PFM stores the bottom row first; alpha is dropped one row at a time
+	int numFileChannels = min(numChannels, 3);
+	vector<float> row(size_t(width) * numFileChannels);
+	for (int y = height - 1; y >= 0; --y)
+	{
+		const float * src = data + size_t(y) * width * numChannels;
+		if (numChannels == 4)
+		{
+			for (int x = 0; x < width; ++x)
+				memcpy(&row[3 * x], &src[4 * x], sizeof(float) * 3);
+			src = row.data();
+		}
+
+		if (fwrite(src, sizeof(float) * numFileChannels, width, f) != size_t(width))
+		{
+			fclose(f);
+			cerr << "writePFMImage: Error writing file '" << filename << "'" << endl;
+			return false;
+		}
+	}
+
 	fclose(f);
 	return true;
 }
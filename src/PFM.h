@@ -6,6 +6,21 @@
 
 #pragma once
 
+#include <functional>
+
 bool isPFMImage(const char *filename) noexcept;
 bool writePFMImage(const char *filename, int width, int height, int numChannels, const float *data);
-float * loadPFMImage(const char *filename, int *width, int *height, int *numChannels);
+
+/*!
+ * @brief Load a 1- or 3-channel PFM image, decoding it straight from the memory-mapped file.
+ *
+ * Decoding the byte order, applying the scale factor, flipping the rows (PFM stores the bottom
+ * row first), and expanding to RGBA all happen in a single parallel pass over the mapped pages.
+ *
+ * @param filename  The PFM file to load
+ * @param allocate  Called once the header is parsed with the image width and height; must return
+ *                  storage for width*height RGBA pixels of 4 floats each, top row first
+ * @return          The number of channels stored in the file
+ * @throws          std::runtime_error if the file cannot be read
+ */
+int loadPFMImage(const char *filename, const std::function<float *(int width, int height)> & allocate);
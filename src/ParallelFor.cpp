@@ -5,41 +5,138 @@
 //
 
 #include "ParallelFor.h"
-#include <future>
-#include <vector>
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 
-// adapted from http://www.andythomason.com/2016/08/21/c-multithreading-an-effective-parallel-for-loop/
-// license unknown, presumed public domain
-void parallel_for(int begin, int end, int step, function<void(int, size_t)> body, bool serial)
+namespace
 {
-	atomic<int> nextIndex;
-	nextIndex = begin;
 
-	auto policy = serial ? std::launch::deferred : std::launch::async;
-	size_t numCPUs = thread::hardware_concurrency();
-	vector< future<void> > futures(numCPUs);
-	for (size_t cpu = 0; cpu != numCPUs; ++cpu)
+/*!
+ * Shared state of a single parallel_for invocation.
+ *
+ * Iterations are claimed one at a time from an atomic counter. Once the body throws, the
+ * remaining iterations are abandoned and the first exception is rethrown to the caller.
+ *
+ * Helper tasks hold on to this via a shared_ptr, so a helper that only gets scheduled after
+ * the loop has finished (and parallel_for has returned) simply finds no iterations left
+ * and exits without touching the (by then destroyed) loop body.
+ */
+struct ParallelForJob
+{
+	ParallelForJob(int begin, int end, int step, const function<void(int, size_t)> & body) :
+		nextIndex(begin), nextCPU(0), end(end), step(step),
+		numIterations((end - begin + step - 1) / step), body(body)
 	{
-		futures[cpu] = async(
-			policy,
-			[cpu, &nextIndex, end, step, &body]()
+
+	}
+
+	// grab iterations until there are none left
+	void run()
+	{
+		size_t cpu = nextCPU++;
+		int done = 0;
+		while (true)
+		{
+			int i = nextIndex.fetch_add(step);
+			if (i >= end)
+				break;
+
+			try
+			{
+				body(i, cpu);
+			}
+			catch (...)
 			{
-				// just iterate, grabbing the next available atomic index in the range [begin, end)
-				while (true)
 				{
-					int i = nextIndex.fetch_add(step);
-					if (i >= end) break;
-					body(i, cpu);
+					lock_guard<mutex> lock(m);
+					if (!error)
+						error = current_exception();
 				}
-			});
+
+				// skip all iterations nobody has claimed yet, so that a failed (e.g. canceled)
+				// loop returns as soon as the iterations already in flight are done
+				int skipFrom = nextIndex.exchange(end);
+				if (skipFrom < end)
+					done += (end - skipFrom + step - 1) / step;
+			}
+			++done;
+		}
+
+		if (done)
+		{
+			lock_guard<mutex> lock(m);
+			numDone += done;
+			if (numDone == numIterations)
+				finished.notify_all();
+		}
+	}
+
+	// block until all iterations have been executed
+	void wait()
+	{
+		unique_lock<mutex> lock(m);
+		finished.wait(lock, [this](){return numDone == numIterations;});
 	}
-	for (auto & f : futures)
-		f.get();
+
+	atomic<int> nextIndex;
+	atomic<size_t> nextCPU;
+	const int end, step, numIterations;
+	const function<void(int, size_t)> & body;
+
+	mutex m;
+	condition_variable finished;
+	int numDone = 0;
+	exception_ptr error;
+};
+
+} // namespace
+
+
+int defaultGrainSize(int numIterations)
+{
+	// aim for a few chunks per thread (counting the calling thread) so the load can be balanced
+	int numChunks = 4 * (ThreadPool::global().numThreads() + 1);
+	return max(1, (numIterations + numChunks - 1) / numChunks);
+}
+
+
+void parallel_for(int begin, int end, int step, function<void(int, size_t)> body, bool serial)
+{
+	if (begin >= end)
+		return;
+
+	auto & pool = ThreadPool::global();
+	int numIterations = (end - begin + step - 1) / step;
+
+	if (serial || numIterations == 1)
+	{
+		for (int i = begin; i < end; i += step)
+			body(i, 0);
+		return;
+	}
+
+	auto job = make_shared<ParallelForJob>(begin, end, step, body);
+
+	// the calling thread participates too, so we need one helper fewer than the available parallelism
+	int numHelpers = min(pool.numThreads(), numIterations - 1);
+	for (int h = 0; h < numHelpers; ++h)
+		pool.enqueue([job](){job->run();});
+
+	job->run();
+	job->wait();
+
+	if (job->error)
+		rethrow_exception(job->error);
 }
 
 void parallel_for(int begin, int end, int step, function<void(int)> body, bool serial)
 {
 	parallel_for(begin, end, step, [&body](int i, size_t){body(i);}, serial);
-}
\ No newline at end of file
+}
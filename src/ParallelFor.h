@@ -6,14 +6,21 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <functional>
 
 /*!
  * @brief 			Executes the body of a for loop in parallel
+ *
+ * The iterations are executed by the calling thread together with the workers of the
+ * process-wide @ref ThreadPool, so no threads are created or joined per call.
+ *
  * @param begin		The starting index of the for loop
  * @param end 		One past the ending index of the for loop
  * @param step 		How much to increment at each iteration when moving from begin to end
- * @param body 		The body of the for loop as a lambda, taking two parameters: the iterator index in [begin,end), and the CPU number
+ * @param body 		The body of the for loop as a lambda, taking two parameters: the iterator index in [begin,end), and the CPU number.
+ *                  The CPU number identifies the participating thread and lies in [0, ThreadPool::global().numThreads()]
  * @param serial 	Force the loop to execute in serial instead of parallel
  */
 void parallel_for(int begin, int end, int step, std::function<void(int, size_t)> body, bool serial = false);
@@ -29,10 +36,92 @@ void parallel_for(int begin, int end, int step, std::function<void(int)> body, b
 // license unknown, presumed public domain
 inline void parallel_for(int begin, int end, std::function<void(int, size_t)> body, bool serial = false)
 {
-	parallel_for(begin, end, 1, body);
+	parallel_for(begin, end, 1, body, serial);
 }
 
 inline void parallel_for(int begin, int end, std::function<void(int)> body, bool serial = false)
 {
 	parallel_for(begin, end, 1, body, serial);
-}
\ No newline at end of file
+}
+
+
+/*!
+ * @brief 			Chooses a chunk size that splits \a numIterations into a few chunks per available thread
+ *
+ * Having several chunks per thread lets the dynamic scheduling in @ref parallel_for balance the load,
+ * while keeping the per-chunk overhead negligible.
+ */
+int defaultGrainSize(int numIterations);
+
+
+/*!
+ * @brief 			Executes a loop over [begin,end) in parallel, handing out contiguous chunks of indices
+ *
+ * Each invocation of \a body processes a whole chunk, so the scheduling overhead is paid once per
+ * chunk instead of once per index, and each thread streams through a contiguous range of memory.
+ *
+ * @param begin		The starting index of the for loop
+ * @param end 		One past the ending index of the for loop
+ * @param grainSize	The number of indices in each chunk (the last chunk may be smaller).
+ *                  Values < 1 select a size automatically using @ref defaultGrainSize
+ * @param body 		The body of the for loop as a lambda, taking the sub-range [chunkBegin,chunkEnd) to process
+ * @param serial 	Force the loop to execute in serial instead of parallel
+ */
+template <typename F>
+void parallel_for_range(int begin, int end, int grainSize, F body, bool serial = false)
+{
+	if (begin >= end)
+		return;
+
+	if (grainSize < 1)
+		grainSize = defaultGrainSize(end - begin);
+
+	int numChunks = (end - begin + grainSize - 1) / grainSize;
+	parallel_for(0, numChunks, [begin,end,grainSize,&body](int c)
+	{
+		int chunkBegin = begin + c * grainSize;
+		body(chunkBegin, std::min(chunkBegin + grainSize, end));
+	}, serial);
+}
+
+//! A version of parallel_for_range that picks the grain size automatically
+template <typename F>
+void parallel_for_range(int begin, int end, F body, bool serial = false)
+{
+	parallel_for_range(begin, end, 0, body, serial);
+}
+
+
+/*!
+ * @brief 			Executes a 2D loop over [beginX,endX) x [beginY,endY) in parallel, one rectangular tile at a time
+ *
+ * Tiles are handed out in scanline order, so that consecutive tiles, and the rows within each tile,
+ * are adjacent in memory for images stored with x as the fastest-varying coordinate (like HDRImage).
+ *
+ * @param beginX,endX	The range of the x (inner, contiguous) coordinate
+ * @param beginY,endY	The range of the y (outer) coordinate
+ * @param body 		The body of the loop as a lambda taking the tile extents (xBegin, xEnd, yBegin, yEnd)
+ * @param tileWidth,tileHeight	The size of each tile in iterations. The default of 64x64 keeps a 4-channel
+ * 					float tile (64KB) well within a typical L2 cache.
+ * @param serial 	Force the loop to execute in serial instead of parallel
+ */
+template <typename F>
+void parallel_for_2d(int beginX, int endX, int beginY, int endY, F body,
+                     int tileWidth = 64, int tileHeight = 64, bool serial = false)
+{
+	if (beginX >= endX || beginY >= endY)
+		return;
+
+	tileWidth = std::max(1, tileWidth);
+	tileHeight = std::max(1, tileHeight);
+
+	int numTilesX = (endX - beginX + tileWidth - 1) / tileWidth;
+	int numTilesY = (endY - beginY + tileHeight - 1) / tileHeight;
+	parallel_for(0, numTilesX * numTilesY, [=,&body](int t)
+	{
+		int xBegin = beginX + (t % numTilesX) * tileWidth;
+		int yBegin = beginY + (t / numTilesX) * tileHeight;
+		body(xBegin, std::min(xBegin + tileWidth, endX),
+		     yBegin, std::min(yBegin + tileHeight, endY));
+	}, serial);
+}
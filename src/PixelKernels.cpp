@@ -0,0 +1,544 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "PixelKernels.h"
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define HAS_SSE2_KERNELS
+	#define HAS_AVX2_KERNELS
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		// MSVC lets every function use any instruction set it has intrinsics for
+		#define AVX2_TARGET
+	#else
+		#define AVX2_TARGET __attribute__((target("avx2")))
+	#endif
+#endif
+
+using namespace std;
+
+static_assert(sizeof(Color4) == 4 * sizeof(float), "Color4 must consist of 4 packed floats");
+
+
+namespace
+{
+
+/*!
+ * The versions of all the kernels for one instruction set.
+ *
+ * All versions perform the same floating-point operations in the same order (and never contract
+ * them into fused multiply-adds), so their results are bit-identical.
+ */
+struct Kernels
+{
+	ESIMDLevel level;
+	void (*expandToRGBA)(const float *, int, Color4 *, size_t);
+	void (*centerScaleOffset)(const Color4 *, Color4 *, size_t, const Color3 &, const Color3 &, const Color3 &);
+	void (*quantizeToRGB8)(const Color4 *, uint8_t *, size_t, const float *);
+	float (*accumulateHistograms)(const float *, size_t, float, int, const float *, int, uint32_t *);
+};
+
+
+//
+// Scalar versions, which also process the leftover pixels of the vector versions
+//
+
+void expandToRGBAScalar(const float * src, int numChannels, Color4 * dst, size_t count)
+{
+	if (numChannels == 4)
+		memcpy((float *) dst, src, count * sizeof(Color4));
+	else
+		for (size_t i = 0; i < count; ++i, src += 3)
+			dst[i] = Color4(src[0], src[1], src[2], 1.f);
+}
+
+void centerScaleOffsetScalar(const Color4 * src, Color4 * dst, size_t count,
+                             const Color3 & center, const Color3 & scale, const Color3 & offset)
+{
+	for (size_t i = 0; i < count; ++i)
+		dst[i] = Color4((src[i].r - center.r) * scale.r + offset.r,
+		                (src[i].g - center.g) * scale.g + offset.g,
+		                (src[i].b - center.b) * scale.b + offset.b,
+		                src[i].a);
+}
+
+// mirrors max/min/cvtt of the vector versions: NaNs become 0 and the rest is clamped, then truncated
+inline uint8_t quantize(float v)
+{
+	v = v > 0.f ? v : 0.f;
+	v = v < 255.f ? v : 255.f;
+	return uint8_t(v);
+}
+
+void quantizeToRGB8Scalar(const Color4 * src, uint8_t * dst, size_t count, const float * dither)
+{
+	for (size_t i = 0; i < count; ++i, dst += 3)
+	{
+		float d = dither ? dither[i & 255] : 0.f;
+		for (int c = 0; c < 3; ++c)
+			dst[c] = quantize(dither ? (src[i][c] + d) * 255.f : src[i][c] * 255.f);
+	}
+}
+
+// the upper 16 bits of the bit pattern of v, remapped so that they are ordered like the floats they represent
+inline uint32_t sortableKey(float v)
+{
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(float));
+	return (bits ^ (bits >> 31 ? 0xffffffffu : 0x80000000u)) >> 16;
+}
+
+// the sum of values is accumulated in 8 lanes (indexed by position modulo 8), which are added in a fixed order
+inline float sumLanes(const float sums[8])
+{
+	return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+}
+
+/*!
+ * Looks up the bin of a value in several histograms.
+ *
+ * A table stores the bin of the smallest float of each run of floats that share the same
+ * sortableKey. Such a run spans less than 1% of the magnitude of its values, so a linear search
+ * from there rarely has to step over more than one or two thresholds.
+ */
+class HistogramBinner
+{
+public:
+	HistogramBinner(int numBins, const float * thresholds, int numHistograms, uint32_t * counts) :
+		m_numBins(numBins), m_numHistograms(numHistograms), m_thresholds(thresholds), m_counts(counts),
+		m_firstBins(size_t(numHistograms) << 16)
+	{
+		for (int h = 0; h < numHistograms; ++h)
+			for (uint32_t key = 0; key <= 0xffff; ++key)
+			{
+				// invert sortableKey
+				uint32_t bits = key << 16;
+				bits = bits & 0x80000000u ? bits ^ 0x80000000u : ~bits;
+				float v;
+				memcpy(&v, &bits, sizeof(float));
+
+				// branchless binary search for the number of thresholds that are <= v
+				const float * t = thresholds + h * (numBins - 1);
+				int i = 0;
+				for (int step = numBins / 2; step > 0; step /= 2)
+					if (v >= t[i + step - 1])
+						i += step;
+				m_firstBins[(size_t(h) << 16) + key] = uint16_t(i);
+			}
+	}
+
+	void add(float v, uint32_t key)
+	{
+		for (int h = 0; h < m_numHistograms; ++h)
+		{
+			const float * t = m_thresholds + h * (m_numBins - 1);
+			int bin = m_firstBins[(size_t(h) << 16) + key];
+			while (bin < m_numBins - 1 && v >= t[bin])
+				++bin;
+			++m_counts[h * m_numBins + (v == v ? bin : 0)];
+		}
+	}
+
+	// bins values[i, count) and adds them to the lanes of sums, assuming i is a multiple of 8
+	void addTail(const float * values, size_t i, size_t count, float gain, float sums[8])
+	{
+		for (; i < count; ++i)
+		{
+			float v = gain * values[i];
+			sums[i % 8] += v;
+			add(v, sortableKey(v));
+		}
+	}
+
+private:
+	int m_numBins, m_numHistograms;
+	const float * m_thresholds;
+	uint32_t * m_counts;
+	std::vector<uint16_t> m_firstBins;
+};
+
+float accumulateHistogramsScalar(const float * values, size_t count, float gain,
+                                 int numBins, const float * thresholds, int numHistograms,
+                                 uint32_t * counts)
+{
+	HistogramBinner binner(numBins, thresholds, numHistograms, counts);
+	float sums[8] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+	binner.addTail(values, 0, count, gain, sums);
+	return sumLanes(sums);
+}
+
+const Kernels scalarKernels =
+{
+	SCALAR_SIMD,
+	expandToRGBAScalar,
+	centerScaleOffsetScalar,
+	quantizeToRGB8Scalar,
+	accumulateHistogramsScalar
+};
+
+
+#if defined(HAS_SSE2_KERNELS)
+
+//
+// SSE2 versions, which handle one pixel (or 4 values) per register
+//
+
+void expandToRGBASSE2(const float * src, int numChannels, Color4 * dst, size_t count)
+{
+	if (numChannels == 4)
+	{
+		expandToRGBAScalar(src, numChannels, dst, count);
+		return;
+	}
+
+	const __m128 rgbMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+	const __m128 alpha = _mm_setr_ps(0.f, 0.f, 0.f, 1.f);
+
+	// 4 pixels span 3 registers: r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4, src += 12)
+	{
+		__m128 a = _mm_loadu_ps(src);
+		__m128 b = _mm_loadu_ps(src + 4);
+		__m128 c = _mm_loadu_ps(src + 8);
+
+		__m128 p1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 3, 3));
+		__m128 p2 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 0, 3, 2));
+		p1 = _mm_shuffle_ps(p1, p1, _MM_SHUFFLE(3, 3, 2, 0));
+		c = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 2, 1));
+
+		_mm_storeu_ps(&dst[i + 0][0], _mm_or_ps(_mm_and_ps(a, rgbMask), alpha));
+		_mm_storeu_ps(&dst[i + 1][0], _mm_or_ps(_mm_and_ps(p1, rgbMask), alpha));
+		_mm_storeu_ps(&dst[i + 2][0], _mm_or_ps(_mm_and_ps(p2, rgbMask), alpha));
+		_mm_storeu_ps(&dst[i + 3][0], _mm_or_ps(_mm_and_ps(c, rgbMask), alpha));
+	}
+
+	expandToRGBAScalar(src, numChannels, dst + i, count - i);
+}
+
+void centerScaleOffsetSSE2(const Color4 * src, Color4 * dst, size_t count,
+                           const Color3 & center, const Color3 & scale, const Color3 & offset)
+{
+	const __m128 c = _mm_setr_ps(center.r, center.g, center.b, 0.f);
+	const __m128 s = _mm_setr_ps(scale.r, scale.g, scale.b, 1.f);
+	const __m128 o = _mm_setr_ps(offset.r, offset.g, offset.b, 0.f);
+	const __m128 rgbMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		__m128 p = _mm_loadu_ps(&src[i][0]);
+		__m128 q = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(p, c), s), o);
+		_mm_storeu_ps(&dst[i][0], _mm_or_ps(_mm_and_ps(rgbMask, q), _mm_andnot_ps(rgbMask, p)));
+	}
+}
+
+void quantizeToRGB8SSE2(const Color4 * src, uint8_t * dst, size_t count, const float * dither)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 k255 = _mm_set1_ps(255.f);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i q[4];
+		for (int j = 0; j < 4; ++j)
+		{
+			__m128 p = _mm_loadu_ps(&src[i + j][0]);
+			if (dither)
+				p = _mm_add_ps(p, _mm_set1_ps(dither[(i + j) & 255]));
+			p = _mm_min_ps(_mm_max_ps(_mm_mul_ps(p, k255), zero), k255);
+			q[j] = _mm_cvttps_epi32(p);
+		}
+
+		// the values are in [0,255], so saturation never kicks in
+		uint8_t rgba[16];
+		_mm_storeu_si128((__m128i *) rgba,
+		                 _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+		for (int j = 0; j < 4; ++j)
+			memcpy(dst + 3 * (i + j), rgba + 4 * j, 3);
+	}
+
+	// fewer than 4 pixels remain, and i is a multiple of 4, so the dither offsets stay in bounds
+	quantizeToRGB8Scalar(src + i, dst + 3 * i, count - i, dither ? dither + (i & 255) : nullptr);
+}
+
+// maps the bit patterns of 4 floats like sortableKey
+inline __m128i sortableKeys(__m128 v)
+{
+	__m128i bits = _mm_castps_si128(v);
+	__m128i flip = _mm_or_si128(_mm_srai_epi32(bits, 31), _mm_set1_epi32(int(0x80000000u)));
+	return _mm_srli_epi32(_mm_xor_si128(bits, flip), 16);
+}
+
+float accumulateHistogramsSSE2(const float * values, size_t count, float gain,
+                               int numBins, const float * thresholds, int numHistograms,
+                               uint32_t * counts)
+{
+	HistogramBinner binner(numBins, thresholds, numHistograms, counts);
+	const __m128 g = _mm_set1_ps(gain);
+	__m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128 v0 = _mm_mul_ps(g, _mm_loadu_ps(values + i));
+		__m128 v1 = _mm_mul_ps(g, _mm_loadu_ps(values + i + 4));
+		sum0 = _mm_add_ps(sum0, v0);
+		sum1 = _mm_add_ps(sum1, v1);
+
+		// the table lookups and counter increments remain scalar
+		float v[8];
+		uint32_t keys[8];
+		_mm_storeu_ps(v, v0);
+		_mm_storeu_ps(v + 4, v1);
+		_mm_storeu_si128((__m128i *) keys, sortableKeys(v0));
+		_mm_storeu_si128((__m128i *) (keys + 4), sortableKeys(v1));
+		for (int j = 0; j < 8; ++j)
+			binner.add(v[j], keys[j]);
+	}
+
+	float sums[8];
+	_mm_storeu_ps(sums, sum0);
+	_mm_storeu_ps(sums + 4, sum1);
+	binner.addTail(values, i, count, gain, sums);
+	return sumLanes(sums);
+}
+
+const Kernels sse2Kernels =
+{
+	SSE2_SIMD,
+	expandToRGBASSE2,
+	centerScaleOffsetSSE2,
+	quantizeToRGB8SSE2,
+	accumulateHistogramsSSE2
+};
+
+#endif // HAS_SSE2_KERNELS
+
+
+#if defined(HAS_AVX2_KERNELS)
+
+//
+// AVX2 versions, which handle two pixels (or 8 values) per register
+//
+
+AVX2_TARGET
+void centerScaleOffsetAVX2(const Color4 * src, Color4 * dst, size_t count,
+                           const Color3 & center, const Color3 & scale, const Color3 & offset)
+{
+	const __m256 c = _mm256_setr_ps(center.r, center.g, center.b, 0.f, center.r, center.g, center.b, 0.f);
+	const __m256 s = _mm256_setr_ps(scale.r, scale.g, scale.b, 1.f, scale.r, scale.g, scale.b, 1.f);
+	const __m256 o = _mm256_setr_ps(offset.r, offset.g, offset.b, 0.f, offset.r, offset.g, offset.b, 0.f);
+
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		__m256 p = _mm256_loadu_ps(&src[i][0]);
+		__m256 q = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(p, c), s), o);
+		_mm256_storeu_ps(&dst[i][0], _mm256_blend_ps(q, p, 0x88));
+	}
+
+	centerScaleOffsetScalar(src + i, dst + i, count - i, center, scale, offset);
+}
+
+AVX2_TARGET
+void quantizeToRGB8AVX2(const Color4 * src, uint8_t * dst, size_t count, const float * dither)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 k255 = _mm256_set1_ps(255.f);
+	// undoes the lane-wise interleaving of the packs below
+	const __m256i pixelOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	// drops the alpha bytes of the 4 pixels in each 128-bit lane
+	const __m256i dropAlpha = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+	                                           0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		// i is a multiple of 8, so this never reads past the 256 dither offsets
+		__m256 d = dither ? _mm256_loadu_ps(dither + (i & 255)) : zero;
+
+		__m256i q[4];
+		for (int j = 0; j < 4; ++j)
+		{
+			__m256 p = _mm256_loadu_ps(&src[i + 2 * j][0]);
+			if (dither)
+				p = _mm256_add_ps(p, _mm256_permutevar8x32_ps(d, _mm256_setr_epi32(2 * j, 2 * j, 2 * j, 2 * j,
+				                                                                   2 * j + 1, 2 * j + 1,
+				                                                                   2 * j + 1, 2 * j + 1)));
+			p = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(p, k255), zero), k255);
+			q[j] = _mm256_cvttps_epi32(p);
+		}
+
+		__m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+		bytes = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, pixelOrder), dropAlpha);
+
+		uint8_t rgb[32];
+		_mm256_storeu_si256((__m256i *) rgb, bytes);
+		memcpy(dst + 3 * i, rgb, 12);
+		memcpy(dst + 3 * i + 12, rgb + 16, 12);
+	}
+
+	// fewer than 8 pixels remain, and i is a multiple of 8, so the dither offsets stay in bounds
+	quantizeToRGB8Scalar(src + i, dst + 3 * i, count - i, dither ? dither + (i & 255) : nullptr);
+}
+
+AVX2_TARGET
+float accumulateHistogramsAVX2(const float * values, size_t count, float gain,
+                               int numBins, const float * thresholds, int numHistograms,
+                               uint32_t * counts)
+{
+	HistogramBinner binner(numBins, thresholds, numHistograms, counts);
+	const __m256 g = _mm256_set1_ps(gain);
+	const __m256i signBit = _mm256_set1_epi32(int(0x80000000u));
+	__m256 sum = _mm256_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 v = _mm256_mul_ps(g, _mm256_loadu_ps(values + i));
+		sum = _mm256_add_ps(sum, v);
+
+		// the table lookups and counter increments remain scalar
+		__m256i bits = _mm256_castps_si256(v);
+		__m256i flip = _mm256_or_si256(_mm256_srai_epi32(bits, 31), signBit);
+		float vs[8];
+		uint32_t keys[8];
+		_mm256_storeu_ps(vs, v);
+		_mm256_storeu_si256((__m256i *) keys, _mm256_srli_epi32(_mm256_xor_si256(bits, flip), 16));
+		for (int j = 0; j < 8; ++j)
+			binner.add(vs[j], keys[j]);
+	}
+
+	float sums[8];
+	_mm256_storeu_ps(sums, sum);
+	binner.addTail(values, i, count, gain, sums);
+	return sumLanes(sums);
+}
+
+const Kernels avx2Kernels =
+{
+	AVX2_SIMD,
+	// expanding is limited by memory bandwidth, and the SSE2 version already saturates it
+	expandToRGBASSE2,
+	centerScaleOffsetAVX2,
+	quantizeToRGB8AVX2,
+	accumulateHistogramsAVX2
+};
+
+bool cpuSupportsAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// the OS also needs to save the AVX registers on context switches
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // HAS_AVX2_KERNELS
+
+
+const Kernels & kernelsFor(ESIMDLevel level)
+{
+	switch (level)
+	{
+#if defined(HAS_AVX2_KERNELS)
+		case AVX2_SIMD: return avx2Kernels;
+#endif
+#if defined(HAS_SSE2_KERNELS)
+		case SSE2_SIMD: return sse2Kernels;
+#endif
+		default: return scalarKernels;
+	}
+}
+
+atomic<const Kernels *> & activeKernels()
+{
+	static atomic<const Kernels *> kernels(&kernelsFor(supportedSIMDLevel()));
+	return kernels;
+}
+
+} // namespace
+
+
+ESIMDLevel supportedSIMDLevel()
+{
+	static const ESIMDLevel level = []() -> ESIMDLevel
+	{
+#if defined(HAS_AVX2_KERNELS)
+		if (cpuSupportsAVX2())
+			return AVX2_SIMD;
+#endif
+#if defined(HAS_SSE2_KERNELS)
+		return SSE2_SIMD;
+#else
+		return SCALAR_SIMD;
+#endif
+	}();
+	return level;
+}
+
+ESIMDLevel activeSIMDLevel()
+{
+	return activeKernels().load()->level;
+}
+
+void setSIMDLevel(ESIMDLevel level)
+{
+	activeKernels() = &kernelsFor(level <= supportedSIMDLevel() ? level : supportedSIMDLevel());
+}
+
+const char * simdLevelName(ESIMDLevel level)
+{
+	switch (level)
+	{
+		case AVX2_SIMD: return "AVX2";
+		case SSE2_SIMD: return "SSE2";
+		default: return "scalar";
+	}
+}
+
+
+void expandToRGBA(const float * src, int numChannels, Color4 * dst, size_t count)
+{
+	activeKernels().load()->expandToRGBA(src, numChannels, dst, count);
+}
+
+void centerScaleOffset(const Color4 * src, Color4 * dst, size_t count,
+                       const Color3 & center, const Color3 & scale, const Color3 & offset)
+{
+	activeKernels().load()->centerScaleOffset(src, dst, count, center, scale, offset);
+}
+
+void quantizeToRGB8(const Color4 * src, uint8_t * dst, size_t count, const float * dither)
+{
+	activeKernels().load()->quantizeToRGB8(src, dst, count, dither);
+}
+
+float accumulateHistograms(const float * values, size_t count, float gain,
+                           int numBins, const float * thresholds, int numHistograms,
+                           uint32_t * counts)
+{
+	return activeKernels().load()->accumulateHistograms(values, count, gain, numBins, thresholds,
+	                                                    numHistograms, counts);
+}
@@ -0,0 +1,93 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "Color.h"
+
+
+/*
+ * Vectorized kernels for the per-pixel loops that run over entire images.
+ *
+ * Every kernel has a portable scalar version, and SSE2 and AVX2 versions on x86. The fastest
+ * version supported by both the build and the CPU is selected at runtime, so the binaries need
+ * not be compiled for a specific instruction set. All versions produce bit-identical results.
+ *
+ * The kernels work on contiguous runs of RGBA pixels, e.g. a row or all of an HDRImage.
+ */
+
+
+enum ESIMDLevel : int
+{
+	SCALAR_SIMD = 0,
+	SSE2_SIMD,
+	AVX2_SIMD
+};
+
+//! The fastest instruction set supported by both this build and the CPU
+ESIMDLevel supportedSIMDLevel();
+
+//! The instruction set currently used by the kernels (initially @ref supportedSIMDLevel)
+ESIMDLevel activeSIMDLevel();
+
+//! Use the kernels for \a level, or for @ref supportedSIMDLevel if \a level is not supported
+void setSIMDLevel(ESIMDLevel level);
+
+const char * simdLevelName(ESIMDLevel level);
+
+
+/*!
+ * @brief Convert \a count interleaved 3- or 4-channel pixels to RGBA.
+ *
+ * @param src           The source pixels, with \a numChannels floats each
+ * @param numChannels   Either 3 (alpha is set to 1) or 4
+ * @param dst           The destination pixels
+ * @param count         The number of pixels
+ */
+void expandToRGBA(const float * src, int numChannels, Color4 * dst, size_t count);
+
+/*!
+ * @brief Apply the per-channel affine map (src - center) * scale + offset to the RGB channels.
+ *
+ * Alpha is copied unchanged. \a src and \a dst may be the same array.
+ */
+void centerScaleOffset(const Color4 * src, Color4 * dst, size_t count,
+                       const Color3 & center, const Color3 & scale, const Color3 & offset);
+
+/*!
+ * @brief Quantize the RGB channels of \a count pixels to 8 bits, dropping alpha.
+ *
+ * Each channel is computed as (c + dither[x % 256]) * 255, clamped to [0,255] and truncated.
+ *
+ * @param src       The source pixels, e.g. a row of an image
+ * @param dst       Receives 3 bytes per pixel
+ * @param count     The number of pixels
+ * @param dither    The dither offsets for the first 256 pixels of the row, or nullptr for none
+ */
+void quantizeToRGB8(const Color4 * src, uint8_t * dst, size_t count, const float * dither);
+
+/*!
+ * @brief Add \a count values to several histograms at once.
+ *
+ * A value v (after multiplication by \a gain) falls into histogram h's bin i if
+ * thresholds[h*(numBins-1) + i-1] <= v < thresholds[h*(numBins-1) + i].
+ * Values below the first threshold or that are NaN land in the first bin.
+ * This makes the binning of any monotonic mapping exact, without evaluating it per value.
+ *
+ * @param values        The values to bin
+ * @param count         The number of values
+ * @param gain          Multiplies each value before binning
+ * @param numBins       The number of bins of each histogram; must be a power of two
+ * @param thresholds    Sorted lower bounds of bins 1 to numBins-1 of each histogram
+ * @param numHistograms The number of histograms
+ * @param counts        numBins counters per histogram, incremented by the binning
+ * @return              The sum of the gain-scaled values
+ */
+float accumulateHistograms(const float * values, size_t count, float gain,
+                           int numBins, const float * thresholds, int numHistograms,
+                           uint32_t * counts);
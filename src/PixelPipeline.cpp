@@ -0,0 +1,215 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "PixelPipeline.h"
+#include <algorithm>             // for min, copy
+#include <cmath>                 // for isfinite, pow, tan
+#include "Colorspace.h"          // for LinearToSRGB
+#include "Common.h"              // for lerp, clamp01, brightnessContrastL, brightnessContrastNL
+#include "HDRImage.h"            // for HDRImage
+#include "ParallelFor.h"         // for parallel_for_range
+#include "PixelKernels.h"        // for centerScaleOffset
+
+using namespace std;
+
+
+// local functions
+namespace
+{
+
+// copies count pixels from src to dst (unless they are the same) and applies the pipeline, in parallel
+void run(const PixelPipeline & pipeline, const Color4 * src, Color4 * dst, size_t count,
+         AtomicProgress & progress)
+{
+    const size_t blockSize = PixelPipeline::blockSize;
+    int numBlocks = int((count + blockSize - 1) / blockSize);
+    progress.setNumSteps(numBlocks);
+    parallel_for_range(0, numBlocks, [&pipeline,src,dst,count,blockSize,&progress](int b0, int b1)
+    {
+        size_t begin = b0 * blockSize, end = std::min(count, b1 * blockSize);
+        if (src != dst)
+            std::copy(src + begin, src + end, dst + begin);
+        pipeline.apply(dst + begin, end - begin);
+        progress += b1 - b0;
+    });
+}
+
+} // namespace
+
+
+const size_t PixelPipeline::blockSize;
+
+PixelPipeline & PixelPipeline::then(const Op & op)
+{
+    if (op)
+        m_ops.push_back(op);
+    return *this;
+}
+
+PixelPipeline & PixelPipeline::then(const PixelPipeline & other)
+{
+    m_ops.insert(m_ops.end(), other.m_ops.begin(), other.m_ops.end());
+    return *this;
+}
+
+void PixelPipeline::apply(Color4 * pixels, size_t count) const
+{
+    // all operations run on one block before moving on to the next, while it is still in the cache
+    for (size_t begin = 0; begin < count; begin += blockSize)
+    {
+        size_t n = std::min(blockSize, count - begin);
+        for (const auto & op : m_ops)
+            op(pixels + begin, n);
+    }
+}
+
+HDRImage PixelPipeline::applied(const HDRImage & img, AtomicProgress progress) const
+{
+    HDRImage result(img.width(), img.height());
+    // the pixels of an image are contiguous, so we can treat them as a single run
+    run(*this, img.data(), result.data(), img.size(), progress);
+    return result;
+}
+
+void PixelPipeline::applyTo(HDRImage & img, AtomicProgress progress) const
+{
+    if (!empty())
+        run(*this, img.data(), img.data(), img.size(), progress);
+}
+
+
+PixelPipeline::Op PixelPipeline::invert()
+{
+    return [](Color4 * pixels, size_t count)
+    {
+        // (c - 1) * -1 is exactly 1 - c
+        centerScaleOffset(pixels, pixels, count, Color3(1.f), Color3(-1.f), Color3(0.f));
+    };
+}
+
+PixelPipeline::Op PixelPipeline::clamp01()
+{
+    return perPixel([](const Color4 & c)
+    {
+        return Color4(::clamp01(c.r), ::clamp01(c.g), ::clamp01(c.b), ::clamp01(c.a));
+    });
+}
+
+PixelPipeline::Op PixelPipeline::replaceNonFinite(const Color3 & color)
+{
+    return perPixel([color](const Color4 & c)
+    {
+        return std::isfinite(c.sum()) ? c : Color4(color, c[3]);
+    });
+}
+
+PixelPipeline::Op PixelPipeline::exposureGamma(float exposure, float offset, float gamma)
+{
+    Color4 scale(std::pow(2.0f, exposure), 1.f), shift(offset, 0.f), exponent(1.0f / gamma);
+    return perPixel([scale,shift,exponent](const Color4 & c)
+    {
+        return pow(scale * c + shift, exponent);
+    });
+}
+
+PixelPipeline::Op PixelPipeline::brightnessContrast(float b, float c, bool linear, EChannel channel)
+{
+    float slope = float(std::tan(lerp(0.0, M_PI_2, c/2.0 + 0.5)));
+    // Perlin's version
+    //float slope = c >= 0 ? -log2(1.f - c) + 1.f : 1.f / (-log2(1.f + c) + 1.f);
+
+    if (linear)
+    {
+        float midpoint = (1.f-b)/2.f;
+
+        if (channel == RGB)
+            return [slope,midpoint](Color4 * pixels, size_t count)
+            {
+                // brightnessContrastL(v, slope, midpoint) == (v - midpoint) * slope + 0.5
+                centerScaleOffset(pixels, pixels, count, Color3(midpoint), Color3(slope), Color3(0.5f));
+            };
+        else if (channel == LUMINANCE || channel == CIE_L)
+            return perPixel(
+                [slope,midpoint](const Color4 &c)
+                {
+                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
+                    return Color4(brightnessContrastL(lab.r, slope, midpoint),
+                                  lab.g, lab.b, c.a).convert(LinearSRGB_CS, CIELab_CS);
+                });
+        else if (channel == CIE_CHROMATICITY)
+            return perPixel(
+                [slope,midpoint](const Color4 &c)
+                {
+                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
+                    return Color4(lab.r,
+                                  brightnessContrastL(lab.g, slope, midpoint),
+                                  brightnessContrastL(lab.b, slope, midpoint),
+                                  c.a).convert(LinearSRGB_CS, CIELab_CS);
+                });
+    }
+    else
+    {
+        float aB = (b + 1.f) / 2.f;
+
+        if (channel == RGB)
+            return perPixel(
+                [aB, slope](const Color4 &c)
+                {
+                    return Color4(brightnessContrastNL(c.r, slope, aB),
+                                  brightnessContrastNL(c.g, slope, aB),
+                                  brightnessContrastNL(c.b, slope, aB),
+                                  c.a);
+                });
+        else if (channel == LUMINANCE || channel == CIE_L)
+            return perPixel(
+                [aB, slope](const Color4 &c)
+                {
+                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
+                    return Color4(brightnessContrastNL(lab.r, slope, aB),
+                                  lab.g, lab.b, c.a).convert(LinearSRGB_CS, CIELab_CS);
+                });
+        else if (channel == CIE_CHROMATICITY)
+            return perPixel(
+                [aB, slope](const Color4 &c)
+                {
+                    Color4 lab = c.convert(CIELab_CS, LinearSRGB_CS);
+                    return Color4(lab.r,
+                                  brightnessContrastNL(lab.g, slope, aB),
+                                  brightnessContrastNL(lab.b, slope, aB),
+                                  c.a).convert(LinearSRGB_CS, CIELab_CS);
+                });
+    }
+
+    return nullptr;
+}
+
+PixelPipeline::Op PixelPipeline::hslAdjust(float h, float s, float l)
+{
+    return perPixel([h,s,l](const Color4 & c) {return c.HSLAdjust(h, s, l);});
+}
+
+PixelPipeline::Op PixelPipeline::convertColorSpace(EColorSpace dst, EColorSpace src)
+{
+    return perPixel([dst,src](const Color4 & c) {return c.convert(dst, src);});
+}
+
+PixelPipeline::Op PixelPipeline::tonemap(float gain, float gamma, bool sRGB, bool toLDR)
+{
+    bool applyGain = gain != 1.0f;
+    bool applyCurve = toLDR && (sRGB || gamma != 1.0f);
+    if (!applyGain && !applyCurve)
+        return nullptr;
+
+    Color4 gainC = Color4(gain, gain, gain, 1.0f);
+    Color4 gammaC = Color4(1.0f / gamma, 1.0f / gamma, 1.0f / gamma, 1.0f);
+    return perPixel([applyGain,applyCurve,sRGB,gainC,gammaC](const Color4 & c) -> Color4
+    {
+        Color4 v = applyGain ? c * gainC : c;
+        if (!applyCurve)
+            return v;
+        return sRGB ? LinearToSRGB(v) : pow(v, gammaC);
+    });
+}
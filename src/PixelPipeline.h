@@ -0,0 +1,102 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>               // for size_t
+#include <functional>            // for function
+#include <vector>                // for vector
+#include "Color.h"               // for Color3, Color4
+#include "Fwd.h"                 // for EChannel, EColorSpace
+#include "Progress.h"            // for AtomicProgress
+
+
+/*!
+ * @brief A sequence of pointwise (per-pixel) operations that are applied to an image in one fused pass.
+ *
+ * Applying a pipeline walks over the pixels once, in blocks that are small enough to stay in
+ * the cache, and runs all operations on a block before moving on to the next one. Compared to
+ * applying the operations one after the other, this saves a full pass over memory, and a full
+ * temporary image, per operation.
+ *
+ * Since every pixel goes through exactly the same operations either way, the result is
+ * identical to applying the operations one at a time.
+ */
+class PixelPipeline
+{
+public:
+    //! An operation that modifies a contiguous run of pixels in place
+    using Op = std::function<void(Color4 * pixels, size_t count)>;
+
+    //! Append \a op, unless it is empty
+    PixelPipeline & then(const Op & op);
+
+    //! Append all operations of \a other
+    PixelPipeline & then(const PixelPipeline & other);
+
+    //! Append an operation that replaces each pixel c by \a f(c)
+    template <typename F>
+    PixelPipeline & thenMap(F f)    {return then(perPixel(f));}
+
+    bool empty() const      {return m_ops.empty();}
+    size_t size() const     {return m_ops.size();}
+
+    //! Run all operations on \a count pixels in place, on the calling thread
+    void apply(Color4 * pixels, size_t count) const;
+
+    //! Returns a copy of \a img with all operations applied, in a single parallel pass
+    HDRImage applied(const HDRImage & img, AtomicProgress progress = AtomicProgress()) const;
+
+    //! Applies all operations to \a img in place, in a single parallel pass
+    void applyTo(HDRImage & img, AtomicProgress progress = AtomicProgress()) const;
+
+    //! The number of pixels each operation is run on at a time
+    static const size_t blockSize = 2048;
+
+    //-----------------------------------------------------------------------
+    //@{ \name Common pointwise operations
+    //-----------------------------------------------------------------------
+    //! An operation that replaces each pixel c by \a f(c)
+    template <typename F>
+    static Op perPixel(F f)
+    {
+        return [f](Color4 * pixels, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                pixels[i] = f(pixels[i]);
+        };
+    }
+
+    //! 1 - c for the RGB channels; alpha is left unchanged
+    static Op invert();
+
+    //! Clamp all four channels to [0,1]
+    static Op clamp01();
+
+    //! Replace pixels with any non-finite channel by \a color, keeping their alpha
+    static Op replaceNonFinite(const Color3 & color);
+
+    //! pow(2^exposure * c + offset, 1/gamma), where the scale and offset do not apply to alpha
+    static Op exposureGamma(float exposure, float offset, float gamma);
+
+    //! See HDRImage::brightnessContrast. Returns an empty operation if \a channel is not supported.
+    static Op brightnessContrast(float brightness, float contrast, bool linear, EChannel channel);
+
+    //! Shift the hue by \a h degrees, and scale the saturation by \a s and the lightness by \a l
+    static Op hslAdjust(float h, float s, float l);
+
+    static Op convertColorSpace(EColorSpace dst, EColorSpace src);
+
+    /*!
+     * The tonemapping applied by HDRImage::save: multiply the RGB channels by \a gain and then,
+     * if \a toLDR, apply the sRGB curve (if \a sRGB) or the \a gamma curve.
+     */
+    static Op tonemap(float gain, float gamma, bool sRGB, bool toLDR);
+    //@}
+
+private:
+    std::vector<Op> m_ops;
+};
@@ -11,7 +11,8 @@ AtomicProgress::AtomicProgress(bool createState, float totalPercentage) :
 	m_numSteps(1),
 	m_percentageOfParent(totalPercentage),
 	m_stepPercent(m_numSteps == 0 ? totalPercentage : totalPercentage / m_numSteps),
-	m_atomicState(createState ? std::make_shared<AtomicPercent32>(0.f) : nullptr)
+	m_atomicState(createState ? std::make_shared<AtomicPercent32>(0.f) : nullptr),
+	m_canceled(createState ? std::make_shared<std::atomic<bool>>(false) : nullptr)
 {
 
 }
@@ -29,7 +30,8 @@ AtomicProgress::AtomicProgress(const AtomicProgress & parent, float percentageOf
 	m_numSteps(1),
 	m_percentageOfParent(parent.m_percentageOfParent * percentageOfParent),
 	m_stepPercent(m_numSteps == 0 ? m_percentageOfParent : m_percentageOfParent / m_numSteps),
-	m_atomicState(parent.m_atomicState)
+	m_atomicState(parent.m_atomicState),
+	m_canceled(parent.m_canceled)
 {
 
 }
@@ -50,6 +52,17 @@ float AtomicProgress::progress() const
 	return float(*m_atomicState);
 }
 
+void AtomicProgress::cancel()
+{
+	if (m_canceled)
+		*m_canceled = true;
+}
+
+bool AtomicProgress::canceled() const
+{
+	return m_canceled && *m_canceled;
+}
+
 void AtomicProgress::setAvailablePercent(float availablePercent)
 {
 	m_percentageOfParent = availablePercent;
@@ -64,6 +77,8 @@ void AtomicProgress::setNumSteps(int numSteps)
 
 AtomicProgress& AtomicProgress::operator+=(int steps)
 {
+	checkCanceled();
+
 	if (!m_atomicState)
 		return *this;
 
@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <cmath>
 #include <memory>
+#include <stdexcept>
 
 /*!
  * A fixed-point fractional number stored using an std::atomic
@@ -107,6 +108,16 @@ using AtomicFixed16 = AtomicFixed<std::int16_t, std::int32_t, 8>;
 using AtomicFixed32 = AtomicFixed<std::int32_t, std::int64_t, 16>;
 
 
+/*!
+ * Thrown by @ref AtomicProgress when stepping the progress of a task that has been canceled
+ */
+class CanceledError : public std::runtime_error
+{
+public:
+	CanceledError() : std::runtime_error("Operation canceled") {}
+};
+
+
 /*!
  * Helper object to manage the progress display.
  * 	{
@@ -118,6 +129,10 @@ using AtomicFixed32 = AtomicFixed<std::int32_t, std::int64_t, 16>;
  *   	}
  * 	} // end progress p1
  *
+ * An AtomicProgress that creates its own state also acts as a cooperative cancellation token
+ * shared by all progress objects derived from it: after @ref cancel has been called, any further
+ * call to @ref operator+= (or @ref checkCanceled) throws a @ref CanceledError. Every loop that
+ * reports its progress is therefore also a point where a canceled computation bails out.
  */
 class AtomicProgress
 {
@@ -133,6 +148,11 @@ public:
 	void setDone()                              {resetProgress(1.f);}
 	void setBusy()                              {resetProgress(-1.f);}
 
+	// cooperative cancellation
+	void cancel();
+	bool canceled() const;
+	void checkCanceled() const                  {if (canceled()) throw CanceledError();}
+
 	// access to the discrete stepping
 	void setAvailablePercent(float percent);
 	void setNumSteps(int numSteps);
@@ -144,4 +164,5 @@ private:
 	float m_percentageOfParent, m_stepPercent;
 
 	std::shared_ptr<AtomicPercent32> m_atomicState;  ///< Atomic internal state of progress
+	std::shared_ptr<std::atomic<bool>> m_canceled;   ///< Cancellation flag, shared along with the state
 };
\ No newline at end of file
@@ -0,0 +1,160 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "ThreadPool.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+// which pool (if any) the current thread is a worker of, and its index within that pool
+thread_local const ThreadPool * t_pool = nullptr;
+thread_local int t_index = -1;
+
+} // namespace
+
+
+ThreadPool::ThreadPool(int numThreads) :
+	m_numPending(0), m_nextQueue(0)
+{
+	numThreads = max(1, numThreads);
+
+	for (int i = 0; i < numThreads; ++i)
+		m_queues.emplace_back(new TaskQueue);
+
+	for (int i = 0; i < numThreads; ++i)
+		m_threads.emplace_back([this, i](){workerLoop(i);});
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(m_sleepMutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (auto & t : m_threads)
+		t.join();
+}
+
+ThreadPool & ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+int ThreadPool::currentThreadIndex() const
+{
+	return t_pool == this ? t_index : -1;
+}
+
+void ThreadPool::enqueue(Task task)
+{
+	// keep work submitted from a worker local to it, distribute everything else round-robin
+	int index = currentThreadIndex();
+	if (index < 0)
+		index = int(m_nextQueue++ % m_queues.size());
+
+	// count the task before it becomes visible so that workers never miss a wake-up
+	{
+		lock_guard<mutex> lock(m_sleepMutex);
+		++m_numPending;
+	}
+
+	{
+		lock_guard<mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->tasks.push_back(move(task));
+	}
+
+	m_wakeUp.notify_one();
+}
+
+bool ThreadPool::runPendingTask()
+{
+	int index = currentThreadIndex();
+
+	Task task;
+	if ((index >= 0 && popTask(index, task)) || stealTask(index, task))
+	{
+		--m_numPending;
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			// tasks that care about errors report them through their future
+		}
+		return true;
+	}
+	return false;
+}
+
+bool ThreadPool::popTask(int index, Task & task)
+{
+	auto & q = *m_queues[index];
+	lock_guard<mutex> lock(q.mutex);
+	if (q.tasks.empty())
+		return false;
+
+	task = move(q.tasks.back());
+	q.tasks.pop_back();
+	return true;
+}
+
+bool ThreadPool::stealTask(int thief, Task & task)
+{
+	int n = int(m_queues.size());
+	// start at the neighbor so that thieves don't all hammer the same victim
+	for (int i = 1; i <= n; ++i)
+	{
+		int victim = (max(thief, 0) + i) % n;
+		if (victim == thief)
+			continue;
+
+		auto & q = *m_queues[victim];
+		lock_guard<mutex> lock(q.mutex);
+		if (q.tasks.empty())
+			continue;
+
+		task = move(q.tasks.front());
+		q.tasks.pop_front();
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(int index)
+{
+	t_pool = this;
+	t_index = index;
+
+	while (true)
+	{
+		Task task;
+		if (popTask(index, task) || stealTask(index, task))
+		{
+			--m_numPending;
+			try
+			{
+				task();
+			}
+			catch (...)
+			{
+				// tasks that care about errors report them through their future
+			}
+			continue;
+		}
+
+		unique_lock<mutex> lock(m_sleepMutex);
+		m_wakeUp.wait(lock, [this](){return m_stop || m_numPending > 0;});
+		if (m_stop && m_numPending == 0)
+			return;
+	}
+}
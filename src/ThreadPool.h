@@ -0,0 +1,123 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/*!
+ * @brief A persistent pool of worker threads with per-worker task queues and work stealing.
+ *
+ * Each worker owns a deque of tasks. A worker pops tasks from the back of its own deque
+ * (most recently submitted first, which keeps nested work cache-warm), and when that runs
+ * dry it steals from the front of the other workers' deques. Tasks submitted from within a
+ * worker go onto that worker's own deque, while tasks submitted from any other thread are
+ * distributed round-robin across all workers.
+ *
+ * A single process-wide pool, accessible via @ref global, backs @ref parallel_for and
+ * @ref AsyncTask so that threads are created once instead of on every call.
+ */
+class ThreadPool
+{
+public:
+	using Task = std::function<void(void)>;
+
+	/*!
+	 * @param numThreads The number of worker threads to create. Values < 1 create a single worker.
+	 */
+	explicit ThreadPool(int numThreads = int(std::thread::hardware_concurrency()));
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator=(const ThreadPool &) = delete;
+
+	//! The process-wide thread pool, created on first use
+	static ThreadPool & global();
+
+	//! The number of worker threads in this pool
+	int numThreads() const {return int(m_threads.size());}
+
+	//! The index of the calling thread within this pool, or -1 if it is not one of our workers
+	int currentThreadIndex() const;
+
+	/*!
+	 * @brief Submit a task for asynchronous execution.
+	 *
+	 * Exceptions thrown by \a task are swallowed; use @ref async if you need the result.
+	 */
+	void enqueue(Task task);
+
+	/*!
+	 * @brief Submit a callable for asynchronous execution and return a future to its result.
+	 *
+	 * Exceptions thrown by \a f are propagated through the returned future.
+	 */
+	template <typename F>
+	auto async(F f) -> std::future<decltype(f())>
+	{
+		using R = decltype(f());
+		auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+		auto future = task->get_future();
+		enqueue([task](){(*task)();});
+		return future;
+	}
+
+	/*!
+	 * @brief Execute one pending task on the calling thread, if there is one.
+	 *
+	 * @return True if a task was executed.
+	 */
+	bool runPendingTask();
+
+	/*!
+	 * @brief Wait until \a f, a std::future or std::shared_future, becomes ready.
+	 *
+	 * When called from one of the pool's workers, the waiting thread keeps executing other
+	 * pending tasks instead of blocking, so that waiting on a task from within the pool can
+	 * never starve it.
+	 */
+	template <typename Future>
+	void wait(const Future & f)
+	{
+		if (currentThreadIndex() >= 0)
+			while (f.wait_for(std::chrono::seconds(0)) == std::future_status::timeout)
+				if (!runPendingTask())
+					std::this_thread::yield();
+
+		// blocks outside the pool, and runs deferred computations
+		f.wait();
+	}
+
+private:
+	struct TaskQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void workerLoop(int index);
+	bool popTask(int index, Task & task);
+	bool stealTask(int thief, Task & task);
+
+	std::vector<std::unique_ptr<TaskQueue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wakeUp;
+	std::atomic<int> m_numPending;      ///< Number of tasks submitted but not yet dequeued
+	std::atomic<unsigned> m_nextQueue;  ///< Round-robin counter for submissions from outside the pool
+	bool m_stop = false;
+};
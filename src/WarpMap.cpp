@@ -0,0 +1,304 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "WarpMap.h"
+#include <algorithm>             // for sort
+#include <cmath>                 // for floor, fabs
+#include <fstream>               // for ifstream, ofstream
+#include <stdexcept>             // for runtime_error, invalid_argument
+#include "ParallelFor.h"         // for parallel_for, parallel_for_range
+#include "Timer.h"               // for Timer
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using namespace Eigen;
+
+
+// local functions
+namespace
+{
+
+const char fileMagic[8] = {'H', 'D', 'R', 'W', 'A', 'R', 'P', '\0'};
+const uint32_t fileVersion = 1;
+
+// collects the taps of one output pixel
+class TapCollector
+{
+public:
+    TapCollector(const Vector2i & srcSize, HDRImage::BorderMode mX, HDRImage::BorderMode mY) :
+        m_srcSize(srcSize), m_mX(mX), m_mY(mY) {}
+
+    // pixel (x,y) of the source, with the border modes applied; BLACK border pixels are dropped
+    void add(int x, int y, float weight)
+    {
+        x = HDRImage::wrapCoordinate(x, m_srcSize.x(), m_mX);
+        y = HDRImage::wrapCoordinate(y, m_srcSize.y(), m_mY);
+        if (x < 0 || y < 0)
+            return;
+        m_taps.push_back({uint32_t(x) + uint32_t(y) * uint32_t(m_srcSize.x()), weight});
+    }
+
+    // the taps of HDRImage::sample(sx, sy, ...), scaled by weight
+    void addSample(float sx, float sy, HDRImage::Sampler s, float weight)
+    {
+        switch (s)
+        {
+            case HDRImage::NEAREST:
+                add(int(std::floor(sx)), int(std::floor(sy)), weight);
+                break;
+
+            case HDRImage::BILINEAR:
+            {
+                // see HDRImage::bilinear
+                sx -= 0.5f;
+                sy -= 0.5f;
+                int x0 = (int) std::floor(sx);
+                int y0 = (int) std::floor(sy);
+                sx -= x0;
+                sy -= y0;
+                add(x0,     y0,     (1.f - sx) * (1.f - sy) * weight);
+                add(x0 + 1, y0,     sx * (1.f - sy) * weight);
+                add(x0,     y0 + 1, (1.f - sx) * sy * weight);
+                add(x0 + 1, y0 + 1, sx * sy * weight);
+                break;
+            }
+
+            case HDRImage::BICUBIC:
+            {
+                // see HDRImage::bicubic
+                sx -= 0.5f;
+                sy -= 0.5f;
+                int bx = (int) std::floor(sx);
+                int by = (int) std::floor(sy);
+
+                const float A = -0.75f;
+                float weights[4][4];
+                float totalWeight = 0;
+                for (int j = 0; j < 4; ++j)
+                {
+                    float dy = std::fabs(sy - (by - 1 + j));
+                    float yWeight = (dy <= 1) ?
+                        ((A + 2.0f) * dy - (A + 3.0f)) * dy * dy + 1.0f :
+                        ((A * dy - 5.0f * A) * dy + 8.0f * A) * dy - 4.0f * A;
+
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        float dx = std::fabs(sx - (bx - 1 + i));
+                        weights[j][i] = (dx <= 1) ?
+                            (((A + 2.0f) * dx - (A + 3.0f)) * dx * dx + 1.0f) * yWeight :
+                            (((A * dx - 5.0f * A) * dx + 8.0f * A) * dx - 4.0f * A) * yWeight;
+                        totalWeight += weights[j][i];
+                    }
+                }
+
+                for (int j = 0; j < 4; ++j)
+                    for (int i = 0; i < 4; ++i)
+                        add(bx - 1 + i, by - 1 + j, weights[j][i] / totalWeight * weight);
+                break;
+            }
+        }
+    }
+
+    // sort the taps by source pixel and merge the ones that read the same pixel
+    vector<WarpMap::Tap> & merged()
+    {
+        if (m_taps.empty())
+            return m_taps;
+
+        sort(m_taps.begin(), m_taps.end(),
+             [](const WarpMap::Tap & a, const WarpMap::Tap & b) {return a.index < b.index;});
+        size_t n = 0;
+        for (size_t t = 1; t < m_taps.size(); ++t)
+        {
+            if (m_taps[t].index == m_taps[n].index)
+                m_taps[n].weight += m_taps[t].weight;
+            else
+                m_taps[++n] = m_taps[t];
+        }
+        m_taps.resize(n + 1);
+        return m_taps;
+    }
+
+    void clear()    {m_taps.clear();}
+
+private:
+    Vector2i m_srcSize;
+    HDRImage::BorderMode m_mX, m_mY;
+    vector<WarpMap::Tap> m_taps;
+};
+
+template <typename T>
+void write(ofstream & out, const T * data, size_t count)
+{
+    out.write(reinterpret_cast<const char *>(data), count * sizeof(T));
+}
+
+template <typename T>
+void read(ifstream & in, T * data, size_t count)
+{
+    in.read(reinterpret_cast<char *>(data), count * sizeof(T));
+}
+
+} // namespace
+
+
+WarpMap::WarpMap(const Vector2i & srcSize, const Vector2i & dstSize, const string & description,
+                 const WarpFn & warpFn, int superSample, HDRImage::Sampler sampler,
+                 HDRImage::BorderMode mX, HDRImage::BorderMode mY, AtomicProgress progress) :
+    m_srcSize(srcSize), m_dstSize(dstSize), m_description(description)
+{
+    if ((srcSize.array() <= 0).any() || (dstSize.array() <= 0).any() || superSample < 1)
+        throw invalid_argument("Invalid warp map parameters.");
+
+    Timer timer;
+    int w = dstSize.x(), h = dstSize.y();
+    float sampleWeight = 1.f / (superSample * superSample);
+
+    // the taps of each row are collected in parallel, and concatenated afterwards
+    vector<vector<Tap>> rowTaps(h);
+    m_firstTap.assign(size_t(w) * h + 1, 0);
+    progress.setNumSteps(h);
+    parallel_for(0, h, [&](int y)
+    {
+        progress.checkCanceled();
+
+        TapCollector collector(srcSize, mX, mY);
+        for (int x = 0; x < w; ++x)
+        {
+            // the same sub-sample positions as in HDRImage::resampled
+            collector.clear();
+            for (int yy = 0; yy < superSample; ++yy)
+            {
+                float j = (yy + 0.5f) / superSample;
+                for (int xx = 0; xx < superSample; ++xx)
+                {
+                    float i = (xx + 0.5f) / superSample;
+                    Vector2f srcUV = warpFn(Vector2f((x + i) / w, (y + j) / h)).array() * Array2f(srcSize.x(), srcSize.y());
+                    collector.addSample(srcUV(0), srcUV(1), sampler, sampleWeight);
+                }
+            }
+
+            const auto & taps = collector.merged();
+            rowTaps[y].insert(rowTaps[y].end(), taps.begin(), taps.end());
+            m_firstTap[size_t(y) * w + x + 1] = taps.size();
+        }
+        ++progress;
+    });
+
+    // turn the counts into offsets
+    for (size_t i = 1; i < m_firstTap.size(); ++i)
+        m_firstTap[i] += m_firstTap[i - 1];
+
+    m_taps.reserve(m_firstTap.back());
+    for (auto & row : rowTaps)
+    {
+        m_taps.insert(m_taps.end(), row.begin(), row.end());
+        vector<Tap>().swap(row);
+    }
+
+    spdlog::get("console")->debug("Building the {:d}x{:d} warp map ({:.1f} taps per pixel, {:d} MB) took: {} seconds.",
+                                  w, h, double(m_taps.size()) / (size_t(w) * h), bytes() >> 20, (timer.elapsed()/1000.f));
+}
+
+
+HDRImage WarpMap::applied(const HDRImage & src, AtomicProgress progress) const
+{
+    if (src.width() != m_srcSize.x() || src.height() != m_srcSize.y())
+        throw invalid_argument(fmt::format("The warp map expects a {:d}x{:d} image, not {:d}x{:d}.",
+                                           m_srcSize.x(), m_srcSize.y(), src.width(), src.height()));
+
+    Timer timer;
+    int w = m_dstSize.x(), h = m_dstSize.y();
+    HDRImage result(w, h);
+    const Color4 * pixels = src.data();
+    progress.setNumSteps(h);
+    parallel_for_range(0, h, [this,w,pixels,&result,&progress](int y0, int y1)
+    {
+        for (int y = y0; y < y1; ++y)
+        {
+            progress.checkCanceled();
+
+            for (int x = 0; x < w; ++x)
+            {
+                size_t i = size_t(y) * w + x;
+                Color4 sum(0, 0, 0, 0);
+                for (uint64_t t = m_firstTap[i]; t < m_firstTap[i + 1]; ++t)
+                    sum += pixels[m_taps[t].index] * m_taps[t].weight;
+                result(x, y) = sum;
+            }
+        }
+        progress += y1 - y0;
+    });
+    spdlog::get("console")->trace("Resampling with a warp map took: {} seconds.", (timer.elapsed()/1000.f));
+    return result;
+}
+
+
+void WarpMap::save(const string & filename) const
+{
+    ofstream out(filename, ios::binary);
+    if (!out)
+        throw runtime_error(fmt::format("Cannot open \"{}\" for writing.", filename));
+
+    int32_t sizes[4] = {m_srcSize.x(), m_srcSize.y(), m_dstSize.x(), m_dstSize.y()};
+    uint64_t lengths[2] = {m_description.size(), m_taps.size()};
+    write(out, fileMagic, 8);
+    write(out, &fileVersion, 1);
+    write(out, sizes, 4);
+    write(out, lengths, 2);
+    write(out, m_description.data(), m_description.size());
+    write(out, m_firstTap.data(), m_firstTap.size());
+    write(out, m_taps.data(), m_taps.size());
+
+    if (!out)
+        throw runtime_error(fmt::format("Could not write the warp map to \"{}\".", filename));
+}
+
+WarpMap WarpMap::load(const string & filename)
+{
+    ifstream in(filename, ios::binary);
+    if (!in)
+        throw runtime_error(fmt::format("Cannot open \"{}\" for reading.", filename));
+
+    char magic[8];
+    uint32_t version = 0;
+    int32_t sizes[4];
+    uint64_t lengths[2];
+    read(in, magic, 8);
+    read(in, &version, 1);
+    read(in, sizes, 4);
+    read(in, lengths, 2);
+    if (!in || !equal(magic, magic + 8, fileMagic) || version != fileVersion)
+        throw runtime_error(fmt::format("\"{}\" is not a warp map.", filename));
+    if (sizes[0] <= 0 || sizes[1] <= 0 || sizes[2] <= 0 || sizes[3] <= 0 || lengths[0] > 4096)
+        throw runtime_error(fmt::format("The warp map \"{}\" is corrupt.", filename));
+
+    WarpMap map;
+    map.m_srcSize = Vector2i(sizes[0], sizes[1]);
+    map.m_dstSize = Vector2i(sizes[2], sizes[3]);
+    map.m_description.resize(lengths[0]);
+    read(in, &map.m_description[0], lengths[0]);
+    map.m_firstTap.resize(size_t(sizes[2]) * sizes[3] + 1);
+    read(in, map.m_firstTap.data(), map.m_firstTap.size());
+    if (!in || map.m_firstTap.front() != 0 || map.m_firstTap.back() != lengths[1])
+        throw runtime_error(fmt::format("The warp map \"{}\" is corrupt.", filename));
+    map.m_taps.resize(lengths[1]);
+    read(in, map.m_taps.data(), map.m_taps.size());
+    if (!in)
+        throw runtime_error(fmt::format("The warp map \"{}\" is truncated.", filename));
+
+    // make sure the map cannot read outside the source image
+    uint64_t numPixels = uint64_t(sizes[0]) * sizes[1];
+    bool valid = true;
+    for (size_t i = 1; i < map.m_firstTap.size(); ++i)
+        valid &= map.m_firstTap[i - 1] <= map.m_firstTap[i];
+    for (const auto & tap : map.m_taps)
+        valid &= tap.index < numPixels;
+    if (!valid)
+        throw runtime_error(fmt::format("The warp map \"{}\" is corrupt.", filename));
+
+    return map;
+}
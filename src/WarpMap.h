@@ -0,0 +1,90 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstdint>               // for uint32_t, uint64_t
+#include <functional>            // for function
+#include <string>                // for string
+#include <vector>                // for vector
+#include <Eigen/Core>            // for Vector2i, Vector2f
+#include "HDRImage.h"            // for HDRImage, Sampler, BorderMode
+#include "Progress.h"            // for AtomicProgress
+
+
+/*!
+ * @brief A precomputed HDRImage::resampled: for each output pixel, the source pixels it reads and their weights.
+ *
+ * Resampling evaluates the warp function and the sampler for every sub-sample of every output pixel.
+ * For warps such as environment map conversions, which are full of trigonometry, that is most of
+ * the work. A warp map does that work once, for a given source and destination size, warp,
+ * super-sampling, sampler and border modes. It then resamples any number of images of the source
+ * size with a cheap gather, and can be saved to disk and loaded back.
+ *
+ * Sub-samples of the same output pixel that read the same source pixel share a single tap. The
+ * result matches HDRImage::resampled up to floating point rounding, since the weighted sum is
+ * accumulated in a different order.
+ */
+class WarpMap
+{
+public:
+    using WarpFn = std::function<Eigen::Vector2f(const Eigen::Vector2f &)>;
+
+    //! A source pixel that contributes to an output pixel
+    struct Tap
+    {
+        uint32_t index;     ///< x + y * width of the source pixel
+        float weight;
+    };
+
+    WarpMap() = default;
+
+    /*!
+     * Precompute the taps of HDRImage::resampled.
+     *
+     * @param srcSize       The size of the images to resample
+     * @param dstSize       The size of the resampled images
+     * @param description   Identifies the warp and the sampling parameters, e.g. to check that a loaded map is still valid
+     * @param progress      Reports the progress; building the map can be canceled
+     *
+     * The remaining parameters are those of HDRImage::resampled.
+     */
+    WarpMap(const Eigen::Vector2i & srcSize, const Eigen::Vector2i & dstSize, const std::string & description,
+            const WarpFn & warpFn, int superSample = 1, HDRImage::Sampler s = HDRImage::NEAREST,
+            HDRImage::BorderMode mX = HDRImage::REPEAT, HDRImage::BorderMode mY = HDRImage::REPEAT,
+            AtomicProgress progress = AtomicProgress());
+
+    bool isNull() const                             {return m_firstTap.empty();}
+    const Eigen::Vector2i & sourceSize() const      {return m_srcSize;}
+    const Eigen::Vector2i & destinationSize() const {return m_dstSize;}
+    const std::string & description() const        {return m_description;}
+
+    //! Whether this map resamples images of size \a srcSize to \a dstSize, as described by \a description
+    bool matches(const Eigen::Vector2i & srcSize, const Eigen::Vector2i & dstSize, const std::string & description) const
+    {
+        return !isNull() && srcSize == m_srcSize && dstSize == m_dstSize && description == m_description;
+    }
+
+    //! The memory taken by the map, in bytes
+    size_t bytes() const    {return m_firstTap.size() * sizeof(uint64_t) + m_taps.size() * sizeof(Tap);}
+
+    //! Resample \a src, which has to be of size @ref sourceSize
+    HDRImage applied(const HDRImage & src, AtomicProgress progress = AtomicProgress()) const;
+
+    //! Write the map to \a filename. Throws a std::runtime_error on failure.
+    void save(const std::string & filename) const;
+
+    //! Read a map written by @ref save. Throws a std::runtime_error on failure.
+    static WarpMap load(const std::string & filename);
+
+private:
+    Eigen::Vector2i m_srcSize = Eigen::Vector2i::Zero(), m_dstSize = Eigen::Vector2i::Zero();
+    std::string m_description;
+
+    // the taps of output pixel i are m_taps[m_firstTap[i]] to m_taps[m_firstTap[i+1]-1]
+    std::vector<uint64_t> m_firstTap;
+    std::vector<Tap> m_taps;
+};
@@ -0,0 +1,133 @@
+/*!
+    bilateral-benchmark.cpp -- Measure the error and speed of the bilateral grid filter.
+
+    Filters a synthetic HDR image, with and without a sprinkling of black pixels, for a range of
+    sigmas. Reports the time of HDRImage::bilateralGridFiltered, the time of the exact
+    HDRImage::bilateralFiltered (for the smallest spatial sigma, where it finishes in reasonable time),
+    and the error of the grid against a brute-force bilateral filter with the same log2 luminance
+    range kernel, evaluated on a crop of the image.
+
+    Usage: bilateral-benchmark [size]
+*/
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include <algorithm>    // std::max, std::min
+#include <chrono>       // std::chrono::steady_clock
+#include <cmath>        // std::exp, std::log2, std::sin
+#include <cstdio>       // std::printf
+#include <cstdlib>      // std::atoi
+#include <random>       // std::mt19937
+#include <vector>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "HDRImage.h"
+
+using namespace std;
+
+namespace
+{
+
+const int cropSize = 128;
+
+template <typename F>
+double seconds(F f)
+{
+	auto start = chrono::steady_clock::now();
+	f();
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// smooth gradients spanning about 10 stops, a few hard edges, and some noise
+HDRImage testImage(int size, float blackFraction)
+{
+	mt19937 rng(53);
+	uniform_real_distribution<float> noise(0.9f, 1.1f), uniform(0.f, 1.f);
+	HDRImage img(size, size);
+	for (int y = 0; y < size; ++y)
+		for (int x = 0; x < size; ++x)
+		{
+			float u = x / float(size), v = y / float(size);
+			float stops = 10.f * u - 4.f + ((x / 97 + y / 131) % 2 ? 2.f : 0.f);
+			Color4 c(exp2(stops) * (0.6f + 0.4f * sin(20.f * v)), exp2(stops) * 0.8f, exp2(stops) * (1.f - 0.5f * v), 1.f);
+			img(x, y) = c * noise(rng);
+			img(x, y).a = 1.f;
+			if (uniform(rng) < blackFraction)
+				img(x, y) = Color4(0.f, 0.f, 0.f, 1.f);
+		}
+	return img;
+}
+
+float logLuminance(const Color4 & c)
+{
+	const float minLuminance = exp2(-24.f);
+	float luminance = c.luminance();
+	return log2(isfinite(luminance) ? max(luminance, minLuminance) : minLuminance);
+}
+
+// the mean relative luminance error of \a filtered against a brute-force evaluation, over a crop in the middle
+float relativeError(const HDRImage & img, const HDRImage & filtered, float sigmaRange, float sigmaDomain)
+{
+	int radius = int(ceil(3.f * sigmaDomain));
+	int c0 = (img.width() - cropSize) / 2;
+	double errorSum = 0.0;
+	for (int y = c0; y < c0 + cropSize; ++y)
+		for (int x = c0; x < c0 + cropSize; ++x)
+		{
+			float g = logLuminance(img(x, y));
+			Color4 accum(0.f, 0.f, 0.f, 0.f);
+			float weightSum = 0.f;
+			for (int dy = -radius; dy <= radius; ++dy)
+				for (int dx = -radius; dx <= radius; ++dx)
+				{
+					const Color4 & n = img.pixel(x + dx, y + dy, HDRImage::EDGE, HDRImage::EDGE);
+					float d = logLuminance(n) - g;
+					float w = exp(-(dx * dx + dy * dy) / (2.f * sigmaDomain * sigmaDomain) - d * d / (2.f * sigmaRange * sigmaRange));
+					accum += w * n;
+					weightSum += w;
+				}
+			float reference = (accum / weightSum).luminance();
+			errorSum += abs(filtered(x, y).luminance() - reference) / max(reference, 1e-3f);
+		}
+	return float(errorSum / (cropSize * cropSize));
+}
+
+} // namespace
+
+
+int main(int argc, char ** argv)
+{
+	auto console = spdlog::stdout_color_mt("console");
+	console->set_level(spdlog::level::warn);
+
+	int size = argc > 1 ? max(cropSize, atoi(argv[1])) : 1024;
+
+	struct Sigmas {float range, domain;};
+	const Sigmas sigmas[] = {{0.1f, 1.f}, {0.5f, 2.f}, {0.1f, 4.f}, {0.5f, 4.f}, {0.5f, 8.f}, {1.f, 16.f}};
+
+	printf("%dx%d pixels, error over the central %dx%d crop\n", size, size, cropSize, cropSize);
+	printf("%-8s %-10s %-12s %10s %10s %10s\n", "black", "range", "domain", "grid (s)", "exact (s)", "error");
+	for (float blackFraction : {0.f, 0.01f})
+	{
+		HDRImage img = testImage(size, blackFraction);
+		for (const auto & s : sigmas)
+		{
+			HDRImage filtered;
+			double gridTime = seconds([&]{filtered = img.bilateralGridFiltered(s.range, s.domain, AtomicProgress());});
+
+			// the exact filter's cost grows with the square of the spatial sigma
+			double exactTime = s.domain <= 1.f ?
+				seconds([&]{img.bilateralFiltered(s.range, s.domain, AtomicProgress());}) : -1.0;
+
+			float error = relativeError(img, filtered, s.range, s.domain);
+			if (exactTime >= 0.0)
+				printf("%-8g %-10g %-12g %10.3f %10.3f %10.4f\n", blackFraction, s.range, s.domain, gridTime, exactTime, error);
+			else
+				printf("%-8g %-10g %-12g %10.3f %10s %10.4f\n", blackFraction, s.range, s.domain, gridTime, "-", error);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*!
+    blur-benchmark.cpp -- Compare the speed of the horizontal and vertical passes of the blurs.
+
+    HDRImage stores rows contiguously, so a vertical pass that walked one column at a time would
+    stride a full row per tap. The vertical passes instead sweep strips of adjacent columns. This
+    times the X and Y passes of the box and Gaussian blurs on a wide, a tall and a square image,
+    and reports how much slower the Y pass is.
+
+    Usage: blur-benchmark [scale]
+
+    The images have 9 megapixels times \a scale (default 1).
+*/
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include <algorithm>    // std::sort, std::max
+#include <chrono>       // std::chrono::steady_clock
+#include <cmath>        // std::sqrt
+#include <cstdio>       // std::printf
+#include <cstdlib>      // std::atof
+#include <functional>
+#include <random>       // std::mt19937
+#include <string>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "HDRImage.h"
+
+using namespace std;
+
+namespace
+{
+
+// the median time in seconds of several runs of \a f
+double seconds(const function<void()> & f)
+{
+	vector<double> times;
+	for (int r = 0; r < 5; ++r)
+	{
+		auto start = chrono::steady_clock::now();
+		f();
+		times.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+struct Pass
+{
+	string name;
+	function<HDRImage(const HDRImage &)> x, y;
+};
+
+} // namespace
+
+
+int main(int argc, char ** argv)
+{
+	auto console = spdlog::stdout_color_mt("console");
+	console->set_level(spdlog::level::warn);
+
+	float scale = argc > 1 ? max(0.01f, float(atof(argv[1]))) : 1.f;
+	int unit = max(1, int(sqrt(scale) * 750));
+
+	// Gaussians with sigmas of 1 and 2 have 13 and 25 taps, for which convolved() picks direct convolution
+	const Pass passes[] =
+	{
+		{"box, radius 5",
+		 [](const HDRImage & img) {return img.boxBlurredX(5, AtomicProgress());},
+		 [](const HDRImage & img) {return img.boxBlurredY(5, AtomicProgress());}},
+		{"Gaussian, sigma 1",
+		 [](const HDRImage & img) {return img.GaussianBlurredX(1.f, AtomicProgress());},
+		 [](const HDRImage & img) {return img.GaussianBlurredY(1.f, AtomicProgress());}},
+		{"Gaussian, sigma 2",
+		 [](const HDRImage & img) {return img.GaussianBlurredX(2.f, AtomicProgress());},
+		 [](const HDRImage & img) {return img.GaussianBlurredY(2.f, AtomicProgress());}}
+	};
+
+	struct Size {int width, height;};
+	const Size sizes[] = {{8 * unit, 2 * unit}, {2 * unit, 8 * unit}, {4 * unit, 4 * unit}};
+
+	printf("%-12s %-20s %10s %10s %8s\n", "size", "pass", "X (s)", "Y (s)", "Y / X");
+	mt19937 rng(53);
+	uniform_real_distribution<float> uniform(0.f, 4.f);
+	for (const auto & size : sizes)
+	{
+		HDRImage img(size.width, size.height);
+		for (int y = 0; y < img.height(); ++y)
+			for (int x = 0; x < img.width(); ++x)
+				img(x, y) = Color4(uniform(rng), uniform(rng), uniform(rng), 1.f);
+
+		for (const auto & pass : passes)
+		{
+			double x = seconds([&]{pass.x(img);});
+			double y = seconds([&]{pass.y(img);});
+			printf("%-12s %-20s %10.3f %10.3f %8.2f\n", fmt::format("{}x{}", size.width, size.height).c_str(),
+			       pass.name.c_str(), x, y, y / x);
+		}
+	}
+	return 0;
+}
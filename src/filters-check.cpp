@@ -0,0 +1,122 @@
+/*!
+    filters-check.cpp -- Check properties that the HDRImage filters must preserve.
+
+    Each check prints one line and the program returns a non-zero exit code if any of them fails.
+*/
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include <algorithm>    // std::max
+#include <cmath>        // std::abs
+#include <cstdio>       // std::printf
+#include <stdexcept>    // std::invalid_argument
+#include <string>
+#include <utility>      // std::make_pair
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "HDRImage.h"
+
+using namespace std;
+
+namespace
+{
+
+int failures = 0;
+
+void report(bool passed, const string & what, const string & detail)
+{
+	printf("%-6s %s%s\n", passed ? "ok" : "FAILED", what.c_str(), detail.c_str());
+	if (!passed)
+		++failures;
+}
+
+// the largest deviation of any channel of \a img from \a value, relative to the value
+float relativeDeviation(const HDRImage & img, const Color4 & value)
+{
+	float deviation = 0.f;
+	for (int y = 0; y < img.height(); ++y)
+		for (int x = 0; x < img.width(); ++x)
+			for (int c = 0; c < 4; ++c)
+				deviation = max(deviation, abs(img(x, y)[c] - value[c]) / abs(value[c]));
+	return deviation;
+}
+
+// blurring a constant image with a border mode that extends it must leave it unchanged,
+// however large sigma gets compared to the image
+void checkRecursiveGaussianPreservesConstants()
+{
+	const Color4 value(100.f, 1.f, 0.01f, 1.f);
+	const float tolerance = 1e-4f;
+	const HDRImage::BorderMode modes[] = {HDRImage::EDGE, HDRImage::REPEAT, HDRImage::MIRROR};
+
+	for (float sigma : {100.f, 500.f, 2000.f})
+		for (auto mode : modes)
+		{
+			// one long row and one long column, so that both passes see the full sigma
+			HDRImage wide(2000, 8), tall(8, 2000);
+			wide.setConstant(value);
+			tall.setConstant(value);
+
+			float deviation = max(relativeDeviation(wide.recursiveGaussianBlurred(sigma, sigma, AtomicProgress(), mode, mode), value),
+			                      relativeDeviation(tall.recursiveGaussianBlurred(sigma, sigma, AtomicProgress(), mode, mode), value));
+
+			report(deviation <= tolerance,
+			       "recursiveGaussianBlurred preserves constants",
+			       fmt::format(" (sigma {}, {} border): relative deviation {:g}", sigma,
+			                   HDRImage::borderModeNames()[mode], deviation));
+		}
+}
+
+// the bilateral grid must keep a flat region flat next to black pixels, for both its grid and its
+// direct evaluation, and must reject sigmas it would divide by
+void checkBilateralGrid()
+{
+	const Color4 value(2.f, 1.f, 0.5f, 1.f);
+	const float tolerance = 1e-3f;
+
+	for (float sigmaDomain : {1.f, 4.f})
+	{
+		HDRImage img(96, 96);
+		img.setConstant(value);
+		img(40, 40) = img(41, 40) = Color4(0.f, 0.f, 0.f, 1.f);
+		HDRImage filtered = img.bilateralGridFiltered(0.1f, sigmaDomain, AtomicProgress());
+		filtered(40, 40) = filtered(41, 40) = value;
+
+		float deviation = relativeDeviation(filtered, value);
+		report(deviation <= tolerance,
+		       "bilateralGridFiltered keeps flat regions next to black pixels",
+		       fmt::format(" (sigma domain {}): relative deviation {:g}", sigmaDomain, deviation));
+	}
+
+	for (auto sigmas : {make_pair(0.f, 5.f), make_pair(0.1f, 0.f), make_pair(-1.f, 1.f)})
+	{
+		bool threw = false;
+		try
+		{
+			HDRImage(8, 8).bilateralGridFiltered(sigmas.first, sigmas.second, AtomicProgress());
+		}
+		catch (const invalid_argument &)
+		{
+			threw = true;
+		}
+		report(threw, "bilateralGridFiltered rejects non-positive sigmas",
+		       fmt::format(" (sigma range {}, sigma domain {})", sigmas.first, sigmas.second));
+	}
+}
+
+} // namespace
+
+
+int main()
+{
+	auto console = spdlog::stdout_color_mt("console");
+	console->set_level(spdlog::level::warn);
+
+	checkRecursiveGaussianPreservesConstants();
+	checkBilateralGrid();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/*!
+    parallel-for-benchmark.cpp -- Compare the scheduling overhead of parallel_for with that of
+    starting threads on every call.
+
+    parallel_for used to launch one std::async thread per hardware thread on every call and join
+    them all before returning. It now hands the iterations to the workers of the process-wide
+    ThreadPool. This times both on loops with a trivial body, and on a pointwise operation over
+    the rows of small images, where the per-call overhead matters most.
+
+    Usage: parallel-for-benchmark
+*/
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include <algorithm>    // std::sort
+#include <atomic>
+#include <chrono>       // std::chrono::steady_clock
+#include <cmath>        // std::pow
+#include <cstdio>       // std::printf
+#include <functional>
+#include <future>       // std::async
+#include <random>       // std::mt19937
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "HDRImage.h"
+#include "ParallelFor.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace
+{
+
+// the scheduling parallel_for used before the thread pool: fresh threads on every call
+void threadPerCallFor(int begin, int end, const function<void(int)> & body)
+{
+	atomic<int> nextIndex(begin);
+	size_t numCPUs = thread::hardware_concurrency();
+	vector<future<void>> futures(numCPUs);
+	for (size_t cpu = 0; cpu != numCPUs; ++cpu)
+		futures[cpu] = async(launch::async, [&nextIndex, end, &body]()
+		{
+			for (int i = nextIndex++; i < end; i = nextIndex++)
+				body(i);
+		});
+	for (auto & f : futures)
+		f.get();
+}
+
+void poolFor(int begin, int end, const function<void(int)> & body)
+{
+	parallel_for(begin, end, body);
+}
+
+// the median time in microseconds of one of \a calls calls to \a f, over several repetitions
+template <typename F>
+double microsecondsPerCall(int calls, F f)
+{
+	vector<double> times;
+	for (int r = 0; r < 7; ++r)
+	{
+		auto start = chrono::steady_clock::now();
+		for (int k = 0; k < calls; ++k)
+			f();
+		times.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / calls);
+	}
+	sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+} // namespace
+
+
+int main()
+{
+	auto console = spdlog::stdout_color_mt("console");
+	console->set_level(spdlog::level::warn);
+
+	printf("%u hardware threads, %d pool threads\n\n", thread::hardware_concurrency(),
+	       ThreadPool::global().numThreads());
+
+	printf("trivial body, time per call\n");
+	printf("%-10s %16s %16s\n", "items", "thread per call", "thread pool");
+	atomic<long> sink(0);
+	for (int n : {1, 16, 256, 4096})
+	{
+		auto body = [&sink](int i) {sink.fetch_add(i, memory_order_relaxed);};
+		double spawned = microsecondsPerCall(500, [&]{threadPerCallFor(0, n, body);});
+		double pooled = microsecondsPerCall(500, [&]{poolFor(0, n, body);});
+		printf("%-10d %13.2f us %13.2f us\n", n, spawned, pooled);
+	}
+
+	printf("\ngamma curve over the rows of an image, time per call\n");
+	printf("%-10s %16s %16s\n", "size", "thread per call", "thread pool");
+	mt19937 rng(53);
+	uniform_real_distribution<float> uniform(0.f, 4.f);
+	for (int size : {16, 64, 256, 1024})
+	{
+		HDRImage img(size, size), result(size, size);
+		for (int y = 0; y < size; ++y)
+			for (int x = 0; x < size; ++x)
+				img(x, y) = Color4(uniform(rng), uniform(rng), uniform(rng), 1.f);
+
+		auto row = [&img, &result](int y)
+		{
+			for (int x = 0; x < img.width(); ++x)
+			{
+				const Color4 & c = img(x, y);
+				result(x, y) = Color4(pow(c.r, 1.f / 2.2f), pow(c.g, 1.f / 2.2f), pow(c.b, 1.f / 2.2f), c.a);
+			}
+		};
+		int calls = max(5, 200000 / (size * size));
+		double spawned = microsecondsPerCall(calls, [&]{threadPerCallFor(0, size, row);});
+		double pooled = microsecondsPerCall(calls, [&]{poolFor(0, size, row);});
+		printf("%-10s %13.2f us %13.2f us\n", fmt::format("{}x{}", size, size).c_str(), spawned, pooled);
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*!
+    pixel-kernels-check.cpp -- Check that every SIMD version of the pixel kernels matches the
+    scalar version bit for bit.
+
+    Every kernel is run at each instruction set supported by the build and the CPU on a range of
+    odd lengths and unaligned starting points, so that the vector loops as well as their scalar
+    tails are exercised, and on inputs that include NaNs, infinities, negative zeros and values
+    outside [0,1]. Returns a non-zero exit code if any result differs from the scalar one.
+*/
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include <cmath>        // std::pow, std::exp
+#include <cstdio>       // std::printf
+#include <cstring>      // std::memcmp
+#include <limits>       // std::numeric_limits
+#include <random>       // std::mt19937, std::normal_distribution
+#include <vector>
+#include "PixelKernels.h"
+
+using namespace std;
+
+namespace
+{
+
+// number of floats in the input, enough for the longest run of 4-channel pixels plus an offset
+const size_t maxFloats = 4 * 1100 + 8;
+const int numBins = 256, numHistograms = 3;
+
+// lengths around every vector width and unroll factor, plus a few long odd runs
+vector<size_t> testLengths()
+{
+	vector<size_t> lengths;
+	for (size_t n = 0; n <= 67; ++n)
+		lengths.push_back(n);
+	for (size_t n : {127, 129, 255, 257, 513, 1013, 1099})
+		lengths.push_back(n);
+	return lengths;
+}
+
+vector<float> testValues()
+{
+	mt19937 rng(53);
+	normal_distribution<float> dist(0.5f, 1.f);
+	vector<float> values(maxFloats);
+	for (auto & v : values)
+		v = dist(rng);
+
+	// sprinkle special values over every channel and lane position
+	const float special[] = {numeric_limits<float>::quiet_NaN(), numeric_limits<float>::infinity(),
+	                         -numeric_limits<float>::infinity(), -0.f, 0.f, 1.f, 255.f, 1e30f};
+	for (size_t i = 0; i < values.size(); i += 13)
+		values[i] = special[(i / 13) % 8];
+	return values;
+}
+
+// the bytes produced by all kernels on one run of \a count pixels, starting \a offset floats in
+vector<unsigned char> runKernels(const vector<float> & values, const vector<float> & dither,
+                                 const vector<float> & thresholds, size_t count, size_t offset)
+{
+	vector<unsigned char> out;
+	auto append = [&out](const void * p, size_t bytes)
+	{
+		out.insert(out.end(), (const unsigned char *) p, (const unsigned char *) p + bytes);
+	};
+
+	for (int numChannels : {3, 4})
+	{
+		vector<Color4> dst(count);
+		expandToRGBA(values.data() + offset, numChannels, dst.data(), count);
+		append(dst.data(), count * sizeof(Color4));
+	}
+
+	// Color4 arrays are only ever offset by whole pixels
+	const Color4 * src = (const Color4 *) values.data() + offset / 4;
+	{
+		vector<Color4> dst(count);
+		centerScaleOffset(src, dst.data(), count, Color3(0.3f, 0.4f, 0.5f), Color3(-1.5f, 2.f, 3.f), Color3(0.5f));
+		append(dst.data(), count * sizeof(Color4));
+
+		// in place
+		vector<Color4> inPlace(src, src + count);
+		centerScaleOffset(inPlace.data(), inPlace.data(), count, Color3(1.f), Color3(-1.f), Color3(0.f));
+		append(inPlace.data(), count * sizeof(Color4));
+	}
+
+	for (const float * d : {(const float *) nullptr, dither.data()})
+	{
+		vector<uint8_t> dst(3 * count);
+		quantizeToRGB8(src, dst.data(), count, d);
+		append(dst.data(), dst.size());
+	}
+
+	{
+		vector<uint32_t> counts(numBins * numHistograms, 0);
+		float sum = accumulateHistograms(values.data() + offset, count, 1.7f, numBins,
+		                                 thresholds.data(), numHistograms, counts.data());
+		append(counts.data(), counts.size() * sizeof(uint32_t));
+		append(&sum, sizeof(sum));
+	}
+
+	return out;
+}
+
+} // namespace
+
+
+int main()
+{
+	vector<float> values = testValues();
+
+	mt19937 rng(1);
+	vector<float> dither(256);
+	for (auto & d : dither)
+		d = (rng() % 65536 / 65536.f - 0.5f) / 255.f;
+
+	vector<float> thresholds(numHistograms * (numBins - 1));
+	for (int k = 0; k < numBins - 1; ++k)
+	{
+		float x = (k + 1) / float(numBins);
+		thresholds[k] = x;
+		thresholds[(numBins - 1) + k] = pow(x, 2.2f);
+		thresholds[2 * (numBins - 1) + k] = exp(k * 0.02f) - 1.f;
+	}
+
+	vector<size_t> lengths = testLengths();
+	const size_t offsets[] = {0, 1, 3, 4, 5};
+
+	// the reference results
+	vector<vector<unsigned char>> expected;
+	setSIMDLevel(SCALAR_SIMD);
+	for (size_t count : lengths)
+		for (size_t offset : offsets)
+			expected.push_back(runKernels(values, dither, thresholds, count, offset));
+
+	int failures = 0;
+	for (int l = SSE2_SIMD; l <= AVX2_SIMD; ++l)
+	{
+		ESIMDLevel level = ESIMDLevel(l);
+		setSIMDLevel(level);
+		if (activeSIMDLevel() != level)
+		{
+			printf("%-6s skipped, not supported by this build or CPU\n", simdLevelName(level));
+			continue;
+		}
+
+		int mismatches = 0, run = 0;
+		for (size_t count : lengths)
+			for (size_t offset : offsets)
+			{
+				if (runKernels(values, dither, thresholds, count, offset) != expected[run++])
+				{
+					if (mismatches++ < 10)
+						printf("%-6s differs from scalar for %zu pixels at offset %zu\n",
+						       simdLevelName(level), count, offset);
+				}
+			}
+
+		printf("%-6s %s (%d runs, %d mismatches)\n", simdLevelName(level),
+		       mismatches ? "FAILED" : "ok", run, mismatches);
+		failures += mismatches;
+	}
+
+	setSIMDLevel(supportedSIMDLevel());
+	return failures ? 1 : 0;
+}